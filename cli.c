@@ -29,7 +29,7 @@ cli_flag_arg *new_cli_flag_arg() {
 
 void append_cli_flag_arg(cli_flag_arg *dst, cli_flag_arg *src) {
     cli_flag_arg *end = dst;
-    while (dst->next != NULL) {
+    while (end->next != NULL) {
         end = end->next;
     }
     end->next = src;
@@ -42,18 +42,20 @@ cli_user_args *cli_new_user_args() {
     }
     memset(a, 0, sizeof(cli_user_args));
     a->comment_flags = NULL;
+    a->application_flags = NULL;
     a->output_flag = NULL;
-    a->filename = NULL;
+    a->jobs_flag = NULL;
+    a->queue_flag = NULL;
+    a->index_flag = NULL;
+    a->query_flag = NULL;
+    a->checkpoint_flag = NULL;
+    a->format_flag = NULL;
+    a->server_flag = NULL;
+    a->inputs = NULL;
     return a;
 }
 
-void cli_free_user_args(cli_user_args *a) {
-    // free filename field
-    if (a != NULL && a->filename != NULL)
-        free(a->filename);
-
-    // free comments linked list
-    cli_flag_arg *item = a->comment_flags;
+void free_cli_flag_args(cli_flag_arg *item) {
     while (item != NULL) {
         if (item->string != NULL) {
             free(item->string);
@@ -62,10 +64,27 @@ void cli_free_user_args(cli_user_args *a) {
         item = item->next;
         free(to_free);
     } 
+}
+
+void cli_free_user_args(cli_user_args *a) {
+    if (a == NULL)
+        return;
+
+    // free linked lists
+    free_cli_flag_args(a->comment_flags);
+    free_cli_flag_args(a->application_flags);
+    free_cli_flag_args(a->output_flag);
+    free_cli_flag_args(a->jobs_flag);
+    free_cli_flag_args(a->queue_flag);
+    free_cli_flag_args(a->index_flag);
+    free_cli_flag_args(a->query_flag);
+    free_cli_flag_args(a->checkpoint_flag);
+    free_cli_flag_args(a->format_flag);
+    free_cli_flag_args(a->server_flag);
+    free_cli_flag_args(a->inputs);
 
     // free whole struct
-    if (a != NULL)
-        free(a);
+    free(a);
 }
 
 int cli_parse(cli_user_args *a, int argc, char **argv) {
@@ -83,12 +102,13 @@ int cli_parse(cli_user_args *a, int argc, char **argv) {
 
         // if awaiting flag arg, capture
         if (awaiting_flag_arg != NULL) {
-            awaiting_flag_arg->string = malloc(arg_len);
+            awaiting_flag_arg->string = malloc(arg_len + 1);
             if (awaiting_flag_arg->string == NULL) {
                 return CLI_ALLOC_FAILURE;
             }
             awaiting_flag_arg->string_len = arg_len;
             strncpy(awaiting_flag_arg->string, arg, arg_len);
+            awaiting_flag_arg->string[arg_len] = '\0';
 
             awaiting_flag_arg = NULL;
             a->invalid_flag = 0;
@@ -112,6 +132,128 @@ int cli_parse(cli_user_args *a, int argc, char **argv) {
                 case 'd':
                     a->debug_flag = 1;
                     break;
+                case 'm':
+                    a->mmap_flag = 1;
+                    break;
+                case 'l':
+                    a->list_flag = 1;
+                    break;
+                case '0':
+                    a->list_flag = 1;
+                    a->null_flag = 1;
+                    break;
+                case 'u':
+                    a->unordered_flag = 1;
+                    break;
+                case 'i':
+                    a->in_place_flag = 1;
+                    break;
+                case 'k':
+                    a->keep_flag = 1;
+                    break;
+                case 's':
+                    a->scrub_flag = 1;
+                    break;
+                case 'D':
+                    a->dedupe_flag = 1;
+                    break;
+                case 't':
+                    a->timeline_flag = 1;
+                    break;
+                case 'p':
+                    a->pixels_flag = 1;
+                    break;
+                case 'x':
+                    // an application to scrub, implies the scrub flag
+                    a->scrub_flag = 1;
+                    awaiting_flag_arg = new_cli_flag_arg();
+                    if (awaiting_flag_arg == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    if (a->application_flags != NULL) {
+                        append_cli_flag_arg(a->application_flags, awaiting_flag_arg);
+                    } else {
+                        a->application_flags = awaiting_flag_arg;
+                    }
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'j':
+                    if (a->jobs_flag != NULL) {
+                        free_cli_flag_args(a->jobs_flag);
+                    }
+                    a->jobs_flag = new_cli_flag_arg();
+                    if (a->jobs_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->jobs_flag;
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'Q':
+                    if (a->queue_flag != NULL) {
+                        free_cli_flag_args(a->queue_flag);
+                    }
+                    a->queue_flag = new_cli_flag_arg();
+                    if (a->queue_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->queue_flag;
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'I':
+                    if (a->index_flag != NULL) {
+                        free_cli_flag_args(a->index_flag);
+                    }
+                    a->index_flag = new_cli_flag_arg();
+                    if (a->index_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->index_flag;
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'q':
+                    if (a->query_flag != NULL) {
+                        free_cli_flag_args(a->query_flag);
+                    }
+                    a->query_flag = new_cli_flag_arg();
+                    if (a->query_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->query_flag;
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'r':
+                    if (a->checkpoint_flag != NULL) {
+                        free_cli_flag_args(a->checkpoint_flag);
+                    }
+                    a->checkpoint_flag = new_cli_flag_arg();
+                    if (a->checkpoint_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->checkpoint_flag;
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'f':
+                    if (a->format_flag != NULL) {
+                        free_cli_flag_args(a->format_flag);
+                    }
+                    a->format_flag = new_cli_flag_arg();
+                    if (a->format_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->format_flag;
+                    a->invalid_flag = flag_c;
+                    break;
+                case 'S':
+                    if (a->server_flag != NULL) {
+                        free_cli_flag_args(a->server_flag);
+                    }
+                    a->server_flag = new_cli_flag_arg();
+                    if (a->server_flag == NULL) {
+                        return CLI_ALLOC_FAILURE;
+                    }
+                    awaiting_flag_arg = a->server_flag;
+                    a->invalid_flag = flag_c;
+                    break;
                 case 'c':
                     awaiting_flag_arg = new_cli_flag_arg();
                     if (awaiting_flag_arg == NULL) {
@@ -128,7 +270,7 @@ int cli_parse(cli_user_args *a, int argc, char **argv) {
                     break;
                 case 'o':
                     if (a->output_flag != NULL) {
-                        printf("ERROR more than one output provided\n");
+                        return CLI_MULTIPLE_OUTPUTS;
                     }
                     a->output_flag = new_cli_flag_arg();
                     if (a->output_flag == NULL) {
@@ -142,20 +284,25 @@ int cli_parse(cli_user_args *a, int argc, char **argv) {
                 }
             }
         } else {
-            // filename
-            if (a->filename != NULL) {
-                return CLI_MULTIPLE_INPUTS;
+            // input path, copied to its own buffer
+            cli_flag_arg *input = new_cli_flag_arg();
+            if (input == NULL) {
+                return CLI_ALLOC_FAILURE;
             }
-            // copy the filename to its own buffer
-            size_t filename_size = arg_len + 1;
-            char *filename = malloc(filename_size);
-            if (filename == NULL) {
+            if (a->inputs != NULL) {
+                append_cli_flag_arg(a->inputs, input);
+            } else {
+                a->inputs = input;
+            }
+            a->input_count++;
+
+            input->string = malloc(arg_len + 1);
+            if (input->string == NULL) {
                 return CLI_ALLOC_FAILURE;
             }
-            strncpy(filename, arg, filename_size);
-            filename[filename_size-1] = '\0';
-            a->filename = filename;
-            a->filename_size = filename_size;
+            strncpy(input->string, arg, arg_len);
+            input->string[arg_len] = '\0';
+            input->string_len = arg_len;
         }
     }
 
@@ -163,6 +310,13 @@ int cli_parse(cli_user_args *a, int argc, char **argv) {
         return CLI_MISSING_FLAG_ARG;
     }
 
+    // writing an output is only supported for a single input, in-place
+    // edits write to each input instead
+    int writing = (a->comment_flags != NULL && !a->in_place_flag) || a->output_flag != NULL || a->scrub_flag;
+    if (writing && (a->input_count > 1 || a->list_flag)) {
+        return CLI_MULTIPLE_INPUTS;
+    }
+
     return CLI_SUCCESS;
 }
 
@@ -42,13 +42,48 @@ typedef struct cli_user_args {
     int verbose_flag;
     int debug_flag;
     int help_flag;
+    int mmap_flag;
+    // read input paths from stdin, delimited by newlines or with the null
+    // flag by NUL characters
+    int list_flag;
+    int null_flag;
+    // print batch results as files finish rather than in input order
+    int unordered_flag;
+    // write comments into the inputs, keeping their existing comments
+    // with the keep flag
+    int in_place_flag;
+    int keep_flag;
+    // remove comments, plain text and application extensions, only those
+    // with the identifiers given as application flags when there are any
+    int scrub_flag;
+    // reuse the results of files with identical content and report them
+    int dedupe_flag;
+    // print frame count, duration and frame rate, and every frame with -a
+    int timeline_flag;
+    // decode every frame and print its pixel count, checksum and colors
+    int pixels_flag;
     cli_flag_arg *comment_flags;
+    cli_flag_arg *application_flags;
     cli_flag_arg *output_flag;
+    cli_flag_arg *jobs_flag;
+    // reads kept in flight across the files of a batch
+    cli_flag_arg *queue_flag;
+    // index file answering unchanged files without parsing them
+    cli_flag_arg *index_flag;
+    // fields to print, reading each file only as far as they are found
+    cli_flag_arg *query_flag;
+    // parser state file to resume a read from and save it to
+    cli_flag_arg *checkpoint_flag;
+    // text, or a structured format for loading the results elsewhere
+    cli_flag_arg *format_flag;
+    // unix socket to answer requests on instead of scanning inputs
+    cli_flag_arg *server_flag;
 
     char invalid_flag;
 
-    char *filename;
-    size_t filename_size;
+    // input paths in the order given, files or directories
+    cli_flag_arg *inputs;
+    size_t input_count;
 } cli_user_args;
 
 cli_user_args *cli_new_user_args();
@@ -17,60 +17,386 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <math.h>
+#include <string.h>
+#include <time.h>
 
 #include "gifmetadata.h"
 
+// parse modes are the parser flags, with PARSE_STATE_CB when there is a
+// state callback. the parse loop is compiled once for each mode in
+// parse_variants with the mode a constant, so that whatever it leaves out
+// costs nothing, and once more for every other mode
+#define PARSE_STATE_CB 0x40
+#define PARSE_MODES 0x80
+
+#define SKIP_MODE(mode) ((mode) & GIFMETADATA_FLAG_SKIP)
+#define ZERO_COPY_MODE(mode) ((mode) & GIFMETADATA_FLAG_ZERO_COPY)
+#define STREAM_MODE(mode) ((mode) & GIFMETADATA_FLAG_STREAM_PAYLOAD)
+#define STATS_MODE(mode) ((mode) & GIFMETADATA_FLAG_STATS)
+#define DECODE_MODE(mode) ((mode) & GIFMETADATA_FLAG_DECODE)
+#define TIMING_MODE(mode) (((mode) & (GIFMETADATA_FLAG_STATS | GIFMETADATA_FLAG_STATS_TIMING)) == (GIFMETADATA_FLAG_STATS | GIFMETADATA_FLAG_STATS_TIMING))
+// bytes that are neither counted nor reported to state_cb one at a time are
+// passed over in runs, as with GIFMETADATA_FLAG_SKIP
+#define RUN_MODE(mode) (SKIP_MODE(mode) || !((mode) & (PARSE_STATE_CB | GIFMETADATA_FLAG_STATS)))
+
+#define STAT(mode, s, counter) if (STATS_MODE(mode)) (s)->stats.counter++
+
 // IMPORTANT this should be called as it encounters the byte, not pre-emptively
-#define CALL_STATE_CB(cb, s) if (cb != NULL) cb(s, s->read_state)
+#define CALL_STATE_CB(mode, cb, s) if ((mode) & PARSE_STATE_CB) { STAT(mode, s, state_callbacks); cb->state_cb(cb->user, s, s->read_state); }
+
+// marks a queried field as found, the parse returns after the current byte
+// once every queried field has been
+#define QUERY_FOUND(s, field) if ((s)->query & (field)) { (s)->query_found |= (field); satisfied = (s)->query_found == (s)->query; }
 
 const char gif_sig[] = { 'G', 'I', 'F', '8', 'x', 'a' };
 
-int gifmetadata_parse_gif(
+// state entered on the byte that starts a block, any other byte is passed
+// over while searching
+static const unsigned char block_states[256] = {
+    [0 ... 0xff] = searching,
+    [0x21] = extension,
+    [0x2c] = image_descriptor,
+    [0x3b] = trailer,
+};
+
+static uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// closes the current timing phase, charging it to state
+static void stats_phase(gifmetadata_state *s, enum gifmetadata_read_state state) {
+    uint64_t t = stats_now();
+    s->stats.state_ns[state] += t - s->stats_phase_ns;
+    s->stats_phase_ns = t;
+}
+
+// accounts the byte just parsed in state with GIFMETADATA_FLAG_STATS
+static void stats_byte(gifmetadata_state *s, enum gifmetadata_read_state state) {
+    s->stats.state_bytes[state]++;
+    // a skipped run belongs to the state that set it up, except for plain
+    // text sub-blocks which are passed over as an unknown extension
+    if (s->skip_len > 0)
+        s->skip_state = s->read_state == unknown_extension ? unknown_extension : state;
+    if (s->read_state == state)
+        return;
+
+    if (state == searching) {
+        s->stats.blocks++;
+        if (s->read_state == image_descriptor)
+            s->stats.frames++;
+    }
+    if (TIMING_MODE(s->flags))
+        stats_phase(s, state);
+}
+
+// delivers a payload event with GIFMETADATA_FLAG_STREAM_PAYLOAD, begin and end
+// carry the type of the extension and data the type of its sub-block
+static void emit_payload(
     gifmetadata_state *s,
-    unsigned char *chunk,
-    size_t chunk_len,
-    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
-    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state)) {
+    const gifmetadata_callbacks *cb,
+    enum gifmetadata_payload_event event,
+    unsigned char *buffer,
+    size_t buffer_len) {
 
-    s->chunk = chunk;
-    s->chunk_len = chunk_len;
+    if (cb->payload_cb == NULL)
+        return;
+
+    gifmetadata_payload payload;
+    payload.event = event;
+    payload.type = s->local_extension_type;
+    if (event != payload_data && payload.type == application_subblock)
+        payload.type = application;
+    payload.subblock = s->payload_subblock;
+    payload.buffer = buffer;
+    payload.buffer_len = buffer_len;
+    if (buffer != NULL)
+        payload.offset = s->chunk_file_i + (buffer - s->chunk);
+    else
+        payload.offset = s->file_i - 1;
+    STAT(s->flags, s, payload_callbacks);
+    cb->payload_cb(cb->user, s, &payload);
+}
+
+// delivers the bytes of the current sub-block that arrived in this chunk
+static void flush_payload(gifmetadata_state *s, const gifmetadata_callbacks *cb) {
+    size_t len = s->scratchpad_i - s->payload_flushed;
+    if (len > 0)
+        emit_payload(s, cb, payload_data, s->chunk + s->payload_chunk_i, len);
+    s->payload_flushed = s->scratchpad_i;
+}
+
+// sub-blocks this far ahead are prefetched while hopping, encoders almost
+// always write image data as full 255 byte sub-blocks so the size bytes to
+// come lie at multiples of 256
+#define WALK_PREFETCH_HOPS 8
+
+size_t gifmetadata_walk_subblocks(
+    const unsigned char *buffer,
+    size_t buffer_len,
+    size_t i,
+    size_t *rest,
+    unsigned char *last_len,
+    size_t *hops) {
+
+    size_t n = 0;
+
+    // every hop is at most 256 bytes, so while this far from the end four
+    // hops can be taken without bounds checks. the hops depend on each other
+    // so there is nothing to vectorise, the unrolling only keeps the loop
+    // overhead and the prefetches off the chain
+    while (i + 4 * 256 < buffer_len) {
+        __builtin_prefetch(buffer + i + WALK_PREFETCH_HOPS * 256);
+        unsigned char len;
+        if ((len = buffer[i]) == 0)
+            goto terminator;
+        i += len + 1;
+        if ((len = buffer[i]) == 0) {
+            n += 1;
+            goto terminator;
+        }
+        i += len + 1;
+        if ((len = buffer[i]) == 0) {
+            n += 2;
+            goto terminator;
+        }
+        i += len + 1;
+        if ((len = buffer[i]) == 0) {
+            n += 3;
+            goto terminator;
+        }
+        i += len + 1;
+        n += 4;
+    }
+
+    while (i < buffer_len) {
+        unsigned char len = buffer[i];
+        if (len == 0)
+            goto terminator;
+        *last_len = len;
+        i += len + 1;
+        n++;
+    }
+
+    *hops += n;
+    *rest = i - buffer_len;
+    return buffer_len;
+
+terminator:
+    *hops += n;
+    return i;
+}
+
+// skips image data from the sub-block size byte at chunk index i, returning
+// the index of the last byte consumed. stops at the terminator or leaves
+// skip_len set to the rest of a sub-block that continues past the chunk
+static size_t skip_image_data(gifmetadata_state *s, size_t i) {
+    size_t rest = 0;
+    unsigned char last_len = 0;
+    size_t hops = 0;
+    size_t end = gifmetadata_walk_subblocks(s->chunk, s->chunk_len, i, &rest, &last_len, &hops);
+
+    if (end < s->chunk_len) {
+        s->read_state = searching;
+    } else {
+        end = s->chunk_len - 1;
+        s->skip_len = rest;
+        s->scratchpad_len = last_len;
+        s->scratchpad_i = last_len;
+    }
+    if (STATS_MODE(s->flags)) {
+        // the byte at i is counted by the parse loop
+        s->stats.state_bytes[image_data] += end - i;
+        s->stats.subblocks += hops;
+    }
+    s->file_i += end - i;
+    s->chunk_i = end;
+    return end;
+}
+
+// starts decoding the frame whose lzw minimum code size is byte
+static void begin_decode(gifmetadata_state *s, unsigned char byte) {
+    gifmetadata_lzw_begin(s->lzw, byte, s->frames - 1, s->frame_pixels);
+}
+
+static void end_decode(gifmetadata_state *s, const gifmetadata_callbacks *cb) {
+    gifmetadata_lzw_end(s->lzw);
+    if (cb->decode_cb != NULL)
+        cb->decode_cb(cb->user, s, &s->lzw->result);
+}
+
+// image data with GIFMETADATA_FLAG_DECODE, the byte at chunk index i is read
+// the same way as without the flag but the data of a sub-block is fed to the
+// decoder in one run. returns the index of the last byte consumed
+static size_t decode_image_data(gifmetadata_state *s, const gifmetadata_callbacks *cb, size_t i) {
+    unsigned char byte = s->chunk[i];
+    if (s->scratchpad_len == 0 && s->scratchpad_i == 0) {
+        // lzw minimum code size, the first sub-block size follows
+        begin_decode(s, byte);
+        s->scratchpad_i = 1;
+        return i;
+    }
+    if (s->scratchpad_len == 0 ? s->scratchpad_i == 1 : s->scratchpad_i >= s->scratchpad_len) {
+        if (byte == 0) {
+            end_decode(s, cb);
+            s->read_state = searching;
+        } else {
+            s->scratchpad_i = 0;
+            s->scratchpad_len = byte;
+            STAT(s->flags, s, subblocks);
+        }
+        return i;
+    }
+
+    size_t n = s->scratchpad_len - s->scratchpad_i;
+    if (n > s->chunk_len - i)
+        n = s->chunk_len - i;
+    gifmetadata_lzw_feed(s->lzw, s->chunk + i, n);
+    s->scratchpad_i += n;
+    // the byte at i is counted by the parse loop
+    if (STATS_MODE(s->flags))
+        s->stats.state_bytes[image_data] += n - 1;
+    s->file_i += n - 1;
+    s->chunk_i = i + n - 1;
+    return i + n - 1;
+}
+
+void gifmetadata_parse_end(gifmetadata_state *s, const gifmetadata_callbacks *cb) {
+    if (s->lzw != NULL && s->lzw->active)
+        end_decode(s, cb);
+}
+
+// keeps the bytes of an application extension that the loop count is read
+// from, n bytes read at the current sub-block position
+static void collect_loop_bytes(gifmetadata_state *s, const unsigned char *data, size_t n) {
+    size_t at, limit;
+    if (s->local_extension_type == application) {
+        at = 0;
+        limit = GIFMETADATA_LOOP_ID_LEN;
+    } else if (s->loop_extension && s->payload_subblock == 1) {
+        at = GIFMETADATA_LOOP_ID_LEN;
+        limit = 3;
+    } else {
+        return;
+    }
+    for (size_t j = 0; j < n && s->scratchpad_i + j < limit; j++)
+        s->loop_bytes[at + s->scratchpad_i + j] = data[j];
+}
+
+// takes the extension payload from chunk index i to the end of its sub-block
+// or the chunk in one go, a comment running on past its size up to its
+// first zero byte as in known_extension below. returns the index of the
+// last byte consumed, or sets *status when a comment outgrows the scratchpad
+static size_t payload_run(gifmetadata_state *s, size_t i, int *status) {
+    size_t avail = s->chunk_len - i;
+    size_t n = 0;
+    if (s->scratchpad_i < s->scratchpad_len) {
+        n = s->scratchpad_len - s->scratchpad_i;
+        if (n > avail)
+            n = avail;
+    }
+    if (s->local_extension_type == comment && n < avail) {
+        const unsigned char *zero = memchr(s->chunk + i + n, 0, avail - n);
+        n = zero != NULL ? (size_t)(zero - (s->chunk + i)) : avail;
+    }
+
+    size_t end = s->scratchpad_i + n;
+    // streamed comments are not bound by the scratchpad
+    if (s->local_extension_type == comment && end >= SCRATCHPAD_CHUNK_SIZE * 10 &&
+        (s->payload_chunk_i < 0 || !STREAM_MODE(s->flags))) {
+        // stop on the byte that a byte by byte parse would have
+        size_t last = SCRATCHPAD_CHUNK_SIZE * 10 - 1 - s->scratchpad_i;
+        s->file_i += last;
+        s->chunk_i = i + last;
+        *status = GIFMETADATA_COMMENT_EXCEEDS_BOUNDS;
+        return i + last;
+    }
+    collect_loop_bytes(s, s->chunk + i, n);
+    if (s->payload_chunk_i < 0) {
+        // copied, only comments outgrow the first scratchpad
+        if (end >= s->scratchpad_size) {
+            size_t size = (end / SCRATCHPAD_CHUNK_SIZE + 1) * SCRATCHPAD_CHUNK_SIZE;
+            unsigned char *scratchpad = s->allocator->resize(s->allocator->user, s->scratchpad, s->scratchpad_size, size);
+            if (scratchpad == NULL) {
+                *status = GIFMETADATA_ALLOC_FAILED;
+                return i;
+            }
+            s->scratchpad = scratchpad;
+            s->scratchpad_size = size;
+        }
+        memcpy(s->scratchpad + s->scratchpad_i, s->chunk + i, n);
+    }
+
+    // the byte at i is counted by the parse loop
+    s->scratchpad_i = end;
+    s->file_i += n - 1;
+    s->chunk_i = i + n - 1;
+    return i + n - 1;
+}
+
+// parses the chunk set on the state in the given parse mode, inlined into
+// every variant so that the mode is known at compile time
+static inline __attribute__((always_inline)) int parse_chunk(
+    gifmetadata_state *s,
+    const gifmetadata_callbacks *cb,
+    const unsigned int mode) {
+
+    unsigned char *chunk = s->chunk;
+    size_t chunk_len = s->chunk_len;
+    int satisfied = 0;
+
+    for (size_t i = 0; i < chunk_len; i++) {
+        if (s->skip_len > 0) {
+            // jump to the end of the ignored run or the end of the chunk,
+            // whichever comes first
+            size_t n = chunk_len - i;
+            if (n > s->skip_len)
+                n = s->skip_len;
+            s->skip_len -= n;
+            s->file_i += n;
+            if (STATS_MODE(mode))
+                s->stats.state_bytes[s->skip_state] += n;
+            i += n;
+            if (i >= chunk_len)
+                break;
+        }
 
-    for (int i = 0; i < chunk_len; i++) {
         s->file_i++;
         unsigned char byte = chunk[i];
         s->chunk_i = i;
        
-        if (s->read_state == header) {
+        enum gifmetadata_read_state byte_state = s->read_state;
+        switch (byte_state) {
+        case header:
             // loading header bytes into scratchpad until complete
             s->scratchpad[s->scratchpad_i++] = byte;
-            if (s->scratchpad_i > 6) {
-
-                unsigned char sig_byte;
-                for (int j = 0; j < 6; j++) {
-                    sig_byte = s->scratchpad[j];
-                    if (j == 4) {
-                        if (sig_byte == 0x37)
-                            s->gif_version = gif87a;
-                        else if (sig_byte == 0x39)
-                            s->gif_version = gif89a;
-                        else
-                            return GIFMETADATA_INVALID_SIG;
-                    } else if (sig_byte != gif_sig[j]) {
-                        return GIFMETADATA_INVALID_SIG; 
-                    }
-                }
+            if (s->scratchpad_i <= 6)
+                break;
 
-                s->scratchpad_i = 0;
-                s->read_state = logical_screen_descriptor;
-                // next byte will be the lsd
-                s->local_lsd_state = 0;
+            unsigned char sig_byte;
+            for (int j = 0; j < 6; j++) {
+                sig_byte = s->scratchpad[j];
+                if (j == 4) {
+                    if (sig_byte == 0x37)
+                        s->gif_version = gif87a;
+                    else if (sig_byte == 0x39)
+                        s->gif_version = gif89a;
+                    else
+                        return GIFMETADATA_INVALID_SIG;
+                } else if (sig_byte != gif_sig[j]) {
+                    return GIFMETADATA_INVALID_SIG; 
+                }
             }
-        }
-        
-        switch (s->read_state) {
+
+            // this byte is the first of the lsd
+            s->scratchpad_i = 0;
+            s->read_state = logical_screen_descriptor;
+            s->local_lsd_state = 0;
+            byte_state = logical_screen_descriptor;
+            // fall through
         case logical_screen_descriptor:
-            CALL_STATE_CB(state_cb, s); 
+            CALL_STATE_CB(mode, cb, s); 
             switch (s->local_lsd_state) {
             case width:
             case height:
@@ -85,6 +411,7 @@ int gifmetadata_parse_gif(
                     } else {
                         s->canvas_height = result;
                         s->local_lsd_state = packed;
+                        QUERY_FOUND(s, GIFMETADATA_QUERY_DIMENSIONS);
                     }
                 }
                 break;
@@ -94,12 +421,14 @@ int gifmetadata_parse_gif(
                 if (s->global_color_table_flag) {
                     s->color_resolution = (byte >> 4) & 0b111;
                     s->color_table_size = byte & 0b111;
-                    s->color_table_len = 3 * pow(2, s->color_table_size+1);
+                    s->color_table_len = 3 << (s->color_table_size + 1);
                     
                     // use the scratchpad index as color table index
                     s->scratchpad_i = 0;
                     s->read_state = global_color_table;
                 } else {
+                    // background color index and pixel aspect ratio
+                    s->skip_len = 2;
                     s->read_state = searching;
                 }
                 
@@ -110,7 +439,14 @@ int gifmetadata_parse_gif(
             
             break;
         case global_color_table:
-            CALL_STATE_CB(state_cb, s);
+            CALL_STATE_CB(mode, cb, s);
+            if (RUN_MODE(mode)) {
+                // the table is preceded by the background color index and
+                // pixel aspect ratio, the current byte being one of them
+                s->skip_len = s->color_table_len + 1 - s->scratchpad_i;
+                s->read_state = searching;
+                break;
+            }
             // loop through the global color table, ignoring the contents
             if (s->color_table_len < s->scratchpad_i) {
                 s->read_state = searching;
@@ -118,61 +454,66 @@ int gifmetadata_parse_gif(
             s->scratchpad_i++;
             break;
         case searching:
-            //CALL_STATE_CB(state_cb, s);
+            s->block_file_i = s->file_i - 1;
 
-            // the following CALL_STATE_CB are not considered pre-emptive as it
-            // is byte matching, hence marking the actual start of the block
-            switch (byte) {
-            case 0x21:
-                s->read_state = extension;
-                CALL_STATE_CB(state_cb, s);
+            // if this were a real gif parser you would terminate at the
+            // trailer but i'm speculating that at least one gif has been
+            // made with comment data coming after the trailer as a mistake
+            // or easter egg. unknown bytes have never occured but are passed
+            // over to avoid the potential
+            s->read_state = block_states[byte];
+            if (s->read_state == searching)
                 break;
-            case 0x2c:
-                s->read_state = image_descriptor;
-                CALL_STATE_CB(state_cb, s);
+            // not pre-emptive as it is byte matching, hence marking the
+            // actual start of the block
+            CALL_STATE_CB(mode, cb, s);
+            if (s->read_state == image_descriptor) {
                 s->scratchpad_i = 0;
                 s->scratchpad_len = 0;
-                break;
-            case 0x3b:
-                // if this were a real gif parser you would terminate here
-                // but i'm speculating that at least one gif
-                // has been made with comment data coming after
-                // the trailer as a mistake or easter egg
-                s->read_state = trailer;
-                CALL_STATE_CB(state_cb, s);
-                break;
-            default:
-                // unknown byte
-                // again, this has never occured but persists to avoid the potential
-                break;
             }
             break;
         case extension:
             s->scratchpad_i = 0;
             s->scratchpad_len = 0;
+            s->payload_flushed = 0;
+            s->payload_subblock = 0;
             s->read_state = known_extension;
             switch (byte) {
                 case 0x01:
                     s->local_extension_type = plain_text;
-                    CALL_STATE_CB(state_cb, s);
+                    CALL_STATE_CB(mode, cb, s);
+                    if (STREAM_MODE(mode))
+                        emit_payload(s, cb, payload_begin, NULL, 0);
                     break;
                 case 0xff:
                     s->local_extension_type = application;
-                    CALL_STATE_CB(state_cb, s);
+                    s->loop_extension = 0;
+                    CALL_STATE_CB(mode, cb, s);
+                    if (STREAM_MODE(mode))
+                        emit_payload(s, cb, payload_begin, NULL, 0);
                     break;
                 case 0xfe:
                     s->local_extension_type = comment;
-                    CALL_STATE_CB(state_cb, s);
+                    CALL_STATE_CB(mode, cb, s);
+                    if (STREAM_MODE(mode))
+                        emit_payload(s, cb, payload_begin, NULL, 0);
+                    break;
+                case 0xf9:
+                    s->read_state = control_extension;
+                    CALL_STATE_CB(mode, cb, s);
                     break;
                 default:
                     s->scratchpad_i = 0;
                     s->scratchpad_len = 0;
                     s->read_state = unknown_extension;
-                    CALL_STATE_CB(state_cb, s);
+                    CALL_STATE_CB(mode, cb, s);
                     break;
             }
             break;
-        case unknown_extension:
+        case control_extension:
+            // packed fields, delay and transparent color index are kept for
+            // the next frame, sub-blocks after the first are passed over as
+            // an unknown extension
             if (s->scratchpad_len == 0) {
                 if (byte == 0) {
                     s->read_state = searching;
@@ -180,12 +521,54 @@ int gifmetadata_parse_gif(
                 }
                 s->scratchpad_len = byte;
                 s->scratchpad_i = 0;
-            } else {
-                if (byte == 0x0 && s->scratchpad_i >= s->scratchpad_len) {
+                s->frame.has_control = 1;
+                STAT(mode, s, subblocks);
+                break;
+            }
+            switch (s->scratchpad_i++) {
+            case 0:
+                s->frame.disposal = (byte >> 2) & 0b111;
+                s->frame.user_input = (byte >> 1) & 1;
+                // the index follows, any other byte means no transparency
+                s->frame.transparent_index = byte & 1 ? 0 : -1;
+                break;
+            case 1:
+                s->frame.delay = byte;
+                break;
+            case 2:
+                s->frame.delay |= byte << 8;
+                break;
+            case 3:
+                if (s->frame.transparent_index == 0)
+                    s->frame.transparent_index = byte;
+                break;
+            }
+            if (s->scratchpad_i >= s->scratchpad_len) {
+                s->scratchpad_i = 0;
+                s->scratchpad_len = 0;
+                s->read_state = unknown_extension;
+            }
+            break;
+        case unknown_extension:
+            if (s->scratchpad_i >= s->scratchpad_len) {
+                // sub-block size, zero terminates the extension
+                if (byte == 0) {
+                    // the text sub-blocks of a plain text extension are
+                    // counted from one, see below
+                    if (STREAM_MODE(mode) && s->local_extension_type == plain_text && s->payload_subblock > 0)
+                        emit_payload(s, cb, payload_end, NULL, 0);
                     s->read_state = searching;
-                } else {
-                    s->scratchpad_i++;
-                }	
+                    break;
+                }
+                s->scratchpad_len = byte;
+                s->scratchpad_i = 0;
+                STAT(mode, s, subblocks);
+                if (RUN_MODE(mode)) {
+                    s->skip_len = byte;
+                    s->scratchpad_i = byte;
+                }
+            } else {
+                s->scratchpad_i++;
             }
             break;
         case known_extension:
@@ -195,12 +578,17 @@ int gifmetadata_parse_gif(
                 // if the new size of the block is
                 // zero then terminate
                 if (byte == 0) {
+                    if (STREAM_MODE(mode))
+                        emit_payload(s, cb, payload_end, NULL, 0);
                     s->read_state = searching;
                     break;
                 }
                 // else get ready for a new block
                 s->scratchpad_len = byte;
                 s->scratchpad_i = 0;
+                s->payload_flushed = 0;
+                STAT(mode, s, subblocks);
+                s->payload_chunk_i = ZERO_COPY_MODE(mode) || STREAM_MODE(mode) ? (ssize_t)i + 1 : -1;
             } else {
                 // comments must be dealt differently and allowed to exceed
                 // previously defined lengths because applications
@@ -209,39 +597,78 @@ int gifmetadata_parse_gif(
                 //
                 // if bytes to read remaining or is a comment
                 int is_comment = s->local_extension_type == comment && byte != 0;
-                if (s->scratchpad_i < s->scratchpad_len || is_comment) {
+                if ((s->scratchpad_i < s->scratchpad_len || is_comment) && !STATS_MODE(mode)) {
+                    // the rest of the sub-block within the chunk in one go
+                    int status = GIFMETADATA_SUCCESS;
+                    i = payload_run(s, i, &status);
+                    if (status != GIFMETADATA_SUCCESS)
+                        return status;
+                } else if (s->scratchpad_i < s->scratchpad_len || is_comment) {
+                    collect_loop_bytes(s, &byte, 1);
+                    if (s->payload_chunk_i >= 0) {
+                        // still contiguous within the chunk, nothing to copy,
+                        // streamed comments are not bound by the scratchpad
+                        if (!STREAM_MODE(mode) && s->local_extension_type == comment && s->scratchpad_i + 1 >= SCRATCHPAD_CHUNK_SIZE * 10) {
+                            return GIFMETADATA_COMMENT_EXCEEDS_BOUNDS;
+                        }
+                        s->scratchpad_i++;
+                        break;
+                    }
+
                     // if future bytes will exceed scratchpad size, realloc
                     if (s->local_extension_type == comment && s->scratchpad_i + 1 >= s->scratchpad_size) {
-                        s->scratchpad_size += SCRATCHPAD_CHUNK_SIZE;
-                        if (s->scratchpad_size > SCRATCHPAD_CHUNK_SIZE * 10) {
+                        size_t size = s->scratchpad_size + SCRATCHPAD_CHUNK_SIZE;
+                        if (size > SCRATCHPAD_CHUNK_SIZE * 10) {
                             // don't go past 2560 bytes of reallocation
-                            //free(extension_cb_info);
                             return GIFMETADATA_COMMENT_EXCEEDS_BOUNDS;
                         }
-                        s->scratchpad = realloc(s->scratchpad, s->scratchpad_size);
+                        unsigned char *scratchpad = s->allocator->resize(s->allocator->user, s->scratchpad, s->scratchpad_size, size);
+                        if (scratchpad == NULL)
+                            return GIFMETADATA_ALLOC_FAILED;
+                        s->scratchpad = scratchpad;
+                        s->scratchpad_size = size;
+                        STAT(mode, s, scratchpad_reallocs);
                     }
 
                     s->scratchpad[s->scratchpad_i] = byte;
                     s->scratchpad_i++;
                 } else {
-                    s->scratchpad[s->scratchpad_i] = 0;
+                    unsigned char *payload;
+                    if (s->payload_chunk_i >= 0) {
+                        payload = chunk + s->payload_chunk_i;
+                    } else {
+                        s->scratchpad[s->scratchpad_i] = 0;
+                        payload = s->scratchpad;
+                    }
 
-                    if (extension_cb != NULL) {
-                        gifmetadata_extension_info *extension_cb_info = malloc(sizeof(gifmetadata_extension_info));
-                        if (extension_cb_info == NULL) {
-                            return GIFMETADATA_ALLOC_FAILED;
-                        }
-                        extension_cb_info->type = s->local_extension_type;
-                        extension_cb_info->buffer = s->scratchpad;
-                        // TODO ensure that callback receiver does not
-                        // free scratchpad
+                    // the loop count is the first sub-block after the
+                    // identifier, a one then a little endian count
+                    const unsigned char *loop = s->loop_bytes + GIFMETADATA_LOOP_ID_LEN;
+                    if (s->local_extension_type == application) {
+                        s->loop_extension = s->scratchpad_len == GIFMETADATA_LOOP_ID_LEN &&
+                            (memcmp(s->loop_bytes, "NETSCAPE2.0", GIFMETADATA_LOOP_ID_LEN) == 0 || memcmp(s->loop_bytes, "ANIMEXTS1.0", GIFMETADATA_LOOP_ID_LEN) == 0);
+                    } else if (s->loop_extension && s->payload_subblock == 1 && s->scratchpad_len >= 3 && loop[0] == 1) {
+                        s->loop_count = loop[1] | (loop[2] << 8);
+                        QUERY_FOUND(s, GIFMETADATA_QUERY_LOOP_COUNT);
+                    }
+
+                    if (STREAM_MODE(mode)) {
+                        // end of the sub-block, payloads have been streamed
+                        // rather than collected for extension_cb
+                        flush_payload(s, cb);
+                    } else if (cb->extension_cb != NULL) {
+                        // only valid for the duration of the callback
+                        gifmetadata_extension_info extension_cb_info;
+                        extension_cb_info.type = s->local_extension_type;
+                        extension_cb_info.buffer = payload;
+                        extension_cb_info.block_offset = s->block_file_i;
                         if (s->local_extension_type == comment) {
-                            extension_cb_info->buffer_len = s->scratchpad_i;
+                            extension_cb_info.buffer_len = s->scratchpad_i;
                         } else {
-                            extension_cb_info->buffer_len = s->scratchpad_len;
+                            extension_cb_info.buffer_len = s->scratchpad_len;
                         }
-                        // TODO ensure that callback receiver frees struct
-                        extension_cb(s, extension_cb_info);
+                        STAT(mode, s, extension_callbacks);
+                        cb->extension_cb(cb->user, s, &extension_cb_info);
                     }
 
                     // if the next extension type is an application then
@@ -250,25 +677,78 @@ int gifmetadata_parse_gif(
                         s->local_extension_type = application_subblock;
                         s->scratchpad_i = 0;
                         s->scratchpad_len = byte;
+                        s->payload_flushed = 0;
+                        s->payload_subblock++;
+                        s->payload_chunk_i = ZERO_COPY_MODE(mode) || STREAM_MODE(mode) ? (ssize_t)i + 1 : -1;
                         
                         if (s->scratchpad_len == 0) {
+                            if (STREAM_MODE(mode))
+                                emit_payload(s, cb, payload_end, NULL, 0);
                             s->read_state = searching;
-                            break;
+                        } else {
+                            STAT(mode, s, subblocks);
+                        }
+                        break;
+                    }
+
+                    if (s->local_extension_type == plain_text && byte != 0) {
+                        // only the plain text header is reported, the text
+                        // sub-blocks that follow are passed over and the
+                        // payload ends on their terminator
+                        s->payload_subblock = 1;
+                        s->read_state = unknown_extension;
+                        s->scratchpad_i = 0;
+                        s->scratchpad_len = byte;
+                        STAT(mode, s, subblocks);
+                        if (RUN_MODE(mode)) {
+                            s->skip_len = byte;
+                            s->scratchpad_i = byte;
                         }
                     } else {
+                        if (STREAM_MODE(mode))
+                            emit_payload(s, cb, payload_end, NULL, 0);
                         s->read_state = searching;
+                        if (s->local_extension_type == comment && ++s->comments >= s->query_comments) {
+                            QUERY_FOUND(s, GIFMETADATA_QUERY_COMMENTS);
+                        }
                     }
                 }
             }
             break;
         case image_descriptor:
-        
+            if (RUN_MODE(mode) && s->scratchpad_i == 0 && cb->frame_cb == NULL && !DECODE_MODE(mode)) {
+                // position and size are not read, jump to the packed byte
+                s->skip_len = 7;
+                s->scratchpad_i = 8;
+                break;
+            }
+
             if (s->scratchpad_i >= 8) {
+                if (cb->frame_cb != NULL || DECODE_MODE(mode)) {
+                    // position and size are little endian pairs
+                    const unsigned char *d = s->scratchpad;
+                    s->frame.index = s->frames;
+                    s->frame.offset = s->block_file_i;
+                    s->frame.left = d[0] | (d[1] << 8);
+                    s->frame.top = d[2] | (d[3] << 8);
+                    s->frame.width = d[4] | (d[5] << 8);
+                    s->frame.height = d[6] | (d[7] << 8);
+                    s->frame.interlaced = (byte >> 6) & 1;
+                    s->frame.local_color_table_len = byte >> 7 ? 3 << ((byte & 0b111) + 1) : 0;
+                    s->frame_pixels = (size_t)s->frame.width * s->frame.height;
+                    if (cb->frame_cb != NULL)
+                        cb->frame_cb(cb->user, s, &s->frame);
+                }
+                // a graphic control extension only applies to one frame
+                s->frames++;
+                memset(&s->frame, 0, sizeof(gifmetadata_frame));
+                s->frame.transparent_index = -1;
+
                 // local color table check
                 if (byte >> 7 == 1) {
                     s->scratchpad_i = 0;
-                    int local_color_table = byte & 0b111;
-                    s->scratchpad_len = 3*pow(2,local_color_table+1);
+                    int local_color_table_size = byte & 0b111;
+                    s->scratchpad_len = 3 << (local_color_table_size + 1);
                     s->read_state = local_color_table;
                 } else {
                     s->scratchpad_i = 0;
@@ -277,14 +757,29 @@ int gifmetadata_parse_gif(
                     break;
                 }
             } else {
-                s->scratchpad_i++;
+                s->scratchpad[s->scratchpad_i++] = byte;
             }
             break;
         case local_color_table:
-            CALL_STATE_CB(state_cb, s);
-            // loop through the local color table, ignoring the contents
+            CALL_STATE_CB(mode, cb, s);
+            // loop through the local color table, ignoring the contents,
+            // the byte after the table is the lzw minimum code size
+            if (RUN_MODE(mode)) {
+                // stop short of the minimum code size when decoding
+                s->skip_len = s->scratchpad_len - s->scratchpad_i;
+                s->scratchpad_i = 1;
+                if (DECODE_MODE(mode)) {
+                    s->skip_len--;
+                    s->scratchpad_i = 0;
+                }
+                s->scratchpad_len = 0;
+                s->read_state = image_data;
+                break;
+            }
             if (s->scratchpad_i >= s->scratchpad_len) {
-                s->scratchpad_i = 0;
+                if (DECODE_MODE(mode))
+                    begin_decode(s, byte);
+                s->scratchpad_i = 1;
                 s->scratchpad_len = 0;
                 s->read_state = image_data;
             } else {
@@ -292,12 +787,27 @@ int gifmetadata_parse_gif(
             }
             break;
         case image_data:
-            CALL_STATE_CB(state_cb, s);
+            CALL_STATE_CB(mode, cb, s);
+            if (DECODE_MODE(mode)) {
+                i = decode_image_data(s, cb, i);
+                break;
+            }
             // loop through the image data, ignoring the contents
+            if (RUN_MODE(mode) && (s->scratchpad_len == 0 ? s->scratchpad_i == 1 : s->scratchpad_i >= s->scratchpad_len)) {
+                // at a size byte, hop the chain as far as the chunk goes
+                i = skip_image_data(s, i);
+                break;
+            }
             if (s->scratchpad_len == 0) {
                 if (s->scratchpad_i == 1) {
+                    // first sub-block size, zero when there is no data
+                    if (byte == 0) {
+                        s->read_state = searching;
+                        break;
+                    }
                     s->scratchpad_i = 0;
                     s->scratchpad_len = byte;
+                    STAT(mode, s, subblocks);
                     break;
                 }
             } else {
@@ -308,6 +818,7 @@ int gifmetadata_parse_gif(
                     } else {
                         s->scratchpad_i = 0;
                         s->scratchpad_len = byte;
+                        STAT(mode, s, subblocks);
                         break;
                     }
                 }
@@ -317,7 +828,197 @@ int gifmetadata_parse_gif(
         default:
             break;
         } 
+
+        if (STATS_MODE(mode))
+            stats_byte(s, byte_state);
+        if (satisfied)
+            return GIFMETADATA_QUERY_SATISFIED;
+    }
+
+    if (s->read_state == known_extension && s->payload_chunk_i >= 0) {
+        // the chunk is only valid during this call, stream what has arrived
+        // of the payload or move it into the scratchpad so that it can be
+        // completed by the next chunk
+        if (STREAM_MODE(mode)) {
+            flush_payload(s, cb);
+            s->payload_chunk_i = 0;
+        } else if (s->scratchpad_i > 0) {
+            if (s->scratchpad_i + 1 > s->scratchpad_size) {
+                size_t size = (s->scratchpad_i / SCRATCHPAD_CHUNK_SIZE + 1) * SCRATCHPAD_CHUNK_SIZE;
+                unsigned char *scratchpad = s->allocator->resize(s->allocator->user, s->scratchpad, s->scratchpad_size, size);
+                if (scratchpad == NULL)
+                    return GIFMETADATA_ALLOC_FAILED;
+                s->scratchpad = scratchpad;
+                s->scratchpad_size = size;
+                STAT(mode, s, scratchpad_reallocs);
+            }
+            memcpy(s->scratchpad, chunk + s->payload_chunk_i, s->scratchpad_i);
+            s->payload_chunk_i = -1;
+        } else {
+            s->payload_chunk_i = 0;
+        }
     }
 
     return GIFMETADATA_SUCCESS;
 }
+
+#define PARSE_VARIANT(name, mode) \
+    static int parse_chunk_##name(gifmetadata_state *s, const gifmetadata_callbacks *cb) { \
+        return parse_chunk(s, cb, mode); \
+    }
+
+// the common modes, reading every byte without or with a state callback, as
+// done by gifmetadata_parse_gif, and skipping with extension payloads copied,
+// left in the chunk or streamed
+PARSE_VARIANT(walk, 0)
+PARSE_VARIANT(walk_state_cb, PARSE_STATE_CB)
+PARSE_VARIANT(skip, GIFMETADATA_FLAG_SKIP)
+PARSE_VARIANT(zero_copy, GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY)
+PARSE_VARIANT(zero_copy_state_cb, GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY | PARSE_STATE_CB)
+PARSE_VARIANT(stream, GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_STREAM_PAYLOAD)
+PARSE_VARIANT(decode, GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_DECODE)
+PARSE_VARIANT(decode_zero_copy_state_cb, GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY | GIFMETADATA_FLAG_DECODE | PARSE_STATE_CB)
+
+// indexed by mode, NULL for the modes left to parse_chunk_any
+static int (*const parse_variants[PARSE_MODES])(gifmetadata_state *s, const gifmetadata_callbacks *cb) = {
+    [0] = &parse_chunk_walk,
+    [PARSE_STATE_CB] = &parse_chunk_walk_state_cb,
+    [GIFMETADATA_FLAG_SKIP] = &parse_chunk_skip,
+    [GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY] = &parse_chunk_zero_copy,
+    [GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY | PARSE_STATE_CB] = &parse_chunk_zero_copy_state_cb,
+    [GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_STREAM_PAYLOAD] = &parse_chunk_stream,
+    [GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_DECODE] = &parse_chunk_decode,
+    [GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY | GIFMETADATA_FLAG_DECODE | PARSE_STATE_CB] = &parse_chunk_decode_zero_copy_state_cb,
+};
+
+// any other mode, read from the state
+static int parse_chunk_any(gifmetadata_state *s, const gifmetadata_callbacks *cb, unsigned int mode) {
+    return parse_chunk(s, cb, mode);
+}
+
+int gifmetadata_parse_gif_v2(
+    gifmetadata_state *s,
+    unsigned char *chunk,
+    size_t chunk_len,
+    const gifmetadata_callbacks *cb) {
+
+    s->chunk = chunk;
+    s->chunk_len = chunk_len;
+    s->chunk_file_i = s->file_i;
+    if (TIMING_MODE(s->flags))
+        s->stats_phase_ns = stats_now();
+
+    if (DECODE_MODE(s->flags) && s->lzw == NULL) {
+        s->lzw = s->allocator->alloc(s->allocator->user, sizeof(gifmetadata_lzw));
+        if (s->lzw == NULL)
+            return GIFMETADATA_ALLOC_FAILED;
+        s->lzw->active = 0;
+    }
+
+    if (s->skip_len >= chunk_len) {
+        // the whole chunk lies within a run being passed over, as happens
+        // for most chunks of a large frame
+        s->skip_len -= chunk_len;
+        s->file_i += chunk_len;
+        if (STATS_MODE(s->flags))
+            s->stats.state_bytes[s->skip_state] += chunk_len;
+        if (TIMING_MODE(s->flags))
+            stats_phase(s, s->read_state);
+        return GIFMETADATA_SUCCESS;
+    }
+
+    unsigned int mode = s->flags & (GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY | GIFMETADATA_FLAG_STREAM_PAYLOAD |
+        GIFMETADATA_FLAG_STATS | GIFMETADATA_FLAG_STATS_TIMING | GIFMETADATA_FLAG_DECODE);
+    if (cb->state_cb != NULL)
+        mode |= PARSE_STATE_CB;
+
+    int parse_status;
+    if (parse_variants[mode] != NULL)
+        parse_status = parse_variants[mode](s, cb);
+    else
+        parse_status = parse_chunk_any(s, cb, mode);
+
+    if ((parse_status == GIFMETADATA_SUCCESS || parse_status == GIFMETADATA_QUERY_SATISFIED) && TIMING_MODE(mode))
+        stats_phase(s, s->read_state);
+    return parse_status;
+}
+
+// version 1 api, the callbacks are adapted to version 2 and receive a heap
+// copy of the extension info that they must free
+
+typedef struct v1_callbacks {
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*);
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state);
+    int status;
+} v1_callbacks;
+
+static void v1_extension_cb(void *user, gifmetadata_state *s, const gifmetadata_extension_info *extension) {
+    v1_callbacks *v1 = user;
+    gifmetadata_extension_info *copy = malloc(sizeof(gifmetadata_extension_info));
+    if (copy == NULL) {
+        v1->status = GIFMETADATA_ALLOC_FAILED;
+        return;
+    }
+    *copy = *extension;
+    v1->extension_cb(s, copy);
+}
+
+static void v1_state_cb(void *user, gifmetadata_state *s, enum gifmetadata_read_state state) {
+    v1_callbacks *v1 = user;
+    v1->state_cb(s, state);
+}
+
+static void v1_init(
+    v1_callbacks *v1,
+    gifmetadata_callbacks *cb,
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state)) {
+
+    v1->extension_cb = extension_cb;
+    v1->state_cb = state_cb;
+    v1->status = GIFMETADATA_SUCCESS;
+    memset(cb, 0, sizeof(gifmetadata_callbacks));
+    cb->extension_cb = extension_cb != NULL ? &v1_extension_cb : NULL;
+    cb->state_cb = state_cb != NULL ? &v1_state_cb : NULL;
+    cb->user = v1;
+}
+
+int gifmetadata_parse_gif(
+    gifmetadata_state *s,
+    unsigned char *chunk,
+    size_t chunk_len,
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state)) {
+
+    v1_callbacks v1;
+    gifmetadata_callbacks cb;
+    v1_init(&v1, &cb, extension_cb, state_cb);
+    int parse_status = gifmetadata_parse_gif_v2(s, chunk, chunk_len, &cb);
+    return parse_status != GIFMETADATA_SUCCESS ? parse_status : v1.status;
+}
+
+int gifmetadata_parse_fd(
+    gifmetadata_state *s,
+    int fd,
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state)) {
+
+    v1_callbacks v1;
+    gifmetadata_callbacks cb;
+    v1_init(&v1, &cb, extension_cb, state_cb);
+    int parse_status = gifmetadata_parse_fd_v2(s, fd, &cb);
+    return parse_status != GIFMETADATA_SUCCESS ? parse_status : v1.status;
+}
+
+int gifmetadata_parse_mmap(
+    gifmetadata_state *s,
+    int fd,
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state)) {
+
+    v1_callbacks v1;
+    gifmetadata_callbacks cb;
+    v1_init(&v1, &cb, extension_cb, state_cb);
+    int parse_status = gifmetadata_parse_mmap_v2(s, fd, &cb);
+    return parse_status != GIFMETADATA_SUCCESS ? parse_status : v1.status;
+}
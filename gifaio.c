@@ -0,0 +1,373 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// preadv2 and RWF_NOWAIT
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef GIFAIO_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "gifaio.h"
+
+#ifdef GIFAIO_IO_URING
+// sets up the ring, returns zero when the kernel has no io_uring or refuses
+// one, e.g. under a seccomp filter
+int ring_open(gifaio *a) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, a->depth, &p);
+    if (fd < 0)
+        return 0;
+
+    a->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    a->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // both rings share one mapping on kernels since 5.4
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (a->cq_ring_len > a->sq_ring_len)
+            a->sq_ring_len = a->cq_ring_len;
+        a->cq_ring_len = a->sq_ring_len;
+    }
+    a->sq_ring = mmap(NULL, a->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (a->sq_ring == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        a->cq_ring = a->sq_ring;
+    } else {
+        a->cq_ring = mmap(NULL, a->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (a->cq_ring == MAP_FAILED) {
+            munmap(a->sq_ring, a->sq_ring_len);
+            close(fd);
+            return 0;
+        }
+    }
+    a->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    a->sqes = mmap(NULL, a->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (a->sqes == MAP_FAILED) {
+        if (a->cq_ring != a->sq_ring)
+            munmap(a->cq_ring, a->cq_ring_len);
+        munmap(a->sq_ring, a->sq_ring_len);
+        close(fd);
+        return 0;
+    }
+
+    unsigned char *sq = a->sq_ring;
+    unsigned char *cq = a->cq_ring;
+    a->sq_head = (unsigned *)(sq + p.sq_off.head);
+    a->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    a->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    a->sq_array = (unsigned *)(sq + p.sq_off.array);
+    a->cq_head = (unsigned *)(cq + p.cq_off.head);
+    a->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    a->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    a->cqes = cq + p.cq_off.cqes;
+    a->ring_fd = fd;
+    return 1;
+}
+
+void ring_close(gifaio *a) {
+    munmap(a->sqes, a->sqes_len);
+    if (a->cq_ring != a->sq_ring)
+        munmap(a->cq_ring, a->cq_ring_len);
+    munmap(a->sq_ring, a->sq_ring_len);
+    close(a->ring_fd);
+}
+
+void ring_link(gifaio *a, gifaio_read *r) {
+    r->prev = NULL;
+    r->next = a->ring_reads;
+    if (r->next != NULL)
+        r->next->prev = r;
+    a->ring_reads = r;
+}
+
+void ring_unlink(gifaio *a, gifaio_read *r) {
+    if (r->prev != NULL)
+        r->prev->next = r->next;
+    else
+        a->ring_reads = r->next;
+    if (r->next != NULL)
+        r->next->prev = r->prev;
+}
+
+void ring_submit(gifaio *a, gifaio_read *r) {
+    // only this thread writes the tail, the kernel moves the head
+    unsigned tail = *a->sq_tail;
+    unsigned i = tail & *a->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)a->sqes + i;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    // readv rather than read works on kernels since 5.1
+    r->iov.iov_base = r->buf;
+    r->iov.iov_len = r->len;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->iov;
+    sqe->len = 1;
+    sqe->off = r->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)r;
+    a->sq_array[i] = i;
+    __atomic_store_n(a->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    a->to_submit++;
+    ring_link(a, r);
+}
+
+gifaio_read *ring_wait(gifaio *a) {
+    for (;;) {
+        unsigned head = *a->cq_head;
+        if (head != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)a->cqes + (head & *a->cq_mask);
+            gifaio_read *r = (gifaio_read *)(uintptr_t)cqe->user_data;
+            r->result = cqe->res;
+            __atomic_store_n(a->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring_unlink(a, r);
+            return r;
+        }
+        // nothing has completed, submit what is queued and wait in the one
+        // system call
+        int submitted = syscall(__NR_io_uring_enter, a->ring_fd, a->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return NULL;
+        }
+        a->to_submit -= submitted;
+    }
+}
+
+// takes back the reads the kernel has not yet been handed, then cancels the
+// rest and reaps their completions, so that nothing writes to the buffers
+// once the ring is closed. returns zero once every read has completed
+int ring_drain(gifaio *a) {
+    // no sq thread, the kernel only takes entries within io_uring_enter
+    unsigned head = __atomic_load_n(a->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *a->sq_tail;
+    for (unsigned t = head; t != tail; t++) {
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)a->sqes + (t & *a->sq_mask);
+        ring_unlink(a, (gifaio_read *)(uintptr_t)sqe->user_data);
+    }
+    __atomic_store_n(a->sq_tail, head, __ATOMIC_RELEASE);
+    a->to_submit = 0;
+
+    // no more reads than entries are in flight, and the completion queue
+    // holds twice as many, so the cancels and the reads both fit. a kernel
+    // without IORING_OP_ASYNC_CANCEL fails them, and the reads are waited for
+    for (gifaio_read *r = a->ring_reads; r != NULL; r = r->next) {
+        unsigned t = *a->sq_tail;
+        unsigned i = t & *a->sq_mask;
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)a->sqes + i;
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)r;
+        // zero tells the completions of cancels from those of reads
+        sqe->user_data = 0;
+        a->sq_array[i] = i;
+        __atomic_store_n(a->sq_tail, t + 1, __ATOMIC_RELEASE);
+        a->to_submit++;
+    }
+
+    while (a->ring_reads != NULL) {
+        unsigned cq_head = *a->cq_head;
+        if (cq_head != __atomic_load_n(a->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)a->cqes + (cq_head & *a->cq_mask);
+            if (cqe->user_data != 0)
+                ring_unlink(a, (gifaio_read *)(uintptr_t)cqe->user_data);
+            __atomic_store_n(a->cq_head, cq_head + 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        int submitted = syscall(__NR_io_uring_enter, a->ring_fd, a->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return -1;
+        }
+        a->to_submit -= submitted;
+    }
+    return 0;
+}
+#endif
+
+void *pool_run(void *arg) {
+    gifaio *a = arg;
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        while (a->pending == NULL && !a->stopping)
+            pthread_cond_wait(&a->submitted, &a->lock);
+        if (a->pending == NULL)
+            break;
+        gifaio_read *r = a->pending;
+        a->pending = r->next;
+        pthread_mutex_unlock(&a->lock);
+
+        ssize_t b;
+        do {
+            b = pread(r->fd, r->buf, r->len, r->offset);
+        } while (b < 0 && errno == EINTR);
+        r->result = b < 0 ? -errno : b;
+
+        pthread_mutex_lock(&a->lock);
+        r->next = NULL;
+        if (a->done == NULL)
+            a->done = r;
+        else
+            a->done_tail->next = r;
+        a->done_tail = r;
+        pthread_cond_signal(&a->completed);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+void pool_stop(gifaio *a) {
+    pthread_mutex_lock(&a->lock);
+    a->stopping = 1;
+    pthread_cond_broadcast(&a->submitted);
+    pthread_mutex_unlock(&a->lock);
+    for (int i = 0; i < a->thread_count; i++)
+        pthread_join(a->threads[i], NULL);
+}
+
+int pool_open(gifaio *a) {
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->submitted, NULL);
+    pthread_cond_init(&a->completed, NULL);
+    // every read blocks a thread, so there are as many as reads in flight
+    a->threads = malloc(sizeof(pthread_t) * a->depth);
+    if (a->threads == NULL)
+        return 0;
+    for (int i = 0; i < a->depth; i++) {
+        if (pthread_create(&a->threads[i], NULL, &pool_run, a) != 0)
+            break;
+        a->thread_count++;
+    }
+    return a->thread_count > 0;
+}
+
+gifaio *gifaio_new(int depth) {
+    gifaio *a = calloc(1, sizeof(gifaio));
+    if (a == NULL)
+        return NULL;
+    a->depth = depth < 1 ? 1 : depth > GIFAIO_MAX_DEPTH ? GIFAIO_MAX_DEPTH : depth;
+    a->ring_fd = -1;
+#ifdef GIFAIO_IO_URING
+    if (ring_open(a))
+        return a;
+#endif
+    if (!pool_open(a)) {
+        gifaio_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+int gifaio_free(gifaio *a) {
+    if (a == NULL)
+        return 0;
+#ifdef GIFAIO_IO_URING
+    if (a->ring_fd >= 0) {
+        // closing the ring only starts cancelling the reads in flight, they
+        // could still complete into their buffers after it returns
+        int status = ring_drain(a);
+        ring_close(a);
+        free(a);
+        return status;
+    }
+#endif
+    // the threads finish every queued read before they stop
+    pool_stop(a);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->submitted);
+    pthread_cond_destroy(&a->completed);
+    free(a->threads);
+    free(a);
+    return 0;
+}
+
+const char *gifaio_backend(const gifaio *a) {
+    return a->ring_fd >= 0 ? "io_uring" : "pread";
+}
+
+void gifaio_submit(gifaio *a, gifaio_read *r) {
+    a->in_flight++;
+#ifdef GIFAIO_IO_URING
+    if (a->ring_fd >= 0) {
+        ring_submit(a, r);
+        return;
+    }
+#endif
+    r->next = NULL;
+    if (!a->no_nowait) {
+        struct iovec iov = { r->buf, r->len };
+        ssize_t b = preadv2(r->fd, &iov, 1, r->offset, RWF_NOWAIT);
+        if (b >= 0) {
+            r->result = b;
+            if (a->ready == NULL)
+                a->ready = r;
+            else
+                a->ready_tail->next = r;
+            a->ready_tail = r;
+            return;
+        }
+        // EAGAIN when the data has to come from the disk
+        if (errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)
+            a->no_nowait = 1;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    if (a->pending == NULL)
+        a->pending = r;
+    else
+        a->pending_tail->next = r;
+    a->pending_tail = r;
+    pthread_cond_signal(&a->submitted);
+    pthread_mutex_unlock(&a->lock);
+}
+
+gifaio_read *gifaio_wait(gifaio *a) {
+    if (a->in_flight == 0)
+        return NULL;
+    gifaio_read *r;
+#ifdef GIFAIO_IO_URING
+    if (a->ring_fd >= 0) {
+        r = ring_wait(a);
+        if (r != NULL)
+            a->in_flight--;
+        return r;
+    }
+#endif
+    if (a->ready != NULL) {
+        r = a->ready;
+        a->ready = r->next;
+        a->in_flight--;
+        return r;
+    }
+    pthread_mutex_lock(&a->lock);
+    while (a->done == NULL)
+        pthread_cond_wait(&a->completed, &a->lock);
+    r = a->done;
+    a->done = r->next;
+    pthread_mutex_unlock(&a->lock);
+    a->in_flight--;
+    return r;
+}
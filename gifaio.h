@@ -0,0 +1,116 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_AIO_H
+#define GIFMETADATA_AIO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// reads of many files kept in flight at once, so that batch scans parse one
+// file while the reads of others are waiting on the disk. built with
+// GIFAIO_IO_URING the reads are made with io_uring, through the raw system
+// calls rather than liburing. without it, or when the kernel refuses a
+// ring, a pool of threads makes them with pread. reads of data already in
+// the page cache are made straight away with RWF_NOWAIT, as handing each of
+// them to a thread costs more than the read itself
+
+// most reads in flight, and threads in the pread pool
+#define GIFAIO_MAX_DEPTH 256
+
+typedef struct gifaio_read {
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    uint64_t offset;
+    // bytes read once completed, or a negative errno
+    ssize_t result;
+    void *user;
+
+    // the single buffer of an io_uring readv
+    struct iovec iov;
+    // pending and completed reads of the pool, or the reads handed to the
+    // ring and not yet completed
+    struct gifaio_read *next;
+    struct gifaio_read *prev;
+} gifaio_read;
+
+typedef struct gifaio {
+    int depth;
+    size_t in_flight;
+
+    // io_uring, ring_fd is -1 when reading with the pool
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    void *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+    // queued since the last io_uring_enter
+    unsigned to_submit;
+    // queued or in the kernel, cancelled before the ring is closed
+    gifaio_read *ring_reads;
+
+    // pread pool
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    pthread_cond_t completed;
+    gifaio_read *pending;
+    gifaio_read *pending_tail;
+    gifaio_read *done;
+    gifaio_read *done_tail;
+    int stopping;
+    // completed on submission, only touched by the submitting thread
+    gifaio_read *ready;
+    gifaio_read *ready_tail;
+    // the kernel refused RWF_NOWAIT
+    int no_nowait;
+} gifaio;
+
+// Starts reading with up to depth reads in flight, NULL on failure
+gifaio *gifaio_new(int depth);
+// Waits for the reads in flight, cancelling them when the ring has failed,
+// and releases a. Returns nonzero when reads that could not be cancelled or
+// waited for may still write to their buffers, which must then not be freed
+int gifaio_free(gifaio *a);
+// "io_uring" or "pread"
+const char *gifaio_backend(const gifaio *a);
+
+// Queues a read of r->len bytes at r->offset of r->fd into r->buf. r is
+// owned by a until gifaio_wait returns it, no more than depth reads may be
+// in flight
+void gifaio_submit(gifaio *a, gifaio_read *r);
+// Returns the next completed read, waiting for one when needed. Queued reads
+// are submitted together while waiting. Returns NULL when nothing is in
+// flight, or when the ring fails, the reads in flight are then cancelled by
+// gifaio_free
+gifaio_read *gifaio_wait(gifaio *a);
+
+#endif
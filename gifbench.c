@@ -0,0 +1,390 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// gifbench times the parser over the synthetic corpus from gifsynth.c, or the
+// files given, held in memory. every parsing mode is run at several chunk
+// sizes and the results are written as tab separated rows so that runs can
+// be diffed between releases. the sub-block walker is also timed on its own
+// over each synthetic file's image data, its rows count image data chains as
+// blocks. the pull iterator is timed over the whole file, and stopping at the
+// first comment, as the modes "iter" and "first-comment". the mode "pool"
+// takes its states from a gifmetadata_pool, counting the allocations of a
+// program that has already parsed the file once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gifmetadata.h"
+#include "gifsynth.h"
+
+#define BENCH_MIN_SECONDS 0.2
+
+// zero hands the whole file over as one chunk, as parse_mmap_v2 does
+const size_t bench_chunk_sizes[] = { 64, 4096, 0 };
+#define BENCH_CHUNK_SIZES (sizeof(bench_chunk_sizes) / sizeof(bench_chunk_sizes[0]))
+
+typedef struct bench_mode {
+    const char *name;
+    unsigned int flags;
+    // states come from bench_pool rather than gifmetadata_state_new
+    int pooled;
+} bench_mode;
+
+const bench_mode bench_modes[] = {
+    { "walk", 0 },
+    { "skip", GIFMETADATA_FLAG_SKIP },
+    { "zero-copy", GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY },
+    { "stream", GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_STREAM_PAYLOAD },
+    // noise image data stops decoding at its first corrupt code, only the
+    // pixels case decodes in full
+    { "decode", GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_DECODE },
+    { "pool", GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY, 1 },
+    { NULL, 0 }
+};
+
+// heap calls are counted through the linker's --wrap while count_allocs is
+// set, see the gifbench rule in the Makefile
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+int count_allocs;
+size_t allocs;
+
+void *__wrap_malloc(size_t size) {
+    allocs += count_allocs;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs += count_allocs;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocs += count_allocs;
+    return __real_realloc(ptr, size);
+}
+
+// running checksum of the payload bytes handed to the callbacks, used to
+// confirm that every mode reports the same extensions
+uint64_t cb_hash;
+size_t cb_blocks;
+
+void hash_bytes(const unsigned char *buffer, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        cb_hash = (cb_hash ^ buffer[i]) * 1099511628211ULL;
+}
+
+void extension_cb(void *user, gifmetadata_state *s, const gifmetadata_extension_info *extension) {
+    hash_bytes(extension->buffer, extension->buffer_len);
+}
+
+void payload_cb(void *user, gifmetadata_state *s, const gifmetadata_payload *payload) {
+    if (payload->event == payload_data)
+        hash_bytes(payload->buffer, payload->buffer_len);
+}
+
+// only set for the counting pass, every block starts with one of these
+void state_cb(void *user, gifmetadata_state *s, enum gifmetadata_read_state state) {
+    if (state == extension || state == image_descriptor || state == trailer)
+        cb_blocks++;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+gifmetadata_pool *bench_pool;
+
+// parses a whole file in chunks of chunk_size with a state from pool, or a
+// new one when it is NULL, returns a parse status
+int parse(const unsigned char *data, size_t len, unsigned int flags, size_t chunk_size, gifmetadata_pool *pool, const gifmetadata_callbacks *cb) {
+    if (chunk_size == 0)
+        chunk_size = len;
+    gifmetadata_state *s = pool != NULL ? gifmetadata_pool_acquire(pool) : gifmetadata_state_new();
+    if (s == NULL)
+        return GIFMETADATA_ALLOC_FAILED;
+    s->flags = flags;
+
+    int parse_status = GIFMETADATA_SUCCESS;
+    for (size_t off = 0; off < len && parse_status == GIFMETADATA_SUCCESS; off += chunk_size) {
+        size_t n = len - off;
+        if (n > chunk_size)
+            n = chunk_size;
+        // the parser does not write to the chunk
+        parse_status = gifmetadata_parse_gif_v2(s, (unsigned char *)data + off, n, cb);
+    }
+    if (parse_status == GIFMETADATA_SUCCESS && s->read_state != trailer)
+        parse_status = GIFMETADATA_INVALID_SIG;
+
+    if (pool != NULL)
+        gifmetadata_pool_release(pool, s);
+    else
+        gifmetadata_state_free(s);
+    return parse_status;
+}
+
+// walks a whole file with the pull iterator, hashing what extension_cb would
+// be given. stops at the first comment when first_comment is set, returns a
+// parse status
+int iterate(const unsigned char *data, size_t len, int first_comment) {
+    gifmetadata_iter it;
+    gifmetadata_block block;
+    gifmetadata_iter_init(&it, data, len);
+
+    int status;
+    while ((status = gifmetadata_next_block(&it, &block)) == GIFMETADATA_SUCCESS) {
+        switch (block.type) {
+        case block_comment:
+            hash_bytes(block.data, block.data_len);
+            cb_blocks++;
+            if (first_comment)
+                return GIFMETADATA_SUCCESS;
+            break;
+        case block_application: {
+            hash_bytes(block.data, block.data_len);
+            size_t cursor = block.subblocks;
+            const unsigned char *subblock;
+            size_t subblock_len;
+            while (gifmetadata_next_subblock(&it, &cursor, &subblock, &subblock_len))
+                hash_bytes(subblock, subblock_len);
+            cb_blocks++;
+            break;
+        }
+        case block_plain_text:
+            hash_bytes(block.data, block.data_len);
+            cb_blocks++;
+            break;
+        case block_control_extension:
+        case block_extension:
+        case block_image_descriptor:
+        case block_trailer:
+            cb_blocks++;
+            break;
+        default:
+            break;
+        }
+    }
+    if (status == GIFMETADATA_END && it.read_state != trailer)
+        status = GIFMETADATA_INVALID_SIG;
+    return status == GIFMETADATA_END ? GIFMETADATA_SUCCESS : status;
+}
+
+void print_row(const char *name, size_t len, size_t blocks, const char *mode, size_t chunk_size, int iterations, double elapsed, size_t file_allocs) {
+    printf("%s\t%zu\t%zu\t%s\t", name, len, blocks, mode);
+    if (chunk_size == 0)
+        printf("file\t");
+    else
+        printf("%zu\t", chunk_size);
+    if (iterations == 0) {
+        printf("0\terror\terror\t-\n");
+        return;
+    }
+    printf("%d\t%.1f\t%.0f\t", iterations,
+        (double)len * iterations / elapsed / 1e6,
+        (double)blocks * iterations / elapsed);
+    if (file_allocs == (size_t)-1)
+        printf("-\n");
+    else
+        printf("%zu\n", file_allocs);
+    fflush(stdout);
+}
+
+// times every mode and chunk size over one file, returns zero when the modes
+// disagree about the extensions
+int bench_file(const char *name, const unsigned char *data, size_t len) {
+    gifmetadata_callbacks cb = {
+        .extension_cb = &extension_cb,
+        .payload_cb = &payload_cb
+    };
+    gifmetadata_callbacks count_cb = cb;
+    count_cb.state_cb = &state_cb;
+    uint64_t reference_hash = 0;
+    int have_reference = 0;
+
+    for (const bench_mode *m = bench_modes; m->name != NULL; m++) {
+        gifmetadata_pool *pool = m->pooled ? bench_pool : NULL;
+        for (size_t c = 0; c < BENCH_CHUNK_SIZES; c++) {
+            size_t chunk_size = bench_chunk_sizes[c];
+            // the pooled state grows to fit the file first
+            if (pool != NULL)
+                parse(data, len, m->flags, chunk_size, pool, &cb);
+
+            // untimed pass counting blocks and allocations
+            cb_hash = 14695981039346656037ULL;
+            cb_blocks = 0;
+            allocs = 0;
+            count_allocs = 1;
+            int parse_status = parse(data, len, m->flags, chunk_size, pool, &count_cb);
+            count_allocs = 0;
+            if (parse_status != GIFMETADATA_SUCCESS) {
+                print_row(name, len, 0, m->name, chunk_size, 0, 0, 0);
+                continue;
+            }
+            if (!have_reference) {
+                reference_hash = cb_hash;
+                have_reference = 1;
+            } else if (cb_hash != reference_hash) {
+                fprintf(stderr, "ERROR %s: %s mode with %zu byte chunks reported different extensions\n", name, m->name, chunk_size);
+                return 0;
+            }
+            size_t blocks = cb_blocks;
+            size_t file_allocs = allocs;
+
+            int iterations = 0;
+            double start = now();
+            double elapsed;
+            do {
+                parse(data, len, m->flags, chunk_size, pool, &cb);
+                iterations++;
+                elapsed = now() - start;
+            } while (elapsed < BENCH_MIN_SECONDS);
+
+            print_row(name, len, blocks, m->name, chunk_size, iterations, elapsed, file_allocs);
+        }
+    }
+
+    for (int first_comment = 0; first_comment <= 1; first_comment++) {
+        const char *mode = first_comment ? "first-comment" : "iter";
+        cb_hash = 14695981039346656037ULL;
+        cb_blocks = 0;
+        allocs = 0;
+        count_allocs = 1;
+        int status = iterate(data, len, first_comment);
+        count_allocs = 0;
+        if (status != GIFMETADATA_SUCCESS) {
+            print_row(name, len, 0, mode, 0, 0, 0, 0);
+            continue;
+        }
+        if (!first_comment && have_reference && cb_hash != reference_hash) {
+            fprintf(stderr, "ERROR %s: the iterator reported different extensions\n", name);
+            return 0;
+        }
+        size_t blocks = cb_blocks;
+        size_t file_allocs = allocs;
+
+        int iterations = 0;
+        double start = now();
+        double elapsed;
+        do {
+            iterate(data, len, first_comment);
+            iterations++;
+            elapsed = now() - start;
+        } while (elapsed < BENCH_MIN_SECONDS);
+
+        print_row(name, len, blocks, mode, 0, iterations, elapsed, file_allocs);
+    }
+    return 1;
+}
+
+// hops every frame's image data with gifmetadata_walk_subblocks alone
+void bench_walker(const char *name, const gifsynth_buf *b, const size_t *chains, int frames) {
+    int iterations = 0;
+    size_t terminators = 0;
+    double start = now();
+    double elapsed;
+
+    do {
+        for (int f = 0; f < frames; f++) {
+            size_t rest = 0;
+            unsigned char last_len = 0;
+            size_t hops = 0;
+            size_t end = gifmetadata_walk_subblocks(b->data, b->len, chains[f], &rest, &last_len, &hops);
+            terminators += end < b->len && b->data[end] == 0;
+        }
+        iterations++;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    if (terminators != (size_t)frames * iterations)
+        iterations = 0;
+    print_row(name, b->len, frames, "walker", 0, iterations, elapsed, -1);
+}
+
+int read_file(const char *path, gifsynth_buf *b) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return 0;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        if (b->len + n > b->size) {
+            size_t size = (b->len + n) * 2;
+            unsigned char *data = realloc(b->data, size);
+            if (data == NULL) {
+                fclose(f);
+                return 0;
+            }
+            b->data = data;
+            b->size = size;
+        }
+        memcpy(b->data + b->len, buf, n);
+        b->len += n;
+    }
+    int failed = ferror(f);
+    fclose(f);
+    return !failed;
+}
+
+int main(int argc, char **argv) {
+    bench_pool = gifmetadata_pool_new(&gifmetadata_default_allocator, 1);
+    if (bench_pool == NULL) {
+        fprintf(stderr, "ERROR Memory alloc failure\n");
+        return 3;
+    }
+    printf("case\tbytes\tblocks\tmode\tchunk\titerations\tmb_per_s\tblocks_per_s\tallocs_per_file\n");
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            gifsynth_buf b = { NULL, 0, 0, 0 };
+            if (!read_file(argv[i], &b)) {
+                fprintf(stderr, "ERROR Failed to read %s\n", argv[i]);
+                free(b.data);
+                return 1;
+            }
+            int agreed = bench_file(argv[i], b.data, b.len);
+            free(b.data);
+            if (!agreed)
+                return 1;
+        }
+        return 0;
+    }
+
+    for (const gifsynth_case *c = gifsynth_cases; c->name != NULL; c++) {
+        gifsynth_buf b = { NULL, 0, 0, 0 };
+        size_t *chains = malloc(sizeof(size_t) * (c->params.frames > 0 ? c->params.frames : 1));
+        if (chains == NULL || !gifsynth_make(&b, &c->params, chains)) {
+            fprintf(stderr, "ERROR Buffer memory alloc failure\n");
+            free(chains);
+            free(b.data);
+            return 3;
+        }
+
+        int agreed = bench_file(c->name, b.data, b.len);
+        if (agreed)
+            bench_walker(c->name, &b, chains, c->params.frames);
+        free(chains);
+        free(b.data);
+        if (!agreed)
+            return 1;
+    }
+    return 0;
+}
@@ -21,94 +21,1728 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
-#include <math.h>
+#include <dirent.h>
+#include <strings.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "cli.h"
+#include "jobs.h"
 #include "gifmetadata.h"
+#include "gifwrite.h"
+#include "gifindex.h"
+#include "gifdedupe.h"
+#include "gifout.h"
+#include "gifaio.h"
+#include "gifserver.h"
 
 #define EXIT_IO_ERROR 2
 #define EXIT_MEM_ERROR 3
 #define EXIT_PARSE_ERROR 4
 
 #define CHUNK_SIZE 2048
+// with a checkpoint file the parser state is saved whenever this many more
+// bytes have been read
+#define CHECKPOINT_INTERVAL (1 << 20)
 
 const unsigned char comment_extension[] = { 0x21, 0xfe };
 
-int all_flag = 0;
-int verbose_flag = 0;
+// options shared by every scan, set once from the command line
+typedef struct scan_options {
+    int all_flag;
+    int verbose_flag;
+    int mmap_flag;
+    // print parser statistics and timings for every file
+    int dev_flag;
+    // write the comments into the input itself, replacing its comments
+    // unless keep_flag is set
+    int in_place_flag;
+    int keep_flag;
+    // copy the input without its comments, plain text and applications,
+    // either the ones named or all but the looping ones
+    int scrub_flag;
+    const char **scrub_applications;
+    size_t scrub_applications_len;
 
-int output_comments = 1;
+    int output_comments;
 
-// file buffer
-unsigned char *buf;
+    // when scanning more than one file, output is prefixed with the path of
+    // the file being scanned
+    int batch_flag;
 
-// have written comments to output
-int w_comments = 0;
-int w_chunk_i = 0;
-FILE *w_out = NULL;
-cli_flag_arg *comment_flags = NULL;
+    // comments to write and where to write the gif with them
+    FILE *w_out;
+    cli_flag_arg *comment_flags;
 
-void extension_cb(gifmetadata_state *s, gifmetadata_extension_info *extension) {
-    if (extension == NULL)
+    // answers unchanged files and records the others when scanning
+    gifindex *index;
+    // reuses the results of files with identical content
+    gifdedupe *dedupe;
+
+    // GIFMETADATA_QUERY_* fields printed instead of the usual output, files
+    // are only read until they are found
+    unsigned int query;
+    int query_comments;
+
+    // frame timeline, see frame_cb
+    int timeline_flag;
+    // decoded pixel statistics, see decode_cb
+    int pixels_flag;
+
+    // parser state file, the single input is read as a stream from where the
+    // state stopped and saved as it goes
+    const char *checkpoint;
+
+    // GIFOUT_* format of the results, records replace the text output
+    int format;
+} scan_options;
+
+// state of a single scanning job, the user context of the parser callbacks
+typedef struct scan_ctx {
+    const scan_options *opts;
+    gifmetadata_state *s;
+    gifmetadata_callbacks cb;
+
+    // file buffer
+    unsigned char *buf;
+
+    // destinations for results and diagnostics of the current file
+    FILE *out;
+    FILE *err;
+    const char *path;
+
+    // totals of the current file's frames with the timeline flag
+    size_t frames;
+    uint64_t duration;
+
+    // have written comments to output
+    int w_comments;
+    size_t w_chunk_i;
+
+    // the current file's record for the index or the dedupe cache, while
+    // recording
+    int recording;
+    gifindex_builder record;
+
+    // structured output of every file of the job, flushed to out once it
+    // grows past GIFOUT_FLUSH_SIZE. the size and first error of the current
+    // file go in its record
+    gifout records;
+    uint64_t size;
+    char error[256];
+} scan_ctx;
+
+// prints a diagnostic, tagged with the current path in batch mode
+void report(scan_ctx *ctx, const char *level, const char *fmt, ...) {
+    va_list ap;
+    fprintf(ctx->err, "%s ", level);
+    if (ctx->path != NULL)
+        fprintf(ctx->err, "%s: ", ctx->path);
+    va_start(ap, fmt);
+    vfprintf(ctx->err, fmt, ap);
+    va_end(ap);
+
+    if (ctx->opts->format != GIFOUT_TEXT && ctx->error[0] == '\0' && strcmp(level, "ERROR") == 0) {
+        va_start(ap, fmt);
+        vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+        va_end(ap);
+        ctx->error[strcspn(ctx->error, "\n")] = '\0';
+    }
+}
+
+void print_path_prefix(scan_ctx *ctx) {
+    if (ctx->path != NULL)
+        fprintf(ctx->out, "%s: ", ctx->path);
+}
+
+void extension_cb(void *user, gifmetadata_state *s, const gifmetadata_extension_info *extension) {
+    scan_ctx *ctx = user;
+    if (ctx->recording)
+        gifindex_builder_extension(&ctx->record, extension);
+    if (ctx->opts->format != GIFOUT_TEXT) {
+        if (extension->type == comment || ctx->opts->all_flag)
+            gifout_extension(&ctx->records, extension);
         return;
-    if (all_flag) {
+    }
+    // buffers are not NUL terminated with GIFMETADATA_FLAG_ZERO_COPY, print
+    // up to the first NUL within the buffer
+    int str_len = strnlen((char *)extension->buffer, extension->buffer_len);
+    if (ctx->opts->query) {
+        // comments counts those before this one
+        if (extension->type == comment && (ctx->opts->query & GIFMETADATA_QUERY_COMMENTS) && s->comments < s->query_comments) {
+            print_path_prefix(ctx);
+            fprintf(ctx->out, "%.*s\n", str_len, extension->buffer);
+        }
+    } else if (ctx->opts->all_flag) {
+        print_path_prefix(ctx);
         switch (extension->type) {
         case plain_text:
-            printf("Plain text: %s\n", extension->buffer);
+            fprintf(ctx->out, "Plain text: %.*s\n", str_len, extension->buffer);
             break;
         case application:
-            printf("Application: %s (%ld bytes)\n", extension->buffer, extension->buffer_len);
+            fprintf(ctx->out, "Application: %.*s (%ld bytes)\n", str_len, extension->buffer, extension->buffer_len);
             break;
         case application_subblock:
-            printf("Application sub-block (%ld bytes)\n", extension->buffer_len);
+            fprintf(ctx->out, "Application sub-block (%ld bytes)\n", extension->buffer_len);
             break;
         case comment:
-            printf("Comment: %s (%ld bytes)\n", extension->buffer, extension->buffer_len);
+            fprintf(ctx->out, "Comment: %.*s (%ld bytes)\n", str_len, extension->buffer, extension->buffer_len);
+        }
+    } else if (ctx->opts->output_comments) {
+        if (extension->type == comment) {
+            print_path_prefix(ctx);
+            fprintf(ctx->out, "%.*s\n", str_len, extension->buffer);
+        }
+    }
+}
+
+void frame_cb(void *user, gifmetadata_state *s, const gifmetadata_frame *frame) {
+    scan_ctx *ctx = user;
+    ctx->frames++;
+    ctx->duration += frame->delay;
+    if (!ctx->opts->all_flag)
+        return;
+    if (ctx->opts->format != GIFOUT_TEXT) {
+        gifout_frame(&ctx->records, frame);
+        return;
+    }
+    print_path_prefix(ctx);
+    fprintf(ctx->out, "Frame %zu: %dx%d at %d,%d, delay %d ms, disposal %d",
+        frame->index, frame->width, frame->height, frame->left, frame->top, frame->delay * 10, frame->disposal);
+    if (frame->transparent_index >= 0)
+        fprintf(ctx->out, ", transparent %d", frame->transparent_index);
+    if (frame->interlaced)
+        fprintf(ctx->out, ", interlaced");
+    if (frame->local_color_table_len > 0)
+        fprintf(ctx->out, ", local color table");
+    fprintf(ctx->out, "\n");
+}
+
+void decode_cb(void *user, gifmetadata_state *s, const gifmetadata_decode *decode) {
+    scan_ctx *ctx = user;
+    if (ctx->opts->format != GIFOUT_TEXT) {
+        gifout_pixels(&ctx->records, decode);
+        return;
+    }
+    int colors = 0;
+    for (int i = 0; i < 256; i++)
+        colors += decode->histogram[i] > 0;
+    print_path_prefix(ctx);
+    fprintf(ctx->out, "Frame %zu pixels: %zu of %zu, checksum %08x, %d colors",
+        decode->index, decode->pixels, decode->expected_pixels, decode->checksum, colors);
+    if (decode->errors & GIFMETADATA_DECODE_TRUNCATED)
+        fprintf(ctx->out, ", truncated");
+    if (decode->errors & GIFMETADATA_DECODE_CORRUPT)
+        fprintf(ctx->out, ", corrupt");
+    if (decode->errors & GIFMETADATA_DECODE_EXCESS)
+        fprintf(ctx->out, ", excess");
+    fprintf(ctx->out, "\n");
+}
+
+// prints the error for a failed parse and returns the exit code, zero if the
+// parse succeeded
+int parse_status_exit_code(scan_ctx *ctx, int parse_status) {
+    switch (parse_status) {
+    case GIFMETADATA_SUCCESS:
+    case GIFMETADATA_QUERY_SATISFIED:
+        return 0;
+    case GIFMETADATA_INVALID_SIG:
+        report(ctx, "ERROR", "Unsupported GIF version (invalid signature)\n");
+        return EXIT_PARSE_ERROR;
+    case GIFMETADATA_COMMENT_EXCEEDS_BOUNDS:
+        report(ctx, "ERROR", "Comment exceeds maximum comment length\n");
+        return EXIT_PARSE_ERROR;
+    case GIFMETADATA_ALLOC_FAILED:
+        report(ctx, "ERROR", "Failed to allocate memory\n");
+        return EXIT_MEM_ERROR;
+    case GIFMETADATA_IO_ERROR:
+        report(ctx, "ERROR", "Error reading input file\n");
+        return EXIT_IO_ERROR;
+    default:
+        report(ctx, "ERROR", "Unknown error\n");
+        return 1;
+    }
+}
+
+// writes every comment given on the command line as a comment extension
+void write_comment_blocks(scan_ctx *ctx, FILE *w_out) {
+    cli_flag_arg *comment = ctx->opts->comment_flags;
+    while (comment != NULL) {
+        fwrite(&comment_extension, 1, sizeof(comment_extension), w_out);
+        unsigned char len;
+        if (comment->string_len > 255) {
+            report(ctx, "WARNING", "Comment length is longer than 255 characters, this is may cause incompatibility issues\n");
+            len = 255;
+        } else {
+            len = (unsigned char)comment->string_len;
+        }
+        fwrite(&len, 1, 1, w_out);
+        fwrite(comment->string, 1, comment->string_len, w_out);
+        fputc(0, w_out);
+
+        comment = comment->next;
+    }
+}
+
+void state_cb(void *user, gifmetadata_state *s, enum gifmetadata_read_state state) {
+    // state is called on the exact byte of first encounter
+    scan_ctx *ctx = user;
+    FILE *w_out = ctx->opts->w_out;
+    if (ctx->recording && state == image_descriptor)
+        ctx->record.frames++;
+
+    int write_comment = w_out != NULL && ctx->opts->comment_flags != NULL && state != searching && state > global_color_table && !ctx->w_comments;
+    if (!write_comment) {
+        return;
+    }
+
+    if (s->chunk_i > 0) {
+        // write to before the current byte
+        // no need to minus one as index starts at zero
+        fwrite(s->chunk, 1, s->chunk_i, w_out);
+        ctx->w_chunk_i = s->chunk_i;
+    }
+
+    write_comment_blocks(ctx, w_out);
+    ctx->w_comments = 1; 
+}
+
+// injects the comments into a seekable input, copying everything around them
+// in the kernel where possible. returns the exit code, or -1 when the
+// insertion point was not found and the input has to be streamed instead
+int inject_comments(scan_ctx *ctx, FILE *f, off_t size) {
+    int in_fd = fileno(f);
+    FILE *w_out = ctx->opts->w_out;
+
+    off_t offset;
+    int exit_code = parse_status_exit_code(ctx, gifwrite_find_first_block(ctx->s, in_fd, &offset));
+    if (exit_code != 0)
+        return exit_code;
+    if (offset < 0) {
+        gifmetadata_state_reset(ctx->s);
+        return -1;
+    }
+
+    // header, logical screen descriptor and global color table, then the
+    // comments and everything else
+    if (fflush(w_out) != 0 || gifwrite_copy_range(in_fd, 0, fileno(w_out), offset) != GIFWRITE_SUCCESS) {
+        report(ctx, "ERROR", "Error writing output file\n");
+        return EXIT_IO_ERROR;
+    }
+    write_comment_blocks(ctx, w_out);
+    ctx->w_comments = 1;
+    if (fflush(w_out) != 0 || gifwrite_copy_range(in_fd, offset, fileno(w_out), size - offset) != GIFWRITE_SUCCESS) {
+        report(ctx, "ERROR", "Error writing output file\n");
+        return EXIT_IO_ERROR;
+    }
+    return 0;
+}
+
+// streams the input to the output without the blocks being scrubbed, the new
+// comments taking their place after the global color table
+int scrub_file(scan_ctx *ctx, FILE *f) {
+    gifwrite_scrub sc;
+    memset(&sc, 0, sizeof(gifwrite_scrub));
+    sc.applications = ctx->opts->scrub_applications;
+    sc.applications_len = ctx->opts->scrub_applications_len;
+
+    char *blocks = NULL;
+    size_t blocks_len = 0;
+    if (ctx->opts->comment_flags != NULL) {
+        FILE *mem = open_memstream(&blocks, &blocks_len);
+        if (mem == NULL) {
+            report(ctx, "ERROR", "Failed to allocate memory\n");
+            return EXIT_MEM_ERROR;
+        }
+        write_comment_blocks(ctx, mem);
+        fclose(mem);
+        sc.insert = (unsigned char *)blocks;
+        sc.insert_len = blocks_len;
+    }
+
+    FILE *w_out = ctx->opts->w_out;
+    int parse_status = GIFMETADATA_SUCCESS;
+    int failed = fflush(w_out) != 0;
+    failed = failed || gifwrite_scrub_fd(ctx->s, fileno(f), fileno(w_out), &sc, &parse_status) != GIFWRITE_SUCCESS;
+    free(blocks);
+    if (failed) {
+        report(ctx, "ERROR", "Error writing output file\n");
+        return EXIT_IO_ERROR;
+    }
+
+    int exit_code = parse_status_exit_code(ctx, parse_status);
+    if (exit_code == 0 && ctx->opts->verbose_flag)
+        report(ctx, "VERBOSE", "Scrubbed %zu blocks, %zu bytes\n", sc.removed, sc.removed_bytes);
+    return exit_code;
+}
+
+int report_file(scan_ctx *ctx, size_t total_b, int parsed_whole);
+
+// restores the parser state saved in the checkpoint file, if there is one,
+// and moves f to where it stopped. input that cannot seek has to continue
+// from there itself. returns the exit code on failure
+int load_checkpoint(scan_ctx *ctx, FILE *f, int seekable) {
+    const char *path = ctx->opts->checkpoint;
+    FILE *c = fopen(path, "rb");
+    if (c == NULL) {
+        if (errno == ENOENT)
+            return 0;
+        report(ctx, "ERROR", "Failed to open checkpoint '%s'\n", path);
+        return EXIT_IO_ERROR;
+    }
+
+    struct stat st;
+    unsigned char *buffer = NULL;
+    int exit_code = 0;
+    if (fstat(fileno(c), &st) != 0) {
+        exit_code = EXIT_IO_ERROR;
+    } else if ((buffer = malloc(st.st_size > 0 ? st.st_size : 1)) == NULL) {
+        exit_code = EXIT_MEM_ERROR;
+    } else if (fread(buffer, 1, st.st_size, c) != (size_t)st.st_size) {
+        exit_code = EXIT_IO_ERROR;
+    }
+    fclose(c);
+    if (exit_code == EXIT_IO_ERROR)
+        report(ctx, "ERROR", "Failed to read checkpoint '%s'\n", path);
+    if (exit_code == EXIT_MEM_ERROR)
+        report(ctx, "ERROR", "Failed to allocate memory\n");
+
+    if (exit_code == 0) {
+        switch (gifmetadata_state_deserialize(ctx->s, buffer, st.st_size)) {
+        case GIFMETADATA_SUCCESS:
+            break;
+        case GIFMETADATA_ALLOC_FAILED:
+            report(ctx, "ERROR", "Failed to allocate memory\n");
+            exit_code = EXIT_MEM_ERROR;
+            break;
+        default:
+            report(ctx, "ERROR", "Checkpoint '%s' is damaged or from another version\n", path);
+            exit_code = EXIT_PARSE_ERROR;
+        }
+    }
+    free(buffer);
+    if (exit_code != 0)
+        return exit_code;
+
+    if (seekable && fseeko(f, ctx->s->file_i, SEEK_SET) != 0) {
+        report(ctx, "ERROR", "Failed to seek input to byte %zu\n", ctx->s->file_i);
+        return EXIT_IO_ERROR;
+    }
+    if (ctx->opts->verbose_flag)
+        report(ctx, "VERBOSE", "Resuming from byte %zu\n", ctx->s->file_i);
+    return 0;
+}
+
+// saves the parser state to the checkpoint file. it is written beside it and
+// renamed over it, so a crash leaves either the old or the new state
+int save_checkpoint(scan_ctx *ctx) {
+    const char *path = ctx->opts->checkpoint;
+    size_t len = gifmetadata_state_serialize(ctx->s, NULL, 0);
+    unsigned char *buffer = malloc(len);
+    char *tmp = malloc(strlen(path) + 5);
+    if (buffer == NULL || tmp == NULL) {
+        free(buffer);
+        free(tmp);
+        report(ctx, "ERROR", "Failed to allocate memory\n");
+        return EXIT_MEM_ERROR;
+    }
+    gifmetadata_state_serialize(ctx->s, buffer, len);
+    sprintf(tmp, "%s.tmp", path);
+
+    FILE *c = fopen(tmp, "wb");
+    int failed = c == NULL;
+    if (c != NULL) {
+        failed |= fwrite(buffer, 1, len, c) != len;
+        failed |= fclose(c) != 0;
+    }
+    if (!failed)
+        failed = rename(tmp, path) != 0;
+    if (failed) {
+        report(ctx, "ERROR", "Failed to write checkpoint '%s'\n", path);
+        unlink(tmp);
+    }
+    free(buffer);
+    free(tmp);
+    return failed ? EXIT_IO_ERROR : 0;
+}
+
+// clears the parser state and totals before reading a file
+void reset_scan(scan_ctx *ctx) {
+    gifmetadata_state_reset(ctx->s);
+    ctx->w_comments = 0;
+    ctx->frames = 0;
+    ctx->duration = 0;
+}
+
+// parses an already open file and reports on it, returns the exit code for
+// the file
+int parse_file(scan_ctx *ctx, FILE *f) {
+    gifmetadata_state *s = ctx->s;
+    FILE *w_out = ctx->opts->w_out;
+    size_t total_b = 0;
+    size_t b;
+    int exit_code = -1;
+    // whether the parser saw the whole file rather than only its header
+    int parsed_whole = 1;
+
+    reset_scan(ctx);
+
+    struct stat st;
+    int seekable = fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
+    if (w_out != NULL && ctx->opts->comment_flags != NULL && seekable && !ctx->opts->scrub_flag) {
+        // comments are only inserted after the global color table, the rest
+        // of the file is copied around them
+        exit_code = inject_comments(ctx, f, st.st_size);
+        if (exit_code > 0)
+            return exit_code;
+    }
+
+    if (ctx->opts->scrub_flag) {
+        exit_code = scrub_file(ctx, f);
+        if (exit_code != 0)
+            return exit_code;
+        total_b = s->file_i;
+    } else if (exit_code == 0) {
+        // the copy only found where the comments go, the input is parsed
+        // again for what is reported on it and to warn when it is cut off.
+        // reads are of block headers only, as with an input not written out
+        gifmetadata_state_reset(s);
+        exit_code = parse_status_exit_code(ctx, gifmetadata_parse_fd_v2(s, fileno(f), &ctx->cb));
+        if (exit_code != 0)
+            return exit_code;
+        total_b = st.st_size;
+    } else if (w_out == NULL && seekable && ctx->opts->checkpoint == NULL) {
+        // nothing has to be copied to an output, so a seekable input only
+        // needs its block headers read, or is mapped whole when asked
+        int parse_status;
+        if (ctx->opts->mmap_flag)
+            parse_status = gifmetadata_parse_mmap_v2(s, fileno(f), &ctx->cb);
+        else
+            parse_status = gifmetadata_parse_fd_v2(s, fileno(f), &ctx->cb);
+        exit_code = parse_status_exit_code(ctx, parse_status);
+        if (exit_code != 0)
+            return exit_code;
+        total_b = st.st_size;
+        if (parse_status == GIFMETADATA_QUERY_SATISFIED)
+            parsed_whole = 0;
+    } else {
+        // otherwise stream the input, e.g. a pipe on stdin
+        size_t checkpoint_i = 0;
+        if (ctx->opts->checkpoint != NULL) {
+            exit_code = load_checkpoint(ctx, f, seekable);
+            if (exit_code != 0)
+                return exit_code;
+            total_b = checkpoint_i = s->file_i;
+        }
+        while ((b = fread(ctx->buf, 1, CHUNK_SIZE, f)) != 0) {
+            ctx->w_chunk_i = 0;
+            int parse_status = gifmetadata_parse_gif_v2(s, ctx->buf, b, &ctx->cb);
+            exit_code = parse_status_exit_code(ctx, parse_status);
+            if (exit_code != 0)
+                return exit_code;
+            total_b += b;
+
+            // before the next loop, write remaining
+            if (w_out != NULL) {
+                fwrite(ctx->buf+ctx->w_chunk_i, 1, b-ctx->w_chunk_i, w_out);
+            }
+            // queries are only ever made when nothing is written
+            if (parse_status == GIFMETADATA_QUERY_SATISFIED) {
+                parsed_whole = 0;
+                break;
+            }
+            if (ctx->opts->checkpoint != NULL && s->file_i - checkpoint_i >= CHECKPOINT_INTERVAL) {
+                exit_code = save_checkpoint(ctx);
+                if (exit_code != 0)
+                    return exit_code;
+                checkpoint_i = s->file_i;
+            }
+        }
+
+        if (ferror(f) != 0) {
+            report(ctx, "ERROR", "Error reading input file\n");
+            return EXIT_IO_ERROR;
+        }
+        if (ctx->opts->checkpoint != NULL && parsed_whole && s->read_state != trailer) {
+            // the input stopped short, e.g. a cut off upload, keep the state
+            // to resume from with the rest of it
+            exit_code = save_checkpoint(ctx);
+            if (exit_code != 0)
+                return exit_code;
+            if (ctx->opts->verbose_flag)
+                report(ctx, "VERBOSE", "Saved checkpoint at byte %zu\n", s->file_i);
+        } else {
+            if (parsed_whole)
+                gifmetadata_parse_end(s, &ctx->cb);
+            // nothing is left to resume
+            if (ctx->opts->checkpoint != NULL)
+                unlink(ctx->opts->checkpoint);
+        }
+    }
+
+    return report_file(ctx, total_b, parsed_whole);
+}
+
+// reports on a file once the parser state holds its header, returns the
+// exit code for the file
+int report_file(scan_ctx *ctx, size_t total_b, int parsed_whole) {
+    gifmetadata_state *s = ctx->s;
+    ctx->size = total_b;
+    if (total_b == 0) {
+        report(ctx, "ERROR", "Empty file\n");
+        return EXIT_IO_ERROR;
+    }
+    if (s->gif_version == 0) {
+        report(ctx, "ERROR", "Invalid GIF file (missing signature)\n");
+        return EXIT_IO_ERROR;
+    }
+    // check for unexpected eof
+    if (parsed_whole && s->read_state != trailer) {
+        // non-fatal status code
+        report(ctx, "WARNING", "Unexpected end of file\n");
+    }
+
+    if (ctx->opts->verbose_flag) {
+        switch (s->gif_version) {
+        case gif87a:
+            report(ctx, "VERBOSE", "GIF version: 87a\n");
+            break;
+        case gif89a:
+            report(ctx, "VERBOSE", "GIF version: 89a\n");
+            break;
+        default:
+            report(ctx, "VERBOSE", "GIF version: unknown (%d)\n", s->gif_version);
+        }
+
+        report(ctx, "VERBOSE", "File size: %ld bytes\n", total_b);
+        report(ctx, "VERBOSE", "Canvas width: %d\n", s->canvas_width);
+        report(ctx, "VERBOSE", "Canvas height: %d\n", s->canvas_height);
+    }
+
+    // the rest is in the file's record
+    if (ctx->opts->format != GIFOUT_TEXT)
+        return 0;
+
+    // queried comments were printed as they were found
+    if (ctx->opts->query & GIFMETADATA_QUERY_DIMENSIONS) {
+        print_path_prefix(ctx);
+        fprintf(ctx->out, "Canvas width: %d\n", s->canvas_width);
+        print_path_prefix(ctx);
+        fprintf(ctx->out, "Canvas height: %d\n", s->canvas_height);
+    }
+    if (ctx->opts->query & GIFMETADATA_QUERY_LOOP_COUNT) {
+        print_path_prefix(ctx);
+        if (s->loop_count >= 0)
+            fprintf(ctx->out, "Loop count: %d\n", s->loop_count);
+        else
+            fprintf(ctx->out, "Loop count: none\n");
+    }
+    if (ctx->opts->timeline_flag) {
+        // delays are in hundredths of a second
+        print_path_prefix(ctx);
+        fprintf(ctx->out, "Frames: %zu\n", ctx->frames);
+        print_path_prefix(ctx);
+        fprintf(ctx->out, "Duration: %.2f s\n", ctx->duration / 100.0);
+        if (ctx->duration > 0) {
+            print_path_prefix(ctx);
+            fprintf(ctx->out, "Average fps: %.2f\n", ctx->frames * 100.0 / ctx->duration);
+        }
+    }
+
+    return 0;
+}
+
+// prints the statistics the parser gathered for the current file, elapsed is
+// the time taken by the whole scan including reads
+void print_stats(scan_ctx *ctx, double elapsed) {
+    const gifmetadata_stats *st = &ctx->s->stats;
+    uint64_t parse_ns = 0;
+    for (int i = 0; i < GIFMETADATA_READ_STATES; i++)
+        parse_ns += st->state_ns[i];
+
+    report(ctx, "DEV", "Time: %.3f ms, in parser %.3f ms\n", elapsed * 1e3, parse_ns / 1e6);
+    report(ctx, "DEV", "Blocks: %zu, sub-blocks: %zu, frames: %zu\n", st->blocks, st->subblocks, st->frames);
+    report(ctx, "DEV", "Scratchpad reallocs: %zu\n", st->scratchpad_reallocs);
+    report(ctx, "DEV", "Callbacks: %zu extension, %zu state, %zu payload\n",
+        st->extension_callbacks, st->state_callbacks, st->payload_callbacks);
+    for (int i = 0; i < GIFMETADATA_READ_STATES; i++) {
+        if (st->state_bytes[i] == 0 && st->state_ns[i] == 0)
+            continue;
+        report(ctx, "DEV", "%-26s %12zu bytes %10.3f ms\n",
+            gifmetadata_read_state_name(i), st->state_bytes[i], st->state_ns[i] / 1e6);
+    }
+}
+
+int scan_file(scan_ctx *ctx, FILE *f) {
+    if (!ctx->opts->dev_flag)
+        return parse_file(ctx, f);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int exit_code = parse_file(ctx, f);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    print_stats(ctx, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return exit_code;
+}
+
+// answers a file from a record with the same output as parsing it, source
+// names where the record came from for -d
+int replay_record(scan_ctx *ctx, const gifindex_record *r, const char *source) {
+    gifmetadata_state *s = ctx->s;
+    gifmetadata_state_reset(s);
+    s->gif_version = r->gif_version;
+    s->canvas_width = r->canvas_width;
+    s->canvas_height = r->canvas_height;
+    s->read_state = r->complete ? trailer : eof;
+
+    const gifindex_extension *e = gifindex_first_extension(r);
+    for (uint32_t i = 0; i < r->extension_count; i++, e = gifindex_next_extension(e)) {
+        gifmetadata_extension_info extension;
+        extension.type = e->type;
+        // application sub-blocks are recorded without their bytes
+        extension.buffer = e->stored_len > 0 ? (unsigned char *)gifindex_extension_payload(e) : (unsigned char *)"";
+        extension.buffer_len = e->len;
+        extension.block_offset = e->block_offset;
+        extension_cb(ctx, s, &extension);
+    }
+
+    if (ctx->opts->dev_flag)
+        report(ctx, "DEV", "Answered from %s\n", source);
+    return report_file(ctx, r->size, 1);
+}
+
+// starts the structured record of a file, path is NULL for stdin
+void begin_file_record(scan_ctx *ctx, const char *path) {
+    if (ctx->opts->format == GIFOUT_TEXT)
+        return;
+    // nothing of the previous file is reported if this one cannot be read
+    gifmetadata_state_reset(ctx->s);
+    ctx->frames = 0;
+    ctx->duration = 0;
+    ctx->size = 0;
+    ctx->error[0] = '\0';
+    gifout_begin_file(&ctx->records, path);
+}
+
+// writes the buffered records to the job's output, returns an exit code
+int flush_records(scan_ctx *ctx) {
+    switch (gifout_flush(&ctx->records, ctx->out)) {
+    case GIFOUT_SUCCESS:
+        return 0;
+    case GIFOUT_ALLOC_FAILURE:
+        fprintf(ctx->err, "ERROR Memory alloc failure\n");
+        return EXIT_MEM_ERROR;
+    default:
+        fprintf(ctx->err, "ERROR Failed to write output\n");
+        return EXIT_IO_ERROR;
+    }
+}
+
+// ends the record of a file scanned with exit_code, returns the exit code
+int end_file_record(scan_ctx *ctx, int exit_code) {
+    if (ctx->opts->format == GIFOUT_TEXT)
+        return exit_code;
+    gifmetadata_state *s = ctx->s;
+    gifout_file file;
+    file.size = ctx->size;
+    file.gif_version = s->gif_version;
+    file.canvas_width = s->canvas_width;
+    file.canvas_height = s->canvas_height;
+    file.complete = s->read_state == trailer;
+    file.loop_count = s->loop_count;
+    file.frames = ctx->frames;
+    file.duration = ctx->duration;
+    file.error = exit_code != 0 ? ctx->error : NULL;
+    gifout_end_file(&ctx->records, &file);
+
+    if (ctx->records.len >= GIFOUT_FLUSH_SIZE || ctx->records.failed) {
+        int flush_exit_code = flush_records(ctx);
+        if (exit_code == 0)
+            exit_code = flush_exit_code;
+    }
+    return exit_code;
+}
+
+int edit_path(scan_ctx *ctx, const char *path);
+
+// a file opened by open_path
+typedef struct open_file {
+    FILE *f;
+    struct stat st;
+    // st is only filled in for the index and the dedupe cache
+    int have_stat;
+    int indexing;
+    gifdedupe_entry *entry;
+} open_file;
+
+// answers a file from the index or the dedupe cache, or opens it to be
+// parsed. returns the exit code of a file that was answered or could not be
+// opened, -1 once it is open and ready to scan
+int open_path(scan_ctx *ctx, const char *path, open_file *of) {
+    if (ctx->opts->batch_flag)
+        ctx->path = path;
+
+    struct stat *st = &of->st;
+    of->have_stat = (ctx->opts->index != NULL || ctx->opts->dedupe != NULL) && stat(path, st) == 0 && S_ISREG(st->st_mode);
+    of->indexing = ctx->opts->index != NULL && of->have_stat;
+    of->entry = NULL;
+    if (of->indexing) {
+        const gifindex_record *r = gifindex_find(ctx->opts->index, path, st);
+        if (r != NULL)
+            return replay_record(ctx, r, "the index");
+    }
+
+    if (access(path, F_OK) != 0) {
+        report(ctx, "ERROR", "File '%s' cannot be accessed\n", path);
+        return EXIT_IO_ERROR;
+    }
+
+    of->f = fopen(path, "rb");
+    if (of->f == NULL) {
+        report(ctx, "ERROR", "Failed to open file '%s'\n", path);
+        return EXIT_IO_ERROR;
+    }
+
+    gifindex_builder_reset(&ctx->record);
+    if (ctx->opts->dedupe != NULL && of->have_stat) {
+        int dedupe_status;
+        const gifindex_record *r = gifdedupe_lookup(ctx->opts->dedupe, path, fileno(of->f), st, &of->entry, &dedupe_status);
+        if (dedupe_status != GIFDEDUPE_SUCCESS)
+            report(ctx, "WARNING", "Failed to check the file for duplicates\n");
+        if (r != NULL) {
+            fclose(of->f);
+            // a duplicate still gets its own index record
+            ctx->recording = of->indexing;
+            ctx->record.frames = r->frames;
+            int exit_code = replay_record(ctx, r, "an identical file");
+            ctx->recording = 0;
+            if (of->indexing && exit_code == 0 && gifindex_add(ctx->opts->index, path, st, ctx->s, &ctx->record) != GIFINDEX_SUCCESS)
+                report(ctx, "WARNING", "Failed to add the file to the index\n");
+            return exit_code;
+        }
+    }
+
+    ctx->recording = of->indexing || of->entry != NULL;
+    return -1;
+}
+
+// closes a file from open_path once scanned with exit_code, recording it
+// in the index and the dedupe cache. returns the exit code
+int close_path(scan_ctx *ctx, const char *path, open_file *of, int exit_code) {
+    ctx->recording = 0;
+    fclose(of->f);
+
+    if (of->indexing && exit_code == 0 && gifindex_add(ctx->opts->index, path, &of->st, ctx->s, &ctx->record) != GIFINDEX_SUCCESS)
+        report(ctx, "WARNING", "Failed to add the file to the index\n");
+    if (of->entry != NULL && exit_code == 0) {
+        gifindex_record *r = gifindex_new_record(path, &of->st, ctx->s, &ctx->record);
+        if (r != NULL)
+            gifdedupe_set_record(ctx->opts->dedupe, of->entry, r);
+    }
+    return exit_code;
+}
+
+// opens and scans a single file
+int read_path(scan_ctx *ctx, const char *path) {
+    if (ctx->opts->in_place_flag)
+        return edit_path(ctx, path);
+
+    open_file of;
+    int exit_code = open_path(ctx, path, &of);
+    if (exit_code >= 0)
+        return exit_code;
+    return close_path(ctx, path, &of, scan_file(ctx, of.f));
+}
+
+// scans a single file, writing its record with structured output
+int scan_path(scan_ctx *ctx, const char *path) {
+    begin_file_record(ctx, path);
+    return end_file_record(ctx, read_path(ctx, path));
+}
+
+// scans a gif held whole in memory, e.g. sent to the server
+int scan_buffer(scan_ctx *ctx, unsigned char *data, size_t len) {
+    reset_scan(ctx);
+    int parse_status = len > 0 ? gifmetadata_parse_gif_v2(ctx->s, data, len, &ctx->cb) : GIFMETADATA_SUCCESS;
+    int exit_code = parse_status_exit_code(ctx, parse_status);
+    if (exit_code != 0)
+        return exit_code;
+    if (parse_status != GIFMETADATA_QUERY_SATISFIED)
+        gifmetadata_parse_end(ctx->s, &ctx->cb);
+    return report_file(ctx, len, parse_status != GIFMETADATA_QUERY_SATISFIED);
+}
+
+// comment blocks and landmarks of a file found for an in-place edit
+typedef struct edit_scan {
+    off_t *starts;
+    off_t *ends;
+    size_t len;
+    size_t size;
+    off_t first_block;
+    off_t trailer;
+    int failed;
+} edit_scan;
+
+void edit_payload_cb(void *user, gifmetadata_state *s, const gifmetadata_payload *payload) {
+    edit_scan *e = user;
+    if (payload->type != comment || payload->event == payload_data)
+        return;
+
+    if (payload->event == payload_begin) {
+        if (e->len == e->size) {
+            size_t size = e->size > 0 ? e->size * 2 : 16;
+            off_t *starts = realloc(e->starts, sizeof(off_t) * size);
+            if (starts != NULL)
+                e->starts = starts;
+            off_t *ends = realloc(e->ends, sizeof(off_t) * size);
+            if (ends != NULL)
+                e->ends = ends;
+            if (starts == NULL || ends == NULL) {
+                e->failed = 1;
+                return;
+            }
+            e->size = size;
+        }
+        e->starts[e->len] = s->block_file_i;
+    } else if (!e->failed) {
+        // ends on the terminator
+        e->ends[e->len++] = payload->offset + 1;
+    }
+}
+
+void edit_state_cb(void *user, gifmetadata_state *s, enum gifmetadata_read_state state) {
+    edit_scan *e = user;
+    if (e->first_block < 0 && state != searching && state > global_color_table)
+        e->first_block = s->file_i - 1;
+    if (state == trailer)
+        e->trailer = s->file_i - 1;
+}
+
+// checks that a comment block is made of well formed sub-blocks, it is about
+// to be overwritten on the parser's word
+int edit_slot_valid(int fd, off_t start, off_t end) {
+    size_t len = end - start;
+    unsigned char *b = malloc(len);
+    if (b == NULL)
+        return 0;
+    int valid = pread(fd, b, len, start) == (ssize_t)len && len >= 3 && b[0] == 0x21 && b[1] == 0xfe;
+    if (valid) {
+        size_t rest = 0;
+        unsigned char last_len = 0;
+        size_t hops = 0;
+        valid = gifmetadata_walk_subblocks(b, len, 2, &rest, &last_len, &hops) == len - 1;
+    }
+    free(b);
+    return valid;
+}
+
+// checks that the len bytes after the trailer are zero padding, anything
+// else may be data that a reader of the file wants kept
+int edit_slack_free(int fd, off_t start, size_t len) {
+    unsigned char *b = malloc(len > 0 ? len : 1);
+    if (b == NULL)
+        return 0;
+    int free_space = pread(fd, b, len, start) == (ssize_t)len;
+    for (size_t i = 0; free_space && i < len; i++)
+        free_space = b[i] == 0;
+    free(b);
+    return free_space;
+}
+
+// edit with its own copy of the bytes to write
+int add_edit(gifwrite_edit *edits, size_t *count, off_t offset, size_t remove_len, const unsigned char *data, size_t data_len, size_t filler_len) {
+    gifwrite_edit *e = &edits[(*count)++];
+    e->offset = offset;
+    e->remove_len = remove_len;
+    e->data_len = data_len + filler_len;
+    e->data = malloc(e->data_len > 0 ? e->data_len : 1);
+    if (e->data == NULL)
+        return 0;
+    if (data_len > 0)
+        memcpy(e->data, data, data_len);
+    gifwrite_filler(e->data + data_len, filler_len);
+    return 1;
+}
+
+// plans the edits writing the new comment blocks into a file, returns 1 when
+// they can be patched in place and 0 when the file has to be rewritten
+int plan_edits(const scan_options *opts, edit_scan *e, int fd, off_t size, const unsigned char *blocks, size_t blocks_len, gifwrite_edit *edits, size_t *count) {
+    const unsigned char trailer_byte = 0x3b;
+    unsigned char *tail = malloc(blocks_len + 1);
+    if (tail == NULL)
+        return -1;
+    memcpy(tail, blocks, blocks_len);
+    tail[blocks_len] = trailer_byte;
+    int failed = 0;
+    int in_place = 1;
+    *count = 0;
+
+    // adjacent comment blocks form one space
+    size_t slots = 0;
+    for (size_t i = 0; i < e->len; i++) {
+        if (slots > 0 && e->starts[i] == e->ends[slots - 1]) {
+            e->ends[slots - 1] = e->ends[i];
+        } else {
+            e->starts[slots] = e->starts[i];
+            e->ends[slots] = e->ends[i];
+            slots++;
+        }
+    }
+    e->len = slots;
+
+    // the space of the existing comments
+    size_t fit = slots;
+    if (!opts->keep_flag) {
+        for (size_t i = 0; i < slots && fit == slots; i++) {
+            size_t len = e->ends[i] - e->starts[i];
+            if (len >= blocks_len && gifwrite_filler(NULL, len - blocks_len))
+                fit = i;
+        }
+    }
+    // or the zero padding after the trailer
+    int slack = e->trailer >= 0 && e->trailer + 1 + (off_t)blocks_len <= size &&
+        edit_slack_free(fd, e->trailer + 1, blocks_len);
+
+    if (fit < slots || slack) {
+        for (size_t i = 0; i < slots && !opts->keep_flag; i++) {
+            size_t len = e->ends[i] - e->starts[i];
+            if (i == fit)
+                failed |= !add_edit(edits, count, e->starts[i], len, blocks, blocks_len, len - blocks_len);
+            else
+                failed |= !add_edit(edits, count, e->starts[i], len, NULL, 0, len);
+        }
+        if (fit == slots || opts->keep_flag)
+            failed |= !add_edit(edits, count, e->trailer, blocks_len + 1, tail, blocks_len + 1, 0);
+    } else {
+        in_place = 0;
+        if (opts->keep_flag) {
+            failed |= !add_edit(edits, count, e->trailer, 0, blocks, blocks_len, 0);
+        } else if (slots == 0) {
+            failed |= !add_edit(edits, count, e->first_block, 0, blocks, blocks_len, 0);
+        } else {
+            for (size_t i = 0; i < slots; i++) {
+                size_t len = e->ends[i] - e->starts[i];
+                failed |= !add_edit(edits, count, e->starts[i], len, blocks, i == 0 ? blocks_len : 0, 0);
+            }
+        }
+    }
+
+    free(tail);
+    return failed ? -1 : in_place;
+}
+
+// replaces or with keep_flag adds to the comments of a file, in place when
+// they fit and otherwise by rewriting it
+int edit_path(scan_ctx *ctx, const char *path) {
+    if (ctx->opts->batch_flag)
+        ctx->path = path;
+
+    FILE *f = fopen(path, "r+b");
+    if (f == NULL) {
+        report(ctx, "ERROR", "Failed to open file '%s' for editing\n", path);
+        return EXIT_IO_ERROR;
+    }
+    int fd = fileno(f);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        report(ctx, "ERROR", "Only regular files can be edited in place\n");
+        fclose(f);
+        return EXIT_IO_ERROR;
+    }
+
+    edit_scan e = { NULL, NULL, 0, 0, -1, -1, 0 };
+    gifmetadata_state *s = ctx->s;
+    gifmetadata_state_reset(s);
+    unsigned int flags = s->flags;
+    s->flags |= GIFMETADATA_FLAG_STREAM_PAYLOAD;
+    gifmetadata_callbacks cb = { .state_cb = &edit_state_cb, .payload_cb = &edit_payload_cb, .user = &e };
+    int exit_code = parse_status_exit_code(ctx, gifmetadata_parse_fd_v2(s, fd, &cb));
+    s->flags = flags;
+
+    if (exit_code == 0 && e.failed) {
+        report(ctx, "ERROR", "Failed to allocate memory\n");
+        exit_code = EXIT_MEM_ERROR;
+    }
+    if (exit_code == 0 && s->gif_version == 0) {
+        report(ctx, "ERROR", "Invalid GIF file (missing signature)\n");
+        exit_code = EXIT_PARSE_ERROR;
+    }
+    if (exit_code == 0 && e.trailer < 0) {
+        report(ctx, "ERROR", "Unexpected end of file, not editing\n");
+        exit_code = EXIT_PARSE_ERROR;
+    }
+    for (size_t i = 0; exit_code == 0 && i < e.len; i++) {
+        if (!edit_slot_valid(fd, e.starts[i], e.ends[i])) {
+            report(ctx, "ERROR", "Malformed comment block at offset %lld, not editing\n", (long long)e.starts[i]);
+            exit_code = EXIT_PARSE_ERROR;
+        }
+    }
+
+    // the new comment blocks
+    char *blocks = NULL;
+    size_t blocks_len = 0;
+    gifwrite_edit *edits = NULL;
+    size_t count = 0;
+    if (exit_code == 0) {
+        FILE *mem = open_memstream(&blocks, &blocks_len);
+        if (mem != NULL) {
+            write_comment_blocks(ctx, mem);
+            fclose(mem);
+        }
+        edits = malloc(sizeof(gifwrite_edit) * (e.len + 1));
+        if (mem == NULL || edits == NULL) {
+            report(ctx, "ERROR", "Failed to allocate memory\n");
+            exit_code = EXIT_MEM_ERROR;
+        }
+    }
+
+    if (exit_code == 0) {
+        int in_place = plan_edits(ctx->opts, &e, fd, st.st_size, (unsigned char *)blocks, blocks_len, edits, &count);
+        if (in_place < 0) {
+            report(ctx, "ERROR", "Failed to allocate memory\n");
+            exit_code = EXIT_MEM_ERROR;
+        } else if (in_place) {
+            if (gifwrite_patch(fd, edits, count) != GIFWRITE_SUCCESS || fsync(fd) != 0) {
+                report(ctx, "ERROR", "Error writing file\n");
+                exit_code = EXIT_IO_ERROR;
+            } else if (ctx->opts->verbose_flag) {
+                report(ctx, "VERBOSE", "Edited in place\n");
+            }
+        } else {
+            if (gifwrite_replace_file(path, fd, st.st_size, edits, count) != GIFWRITE_SUCCESS) {
+                report(ctx, "ERROR", "Error rewriting file\n");
+                exit_code = EXIT_IO_ERROR;
+            } else if (ctx->opts->verbose_flag) {
+                report(ctx, "VERBOSE", "Comments did not fit, rewrote file\n");
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(edits[i].data);
+    free(edits);
+    free(blocks);
+    free(e.starts);
+    free(e.ends);
+    fclose(f);
+    return exit_code;
+}
+
+// sets up a job context with its own parser state and buffer
+int scan_ctx_init(scan_ctx *ctx, const scan_options *opts) {
+    memset(ctx, 0, sizeof(scan_ctx));
+    ctx->opts = opts;
+    ctx->out = stdout;
+    ctx->err = stderr;
+
+    ctx->s = gifmetadata_state_new();
+    if (ctx->s == NULL)
+        return EXIT_MEM_ERROR;
+    // only block headers and extension payloads are of interest
+    ctx->s->flags |= GIFMETADATA_FLAG_SKIP | GIFMETADATA_FLAG_ZERO_COPY;
+    if (opts->dev_flag)
+        ctx->s->flags |= GIFMETADATA_FLAG_STATS | GIFMETADATA_FLAG_STATS_TIMING;
+    ctx->s->query = opts->query;
+    ctx->s->query_comments = opts->query_comments;
+    ctx->cb.extension_cb = &extension_cb;
+    ctx->cb.state_cb = &state_cb;
+    // records always hold the frame count and duration
+    if (opts->timeline_flag || opts->format != GIFOUT_TEXT)
+        ctx->cb.frame_cb = &frame_cb;
+    if (opts->pixels_flag) {
+        ctx->s->flags |= GIFMETADATA_FLAG_DECODE;
+        ctx->cb.decode_cb = &decode_cb;
+    }
+    ctx->cb.user = ctx;
+    gifout_init(&ctx->records, opts->format);
+
+    // read buffer for streamed input, shared by every file of the job
+    ctx->buf = malloc(CHUNK_SIZE);
+    if (ctx->buf == NULL) {
+        gifmetadata_state_free(ctx->s);
+        return EXIT_MEM_ERROR;
+    }
+    return 0;
+}
+
+void scan_ctx_free(scan_ctx *ctx) {
+    gifindex_builder_free(&ctx->record);
+    gifout_free(&ctx->records);
+    free(ctx->buf);
+    gifmetadata_state_free(ctx->s);
+}
+
+// inputs are expanded into file paths and handed to a visitor, either
+// scanning them straight away or queueing them for the worker threads
+typedef int (*visit_fn)(void *visitor, const char *path);
+
+int visit_scan(void *visitor, const char *path) {
+    return scan_path(visitor, path);
+}
+
+int has_gif_extension(const char *path) {
+    size_t len = strlen(path);
+    return len >= 4 && strcasecmp(path + len - 4, ".gif") == 0;
+}
+
+int walk_dir(visit_fn visit, void *visitor, const char *path);
+
+// visits a file, or every .gif file below a directory, returns the first
+// non-zero exit code
+int walk_input(visit_fn visit, void *visitor, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return walk_dir(visit, visitor, path);
+    return visit(visitor, path);
+}
+
+int walk_dir(visit_fn visit, void *visitor, const char *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "ERROR Failed to open directory '%s'\n", path);
+        return EXIT_IO_ERROR;
+    }
+
+    int exit_code = 0;
+    size_t path_len = strlen(path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char *child = malloc(path_len + strlen(entry->d_name) + 2);
+        if (child == NULL) {
+            closedir(dir);
+            fprintf(stderr, "ERROR Memory alloc failure\n");
+            return EXIT_MEM_ERROR;
         }
-    } else if (output_comments) {
-        if (extension->type == comment) {
-            printf("%s\n", extension->buffer);
+        sprintf(child, "%s/%s", path, entry->d_name);
+
+        // symlinked directories are not followed to avoid cycles
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(child, &st) == 0)
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
         }
+
+        int child_exit_code = 0;
+        if (type == DT_DIR)
+            child_exit_code = walk_dir(visit, visitor, child);
+        else if (type == DT_REG && has_gif_extension(entry->d_name))
+            child_exit_code = visit(visitor, child);
+        if (exit_code == 0)
+            exit_code = child_exit_code;
+
+        free(child);
     }
-    free(extension);
+
+    closedir(dir);
+    return exit_code;
 }
 
-void state_cb(gifmetadata_state *s, enum gifmetadata_read_state state) {
-    // state is called on the exact byte of first encounter
+// visits each path read from stdin
+int walk_list(visit_fn visit, void *visitor, int delim) {
+    int exit_code = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    while ((line_len = getdelim(&line, &line_size, delim, stdin)) != -1) {
+        if (line_len > 0 && line[line_len-1] == delim)
+            line[--line_len] = '\0';
+        if (line_len == 0)
+            continue;
 
-    int write_comment = w_out != NULL && comment_flags != NULL && state != searching && state > global_color_table && !w_comments;
-    if (!write_comment) {
-        return;
+        int line_exit_code = walk_input(visit, visitor, line);
+        if (exit_code == 0)
+            exit_code = line_exit_code;
     }
+    free(line);
+    return exit_code;
+}
 
-    if (s->chunk_i > 0) {
-        // write to before the current byte
-        // no need to minus one as index starts at zero
-        fwrite(s->chunk, 1, s->chunk_i, w_out);
-        w_chunk_i = s->chunk_i;
+int walk_inputs(visit_fn visit, void *visitor, cli_user_args *args) {
+    if (args->list_flag)
+        return walk_list(visit, visitor, args->null_flag ? '\0' : '\n');
+
+    int exit_code = 0;
+    cli_flag_arg *input = args->inputs;
+    while (input != NULL) {
+        int input_exit_code = walk_input(visit, visitor, input->string);
+        if (exit_code == 0)
+            exit_code = input_exit_code;
+        input = input->next;
     }
+    return exit_code;
+}
 
-    cli_flag_arg *comment = comment_flags;
-    while (comment != NULL) {
-        fwrite(&comment_extension, 1, sizeof(comment_extension), w_out);
-        unsigned char len;
-        if (comment->string_len > 255) {
-            fprintf(stderr, "WARNING Comment length is longer than 255 characters, this is may cause incompatibility issues\n");
-            len = 255;
+// multi-threaded scanning
+
+typedef struct path_list {
+    char **paths;
+    size_t len;
+    size_t size;
+} path_list;
+
+int visit_append(void *visitor, const char *path) {
+    path_list *list = visitor;
+    if (list->len == list->size) {
+        size_t size = list->size ? list->size * 2 : 1024;
+        char **paths = realloc(list->paths, sizeof(char *) * size);
+        if (paths == NULL)
+            return EXIT_MEM_ERROR;
+        list->paths = paths;
+        list->size = size;
+    }
+    list->paths[list->len] = strdup(path);
+    if (list->paths[list->len] == NULL)
+        return EXIT_MEM_ERROR;
+    list->len++;
+    return 0;
+}
+
+// output of one file, buffered until it can be printed
+typedef struct scan_result {
+    char *out;
+    size_t out_len;
+    char *err;
+    size_t err_len;
+    int exit_code;
+    int done;
+} scan_result;
+
+typedef struct parallel_scan {
+    const scan_options *opts;
+    path_list *paths;
+    jobs_queue *queue;
+    scan_result *results;
+
+    // results are printed in path order unless unordered
+    int unordered;
+    size_t next_result;
+    pthread_mutex_t print_lock;
+    int exit_code;
+} parallel_scan;
+
+typedef struct scan_worker {
+    parallel_scan *p;
+    int id;
+    pthread_t thread;
+} scan_worker;
+
+// must be called with print_lock held
+void print_result(parallel_scan *p, scan_result *r) {
+    fwrite(r->out, 1, r->out_len, stdout);
+    fwrite(r->err, 1, r->err_len, stderr);
+    free(r->out);
+    free(r->err);
+    r->out = NULL;
+    r->err = NULL;
+    if (p->exit_code == 0)
+        p->exit_code = r->exit_code;
+}
+
+void publish_result(parallel_scan *p, size_t job) {
+    pthread_mutex_lock(&p->print_lock);
+    p->results[job].done = 1;
+    if (p->unordered) {
+        print_result(p, &p->results[job]);
+    } else {
+        while (p->next_result < p->paths->len && p->results[p->next_result].done)
+            print_result(p, &p->results[p->next_result++]);
+    }
+    pthread_mutex_unlock(&p->print_lock);
+}
+
+void *scan_worker_run(void *arg) {
+    scan_worker *w = arg;
+    parallel_scan *p = w->p;
+
+    scan_ctx ctx;
+    int init_exit_code = scan_ctx_init(&ctx, p->opts);
+
+    size_t job;
+    while (jobs_queue_next(p->queue, w->id, &job)) {
+        scan_result *r = &p->results[job];
+        FILE *out = open_memstream(&r->out, &r->out_len);
+        FILE *err = open_memstream(&r->err, &r->err_len);
+        if (init_exit_code != 0 || out == NULL || err == NULL) {
+            if (out != NULL)
+                fclose(out);
+            if (err != NULL)
+                fclose(err);
+            r->exit_code = EXIT_MEM_ERROR;
         } else {
-            len = (unsigned char)comment->string_len;
+            ctx.out = out;
+            ctx.err = err;
+            r->exit_code = scan_path(&ctx, p->paths->paths[job]);
+            // every file's records are printed with the rest of its output
+            int flush_exit_code = flush_records(&ctx);
+            if (r->exit_code == 0)
+                r->exit_code = flush_exit_code;
+            fclose(out);
+            fclose(err);
         }
-        fwrite(&len, 1, 1, w_out);
-        fwrite(comment->string, 1, comment->string_len, w_out);
-        fputc(0, w_out);
+        publish_result(p, job);
+    }
 
-        comment = comment->next;
+    if (init_exit_code == 0)
+        scan_ctx_free(&ctx);
+    return NULL;
+}
+
+int scan_parallel(const scan_options *opts, path_list *paths, int jobs, int unordered) {
+    if (paths->len == 0)
+        return 0;
+    if (jobs > paths->len)
+        jobs = paths->len;
+
+    parallel_scan p;
+    memset(&p, 0, sizeof(parallel_scan));
+    p.opts = opts;
+    p.paths = paths;
+    p.unordered = unordered;
+    pthread_mutex_init(&p.print_lock, NULL);
+
+    p.queue = jobs_queue_new(paths->len, jobs);
+    p.results = calloc(paths->len, sizeof(scan_result));
+    scan_worker *workers = calloc(jobs, sizeof(scan_worker));
+    if (p.queue == NULL || p.results == NULL || workers == NULL) {
+        fprintf(stderr, "ERROR Memory alloc failure\n");
+        jobs_queue_free(p.queue);
+        free(p.results);
+        free(workers);
+        return EXIT_MEM_ERROR;
+    }
+
+    int started = 0;
+    for (int i = 0; i < jobs; i++) {
+        workers[i].p = &p;
+        workers[i].id = i;
+        if (pthread_create(&workers[i].thread, NULL, &scan_worker_run, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    // the queue lets any worker finish the jobs of one that failed to start
+    if (started == 0) {
+        scan_worker_run(&workers[0]);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    pthread_mutex_destroy(&p.print_lock);
+    jobs_queue_free(p.queue);
+    free(p.results);
+    free(workers);
+    return p.exit_code;
+}
+
+// a file being read by scan_async, with its own parser state and output
+typedef struct async_slot {
+    scan_ctx ctx;
+    int active;
+    size_t job;
+    open_file file;
+    struct stat st;
+    struct timespec start;
+    gifmetadata_fd_reader reader;
+    gifaio_read read;
+    unsigned char buf[GIFMETADATA_FD_MAX_WINDOW];
+} async_slot;
+
+// ends a file of scan_async and hands its output over for printing
+void finish_async(parallel_scan *p, async_slot *slot, int exit_code) {
+    scan_ctx *ctx = &slot->ctx;
+    scan_result *r = &p->results[slot->job];
+    r->exit_code = end_file_record(ctx, exit_code);
+    int flush_exit_code = flush_records(ctx);
+    if (r->exit_code == 0)
+        r->exit_code = flush_exit_code;
+    fclose(ctx->out);
+    fclose(ctx->err);
+    slot->active = 0;
+    publish_result(p, slot->job);
+}
+
+// ends the parse of a file of scan_async, as parse_file and read_path do
+void complete_async(parallel_scan *p, async_slot *slot, int parse_status) {
+    scan_ctx *ctx = &slot->ctx;
+    int exit_code = parse_status_exit_code(ctx, parse_status == GIFMETADATA_END ? GIFMETADATA_SUCCESS : parse_status);
+    if (exit_code == 0)
+        exit_code = report_file(ctx, slot->st.st_size, parse_status != GIFMETADATA_QUERY_SATISFIED);
+    if (ctx->opts->dev_flag) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        print_stats(ctx, (end.tv_sec - slot->start.tv_sec) + (end.tv_nsec - slot->start.tv_nsec) / 1e9);
+    }
+    finish_async(p, slot, close_path(ctx, p->paths->paths[slot->job], &slot->file, exit_code));
+}
+
+void submit_async(gifaio *aio, async_slot *slot) {
+    slot->read.fd = fileno(slot->file.f);
+    slot->read.buf = slot->buf;
+    slot->read.len = slot->reader.window;
+    slot->read.offset = slot->reader.offset;
+    slot->read.user = slot;
+    gifaio_submit(aio, &slot->read);
+}
+
+// opens the next file in a free slot and queues its first read, files
+// answered without reading them are finished straight away
+void start_async(parallel_scan *p, gifaio *aio, async_slot *slot, size_t job) {
+    scan_ctx *ctx = &slot->ctx;
+    const char *path = p->paths->paths[job];
+    scan_result *r = &p->results[job];
+    slot->job = job;
+
+    FILE *out = open_memstream(&r->out, &r->out_len);
+    FILE *err = open_memstream(&r->err, &r->err_len);
+    if (out == NULL || err == NULL) {
+        if (out != NULL)
+            fclose(out);
+        if (err != NULL)
+            fclose(err);
+        r->exit_code = EXIT_MEM_ERROR;
+        publish_result(p, job);
+        return;
+    }
+    ctx->out = out;
+    ctx->err = err;
+    slot->active = 1;
+    begin_file_record(ctx, path);
+    if (ctx->opts->dev_flag)
+        clock_gettime(CLOCK_MONOTONIC, &slot->start);
+
+    int exit_code = open_path(ctx, path, &slot->file);
+    if (exit_code >= 0) {
+        finish_async(p, slot, exit_code);
+        return;
+    }
+    if (fstat(fileno(slot->file.f), &slot->st) != 0 || !S_ISREG(slot->st.st_mode)) {
+        // e.g. a fifo named in a list of paths, which can only be read in
+        // order here
+        finish_async(p, slot, close_path(ctx, path, &slot->file, scan_file(ctx, slot->file.f)));
+        return;
+    }
+
+    reset_scan(ctx);
+    gifmetadata_fd_reader_init(ctx->s, &slot->reader);
+    submit_async(aio, slot);
+}
+
+// scans files with reads of up to depth of them in flight at once. each
+// completed read is parsed straight away and the next read of its file,
+// known as soon as the parser has the next length byte, is queued before
+// the next completion is taken
+int scan_async(const scan_options *opts, path_list *paths, int depth, int unordered) {
+    if (paths->len == 0)
+        return 0;
+    if (depth > paths->len)
+        depth = paths->len;
+    if (depth > GIFAIO_MAX_DEPTH)
+        depth = GIFAIO_MAX_DEPTH;
+
+    parallel_scan p;
+    memset(&p, 0, sizeof(parallel_scan));
+    p.opts = opts;
+    p.paths = paths;
+    p.unordered = unordered;
+    pthread_mutex_init(&p.print_lock, NULL);
+
+    p.results = calloc(paths->len, sizeof(scan_result));
+    async_slot *slots = calloc(depth, sizeof(async_slot));
+    gifaio *aio = gifaio_new(depth);
+    int ready = 0;
+    if (p.results != NULL && slots != NULL && aio != NULL) {
+        for (; ready < depth; ready++) {
+            if (scan_ctx_init(&slots[ready].ctx, opts) != 0)
+                break;
+        }
+    }
+    if (ready < depth) {
+        fprintf(stderr, "ERROR Memory alloc failure\n");
+        for (int i = 0; i < ready; i++)
+            scan_ctx_free(&slots[i].ctx);
+        gifaio_free(aio);
+        free(slots);
+        free(p.results);
+        pthread_mutex_destroy(&p.print_lock);
+        return EXIT_MEM_ERROR;
+    }
+    if (opts->dev_flag)
+        fprintf(stderr, "DEV Reading with %s, %d files in flight\n", gifaio_backend(aio), depth);
+
+    size_t next_job = 0;
+    for (;;) {
+        for (int i = 0; i < depth && next_job < paths->len; i++) {
+            if (!slots[i].active)
+                start_async(&p, aio, &slots[i], next_job++);
+        }
+
+        gifaio_read *read = gifaio_wait(aio);
+        if (read == NULL) {
+            if (aio->in_flight > 0 || next_job == paths->len)
+                break;
+            continue;
+        }
+
+        async_slot *slot = read->user;
+        scan_ctx *ctx = &slot->ctx;
+        if (read->result < 0) {
+            complete_async(&p, slot, GIFMETADATA_IO_ERROR);
+            continue;
+        }
+        int parse_status = gifmetadata_fd_reader_feed(ctx->s, &slot->reader, slot->buf, read->result, &ctx->cb);
+        if (parse_status == GIFMETADATA_SUCCESS)
+            submit_async(aio, slot);
+        else
+            complete_async(&p, slot, parse_status);
+    }
+
+    // the reads still in flight when the ring failed are cancelled. should
+    // that fail too the kernel may yet write to the slots, which are then
+    // left allocated
+    int reads_lost = gifaio_free(aio);
+    for (int i = 0; i < depth; i++) {
+        if (slots[i].active) {
+            report(&slots[i].ctx, "ERROR", "Error reading input file\n");
+            finish_async(&p, &slots[i], close_path(&slots[i].ctx, paths->paths[slots[i].job], &slots[i].file, EXIT_IO_ERROR));
+        }
+        scan_ctx_free(&slots[i].ctx);
+    }
+    // jobs never started are printed as failed, in order
+    for (; next_job < paths->len; next_job++) {
+        p.results[next_job].exit_code = EXIT_IO_ERROR;
+        publish_result(&p, next_job);
+    }
+
+    pthread_mutex_destroy(&p.print_lock);
+    if (!reads_lost)
+        free(slots);
+    free(p.results);
+    return p.exit_code;
+}
+
+// every server worker answers requests with its own job context, the
+// parser state of which is reused for every file it is sent
+void serve_open(void *user, FILE *out) {
+    scan_ctx *ctx = user;
+    gifout_write_header(ctx->opts->format, out);
+}
+
+void serve_request(void *user, const gifserver_request *request, FILE *out) {
+    scan_ctx *ctx = user;
+    ctx->out = out;
+    ctx->path = NULL;
+
+    int exit_code;
+    switch (request->type) {
+    case GIFSERVER_REQUEST_PATH:
+        begin_file_record(ctx, request->path);
+        exit_code = read_path(ctx, request->path);
+        break;
+    case GIFSERVER_REQUEST_DATA:
+        begin_file_record(ctx, NULL);
+        exit_code = scan_buffer(ctx, request->data, request->data_len);
+        break;
+    default:
+        begin_file_record(ctx, NULL);
+        snprintf(ctx->error, sizeof(ctx->error), "%s", request->error);
+        exit_code = EXIT_PARSE_ERROR;
+        break;
+    }
+    ctx->path = NULL;
+    // the server sends the replies once there are no more requests to read
+    end_file_record(ctx, exit_code);
+    flush_records(ctx);
+}
+
+// answers requests on a unix socket until the server fails, see gifserver.h
+int serve(const scan_options *opts, const char *socket_path, int workers) {
+    int status;
+    gifserver *server = gifserver_listen(socket_path, &status);
+    if (server == NULL) {
+        if (status == GIFSERVER_IN_USE)
+            fprintf(stderr, "ERROR A server is already listening on '%s'\n", socket_path);
+        else if (status == GIFSERVER_ALLOC_FAILURE)
+            fprintf(stderr, "ERROR Memory alloc failure\n");
+        else
+            fprintf(stderr, "ERROR Failed to listen on '%s'\n", socket_path);
+        return status == GIFSERVER_ALLOC_FAILURE ? EXIT_MEM_ERROR : EXIT_IO_ERROR;
+    }
+
+    scan_ctx *ctxs = malloc(sizeof(scan_ctx) * workers);
+    void **users = malloc(sizeof(void *) * workers);
+    int ready = 0;
+    if (ctxs != NULL && users != NULL) {
+        for (; ready < workers; ready++) {
+            if (scan_ctx_init(&ctxs[ready], opts) != 0)
+                break;
+            users[ready] = &ctxs[ready];
+        }
+    }
+    if (ready < workers) {
+        fprintf(stderr, "ERROR Failed to allocate state memory\n");
+        for (int i = 0; i < ready; i++)
+            scan_ctx_free(&ctxs[i]);
+        free(ctxs);
+        free(users);
+        gifserver_free(server);
+        return EXIT_MEM_ERROR;
+    }
+
+    if (opts->verbose_flag)
+        fprintf(stderr, "VERBOSE Listening on '%s' with %d workers\n", socket_path, workers);
+    const gifserver_handler handler = { &serve_open, &serve_request };
+    status = gifserver_run(server, &handler, users, workers);
+    fprintf(stderr, "ERROR %s\n", status == GIFSERVER_ALLOC_FAILURE ? "Memory alloc failure" : "Failed to accept connections");
+
+    for (int i = 0; i < workers; i++)
+        scan_ctx_free(&ctxs[i]);
+    free(ctxs);
+    free(users);
+    gifserver_free(server);
+    unlink(socket_path);
+    return status == GIFSERVER_ALLOC_FAILURE ? EXIT_MEM_ERROR : EXIT_IO_ERROR;
+}
+
+// reads the comma separated fields of -q, e.g. "size,comments=3,loop".
+// returns zero after printing an error for an unknown field
+int parse_query(scan_options *opts, const char *query) {
+    const char *field = query;
+    while (*field != '\0') {
+        size_t len = strcspn(field, ",");
+        int count;
+        int count_len = 0;
+        if (len == 4 && strncmp(field, "size", 4) == 0) {
+            opts->query |= GIFMETADATA_QUERY_DIMENSIONS;
+        } else if (len == 4 && strncmp(field, "loop", 4) == 0) {
+            opts->query |= GIFMETADATA_QUERY_LOOP_COUNT;
+        } else if (len == 7 && strncmp(field, "comment", 7) == 0) {
+            opts->query |= GIFMETADATA_QUERY_COMMENTS;
+            opts->query_comments = 1;
+        } else if (sscanf(field, "comments=%d%n", &count, &count_len) == 1 && count_len == len && count > 0) {
+            opts->query |= GIFMETADATA_QUERY_COMMENTS;
+            opts->query_comments = count;
+        } else {
+            fprintf(stderr, "ERROR Unknown query field '%.*s'\n", (int)len, field);
+            return 0;
+        }
+        field += len;
+        if (*field == ',')
+            field++;
+    }
+    if (opts->query == 0) {
+        fprintf(stderr, "ERROR Empty query\n");
+        return 0;
     }
-    w_comments = 1; 
+    return 1;
 }
 
-// TODO gif comment scrubbing
 int main(int argc, char **argv) {
     cli_user_args *args = cli_new_user_args();
     if (args == NULL) {
@@ -147,138 +1781,329 @@ int main(int argc, char **argv) {
     }
 
     if (args->help_flag) {
-        printf("gifcomment [-h] [-a] [-v] [-d] [-c <comment>] [-o <output>] [input]\n");
+        printf("gifcomment [-h] [-a] [-v] [-d] [-m] [-l] [-0] [-u] [-j <jobs>] [-Q <depth>] [-c <comment>] [-o <output>] [-i [-k]] [-s] [-x <app id>] [-I <index>] [-D] [-q <fields>] [-t] [-p] [-r <checkpoint>] [-f <format>] [-S <socket>] [input ...]\n");
         cli_free_user_args(args);
         return 0;
     }
 
-    verbose_flag = args->verbose_flag;
-    all_flag = args->all_flag;
+    scan_options opts;
+    memset(&opts, 0, sizeof(scan_options));
+    opts.verbose_flag = args->verbose_flag;
+    opts.all_flag = args->all_flag;
+    opts.mmap_flag = args->mmap_flag;
+    opts.dev_flag = args->debug_flag;
+    opts.in_place_flag = args->in_place_flag;
+    opts.keep_flag = args->keep_flag;
+    opts.scrub_flag = args->scrub_flag;
+    opts.timeline_flag = args->timeline_flag;
+    opts.pixels_flag = args->pixels_flag;
+    opts.output_comments = 1;
 
-    // configuring the file for reading
-    if (args->output_flag != NULL && args->output_flag->string != NULL) {
-        w_out = fopen(args->output_flag->string, "wb");
-        if (w_out == NULL) {
-            fprintf(stderr, "ERROR Failed to open output file for writing\n");
-            return EXIT_IO_ERROR;
+    if (args->format_flag != NULL) {
+        opts.format = gifout_format(args->format_flag->string);
+        if (opts.format < 0) {
+            fprintf(stderr, "ERROR Unknown output format '%s'\n", args->format_flag->string);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
         }
-        output_comments = 0;
     }
 
-    if (args->comment_flags != NULL) {
-        if (w_out == NULL) {
-            w_out = stdout;
+    if (args->server_flag != NULL) {
+        // paths and gifs come from the socket, every reply is a record
+        if (args->inputs != NULL || args->list_flag || args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag || opts.in_place_flag) {
+            fprintf(stderr, "ERROR A server cannot be given inputs, -l, -c, -o, -s or -i\n");
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (args->queue_flag != NULL || args->checkpoint_flag != NULL || opts.mmap_flag || args->unordered_flag) {
+            fprintf(stderr, "ERROR A server cannot be combined with -Q, -r, -m or -u\n");
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
         }
-        output_comments = 0;
-        comment_flags = args->comment_flags;
+        if (opts.format == GIFOUT_TEXT)
+            opts.format = GIFOUT_JSON;
     }
 
-    FILE *f;
-    if (args->filename == NULL) {
-        f = stdin;
-    } else {
-        if (access(args->filename, F_OK) != 0) {
-            fprintf(stderr, "ERROR File '%s' cannot be accessed\n", args->filename);
+    int queue_depth = 0;
+    if (args->queue_flag != NULL) {
+        queue_depth = atoi(args->queue_flag->string);
+        if (queue_depth < 1) {
+            fprintf(stderr, "ERROR Invalid queue depth '%s'\n", args->queue_flag->string);
             cli_free_user_args(args);
-            return EXIT_IO_ERROR;
+            return EXIT_PARSE_ERROR;
         }
-        
-        f = fopen(args->filename, "rb");
-        if (f == NULL) {
-            fprintf(stderr, "ERROR Failed to open file '%s'\n", args->filename);
+        // reads are made at offsets without copying the file anywhere
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag || args->checkpoint_flag != NULL) {
+            fprintf(stderr, "ERROR A read queue can only be used when reading files\n");
             cli_free_user_args(args);
-            return EXIT_IO_ERROR;
+            return EXIT_PARSE_ERROR;
+        }
+        if (args->jobs_flag != NULL || opts.mmap_flag) {
+            fprintf(stderr, "ERROR A read queue cannot be combined with -j or -m\n");
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
         }
     }
 
-    // TODO cli_free_user_args used to be here, must be called again on all
-    // exit lines below
+    int jobs = 1;
+    if (args->jobs_flag != NULL) {
+        jobs = atoi(args->jobs_flag->string);
+        if (jobs < 1) {
+            fprintf(stderr, "ERROR Invalid number of jobs '%s'\n", args->jobs_flag->string);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+    }
 
-    // configure gif parsing state
-    gifmetadata_state *gifmetadata_s = gifmetadata_state_new();
-    if (gifmetadata_s == NULL) {
-        fprintf(stderr, "ERROR Failed to allocate state memory\n");
-        return EXIT_MEM_ERROR;
+    if (opts.in_place_flag) {
+        if (args->comment_flags == NULL || args->output_flag != NULL) {
+            fprintf(stderr, "ERROR In-place editing needs comments and no output file\n");
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (args->inputs == NULL && !args->list_flag) {
+            fprintf(stderr, "ERROR In-place editing needs an input file\n");
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (opts.scrub_flag) {
+            fprintf(stderr, "ERROR Scrubbing cannot be done in place\n");
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
     }
 
-    // read file chunk by chunk
-    unsigned char *buf = malloc(CHUNK_SIZE);
-    if (buf == NULL) {
-        fprintf(stderr, "ERROR Buffer memory alloc failure\n");
-        return EXIT_MEM_ERROR;
+    if (args->application_flags != NULL) {
+        size_t len = 0;
+        for (cli_flag_arg *app = args->application_flags; app != NULL; app = app->next)
+            len++;
+        opts.scrub_applications = malloc(sizeof(char *) * len);
+        if (opts.scrub_applications == NULL) {
+            fprintf(stderr, "ERROR Memory alloc failure\n");
+            cli_free_user_args(args);
+            return EXIT_MEM_ERROR;
+        }
+        for (cli_flag_arg *app = args->application_flags; app != NULL; app = app->next)
+            opts.scrub_applications[opts.scrub_applications_len++] = app->string;
     }
 
-    size_t total_b;
-    size_t b;
-    int parse_status;
-    while ((b = fread(buf, 1, CHUNK_SIZE, f)) != 0) {
-        w_chunk_i = 0;
-        parse_status = gifmetadata_parse_gif(gifmetadata_s, buf, b, &extension_cb, &state_cb);
-        switch (parse_status) {
-        case GIFMETADATA_SUCCESS:
-            break;
-        case GIFMETADATA_INVALID_SIG:
-            fprintf(stderr, "ERROR Unsupported GIF version (invalid signature)\n");
+    if (opts.timeline_flag || opts.pixels_flag) {
+        // the index and the dedupe cache keep the frame count only, and a
+        // query stops before the last frame
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag) {
+            fprintf(stderr, "ERROR Frames can only be reported when reading files\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
             return EXIT_PARSE_ERROR;
-        case GIFMETADATA_COMMENT_EXCEEDS_BOUNDS:
-            fprintf(stderr, "ERROR Comment exceeds maximum comment length\n");
+        }
+        if (args->index_flag != NULL || args->dedupe_flag || args->query_flag != NULL) {
+            fprintf(stderr, "ERROR Frames cannot be reported with -I, -D or -q\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
             return EXIT_PARSE_ERROR;
-        case GIFMETADATA_ALLOC_FAILED:
-            fprintf(stderr, "ERROR Failed to allocate memory\n");
-            return EXIT_MEM_ERROR;
-        default:
-            fprintf(stderr, "ERROR Unknown error\n");
-            return 1;
         }
-        total_b += b;
+    }
 
-        // before the next loop, write remaining
-        if (w_out != NULL) {
-            fwrite(buf+w_chunk_i, 1, b-w_chunk_i, w_out);
+    if (opts.format != GIFOUT_TEXT) {
+        // records describe whole files, which the index and the dedupe
+        // cache do not keep the frames of and a query stops short of
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag) {
+            fprintf(stderr, "ERROR Records can only be written when reading files\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (args->index_flag != NULL || args->dedupe_flag || args->query_flag != NULL) {
+            fprintf(stderr, "ERROR Records cannot be written with -I, -D or -q\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
         }
     }
 
-    if (ferror(f) != 0) {
-        fclose(f);
-        fprintf(stderr, "ERROR Error reading input file\n"); 
-        return EXIT_IO_ERROR;
+    if (args->query_flag != NULL) {
+        // a query reads only part of each file, which the index and the
+        // dedupe cache cannot record
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag) {
+            fprintf(stderr, "ERROR Queries can only be used when reading files\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (args->index_flag != NULL || args->dedupe_flag) {
+            fprintf(stderr, "ERROR Queries cannot be combined with -I or -D\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (!parse_query(&opts, args->query_flag->string)) {
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
     }
 
-    fclose(f);
+    if (args->checkpoint_flag != NULL) {
+        // the checkpoint holds the parser state of one file, totals kept
+        // outside the parser are not in it
+        struct stat input_st;
+        int directory = args->input_count == 1 && stat(args->inputs->string, &input_st) == 0 && S_ISDIR(input_st.st_mode);
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag || args->input_count > 1 || args->list_flag || directory) {
+            fprintf(stderr, "ERROR A checkpoint can only be used when reading a single file\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        if (args->index_flag != NULL || args->dedupe_flag || opts.timeline_flag || opts.format != GIFOUT_TEXT) {
+            fprintf(stderr, "ERROR A checkpoint cannot be combined with -I, -D, -t or -f\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        opts.checkpoint = args->checkpoint_flag->string;
+    }
 
-    if (total_b == 0) {
-        fprintf(stderr, "ERROR Empty file\n");
-        return EXIT_IO_ERROR;
+    if (args->index_flag != NULL) {
+        // only reports can be answered from the index
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag) {
+            fprintf(stderr, "ERROR The index can only be used when reading files\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        int index_status;
+        opts.index = gifindex_open(args->index_flag->string, &index_status);
+        if (opts.index == NULL) {
+            if (index_status == GIFINDEX_INVALID)
+                fprintf(stderr, "ERROR '%s' is not an index file\n", args->index_flag->string);
+            else if (index_status == GIFINDEX_ALLOC_FAILURE)
+                fprintf(stderr, "ERROR Memory alloc failure\n");
+            else
+                fprintf(stderr, "ERROR Failed to open index file\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return index_status == GIFINDEX_ALLOC_FAILURE ? EXIT_MEM_ERROR : EXIT_IO_ERROR;
+        }
     }
-    if (gifmetadata_s->gif_version == 0) {
-        fprintf(stderr, "ERROR Invalid GIF file (missing signature)\n");
-        return EXIT_IO_ERROR;
+
+    if (args->dedupe_flag) {
+        // like the index, duplicates only skip parsing when reading
+        if (args->comment_flags != NULL || args->output_flag != NULL || opts.scrub_flag) {
+            fprintf(stderr, "ERROR Deduplication can only be used when reading files\n");
+            if (opts.index != NULL)
+                gifindex_close(opts.index);
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_PARSE_ERROR;
+        }
+        opts.dedupe = gifdedupe_new();
+        if (opts.dedupe == NULL) {
+            fprintf(stderr, "ERROR Memory alloc failure\n");
+            if (opts.index != NULL)
+                gifindex_close(opts.index);
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_MEM_ERROR;
+        }
     }
-    // check for unexpected eof
-    if (gifmetadata_s->read_state != trailer) {
-        // non-fatal status code
-        fprintf(stderr, "WARNING Unexpected end of file\n");
+
+    // configuring the file for reading
+    if (args->output_flag != NULL && args->output_flag->string != NULL) {
+        opts.w_out = fopen(args->output_flag->string, "wb");
+        if (opts.w_out == NULL) {
+            fprintf(stderr, "ERROR Failed to open output file for writing\n");
+            free(opts.scrub_applications);
+            return EXIT_IO_ERROR;
+        }
+        opts.output_comments = 0;
     }
 
-    if (verbose_flag) {
-        fprintf(stderr, "VERBOSE GIF version: ");
-        switch (gifmetadata_s->gif_version) {
-        case gif87a:
-            fprintf(stderr, "87a\n");
-            break;
-        case gif89a:
-            fprintf(stderr, "89a\n");
-            break;
-        default:
-            fprintf(stderr, "unknown (%d)\n", gifmetadata_s->gif_version);
+    if (opts.in_place_flag) {
+        // every input is rewritten with the comments, nothing is printed
+        opts.output_comments = 0;
+        opts.comment_flags = args->comment_flags;
+    } else if (args->comment_flags != NULL || opts.scrub_flag) {
+        if (opts.w_out == NULL) {
+            opts.w_out = stdout;
         }
+        opts.output_comments = 0;
+        opts.comment_flags = args->comment_flags;
+    }
+
+    // more than one file is scanned when given several inputs, a directory
+    // or a list of paths
+    struct stat st;
+    opts.batch_flag = args->input_count > 1 || args->list_flag;
+    if (args->input_count == 1 && stat(args->inputs->string, &st) == 0 && S_ISDIR(st.st_mode))
+        opts.batch_flag = 1;
 
-        fprintf(stderr, "VERBOSE File size: %ld bytes\n", total_b);
-        fprintf(stderr, "VERBOSE Canvas width: %d\n", gifmetadata_s->canvas_width);
-        fprintf(stderr, "VERBOSE Canvas height: %d\n", gifmetadata_s->canvas_height);
+    int exit_code = 0;
+    // the server writes the header at the start of every connection
+    if (args->server_flag == NULL && gifout_write_header(opts.format, stdout) != GIFOUT_SUCCESS) {
+        fprintf(stderr, "ERROR Failed to write output\n");
+        exit_code = EXIT_IO_ERROR;
+    }
+    if (args->server_flag != NULL) {
+        // every worker answers a connection at a time, one per core unless
+        // -j says otherwise
+        if (args->jobs_flag == NULL) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = cores > 0 ? cores : 1;
+        }
+        // diagnostics on stderr are tagged with the path asked for
+        opts.batch_flag = 1;
+        exit_code = serve(&opts, args->server_flag->string, jobs);
+    } else if (opts.batch_flag && (jobs > 1 || queue_depth > 0)) {
+        // collect every path up front and share them between the workers,
+        // or the reads in flight
+        path_list paths = { NULL, 0, 0 };
+        exit_code = walk_inputs(&visit_append, &paths, args);
+        int scan_exit_code;
+        if (queue_depth > 0)
+            scan_exit_code = scan_async(&opts, &paths, queue_depth, args->unordered_flag);
+        else
+            scan_exit_code = scan_parallel(&opts, &paths, jobs, args->unordered_flag);
+        if (exit_code == 0)
+            exit_code = scan_exit_code;
+        for (size_t i = 0; i < paths.len; i++)
+            free(paths.paths[i]);
+        free(paths.paths);
+    } else {
+        scan_ctx ctx;
+        if (scan_ctx_init(&ctx, &opts) != 0) {
+            fprintf(stderr, "ERROR Failed to allocate state memory\n");
+            free(opts.scrub_applications);
+            cli_free_user_args(args);
+            return EXIT_MEM_ERROR;
+        }
+        if (args->inputs == NULL && !args->list_flag) {
+            begin_file_record(&ctx, NULL);
+            exit_code = end_file_record(&ctx, scan_file(&ctx, stdin));
+        } else {
+            exit_code = walk_inputs(&visit_scan, &ctx, args);
+        }
+        int flush_exit_code = flush_records(&ctx);
+        if (exit_code == 0)
+            exit_code = flush_exit_code;
+        scan_ctx_free(&ctx);
     }
 
+    if (opts.w_out != NULL && opts.w_out != stdout)
+        fclose(opts.w_out);
+    if (opts.dedupe != NULL) {
+        size_t groups;
+        uint64_t bytes;
+        size_t dups = gifdedupe_report(opts.dedupe, stdout, &groups, &bytes);
+        if (opts.verbose_flag)
+            fprintf(stderr, "VERBOSE Duplicates: %zu files in %zu groups, %llu bytes\n", dups, groups, (unsigned long long)bytes);
+        gifdedupe_free(opts.dedupe);
+    }
+    if (opts.index != NULL && gifindex_close(opts.index) != GIFINDEX_SUCCESS) {
+        fprintf(stderr, "ERROR Failed to write index file\n");
+        if (exit_code == 0)
+            exit_code = EXIT_IO_ERROR;
+    }
+    free(opts.scrub_applications);
     cli_free_user_args(args);
-    return 0;
+    return exit_code;
 }
-
@@ -0,0 +1,462 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gifdedupe.h"
+
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+#define XXH_PRIME5 2870177450012600261ULL
+
+#define DEDUPE_MIN_BUCKETS 4096
+
+uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t xxh_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+void xxh_stripe(gifdedupe_hash *h, const unsigned char *p) {
+    h->v[0] = xxh_round(h->v[0], xxh_read64(p));
+    h->v[1] = xxh_round(h->v[1], xxh_read64(p + 8));
+    h->v[2] = xxh_round(h->v[2], xxh_read64(p + 16));
+    h->v[3] = xxh_round(h->v[3], xxh_read64(p + 24));
+}
+
+void gifdedupe_hash_init(gifdedupe_hash *h) {
+    memset(h, 0, sizeof(gifdedupe_hash));
+    h->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    h->v[1] = XXH_PRIME2;
+    h->v[2] = 0;
+    h->v[3] = -XXH_PRIME1;
+}
+
+void gifdedupe_hash_update(gifdedupe_hash *h, const unsigned char *data, size_t len) {
+    h->total += len;
+    if (h->stripe_len > 0) {
+        size_t n = 32 - h->stripe_len;
+        if (n > len)
+            n = len;
+        memcpy(h->stripe + h->stripe_len, data, n);
+        h->stripe_len += n;
+        data += n;
+        len -= n;
+        if (h->stripe_len < 32)
+            return;
+        xxh_stripe(h, h->stripe);
+        h->stripe_len = 0;
+    }
+    for (; len >= 32; data += 32, len -= 32)
+        xxh_stripe(h, data);
+    memcpy(h->stripe, data, len);
+    h->stripe_len = len;
+}
+
+uint64_t gifdedupe_hash_final(const gifdedupe_hash *h) {
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            acc = xxh_merge(acc, h->v[i]);
+    } else {
+        acc = XXH_PRIME5;
+    }
+    acc += h->total;
+
+    const unsigned char *p = h->stripe;
+    size_t len = h->stripe_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        acc ^= xxh_round(0, xxh_read64(p));
+        acc = xxh_rotl(acc, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (len >= 4) {
+        acc ^= (uint64_t)xxh_read32(p) * XXH_PRIME1;
+        acc = xxh_rotl(acc, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        acc ^= *p * XXH_PRIME5;
+        acc = xxh_rotl(acc, 11) * XXH_PRIME1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= XXH_PRIME2;
+    acc ^= acc >> 29;
+    acc *= XXH_PRIME3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+int gifdedupe_hash_fd(int fd, uint64_t *hash) {
+    unsigned char buf[GIFDEDUPE_READ_SIZE];
+    gifdedupe_hash h;
+    gifdedupe_hash_init(&h);
+    off_t offset = 0;
+    for (;;) {
+        ssize_t b = pread(fd, buf, sizeof(buf), offset);
+        if (b < 0 && errno == EINTR)
+            continue;
+        if (b < 0)
+            return GIFDEDUPE_IO_ERROR;
+        if (b == 0)
+            break;
+        gifdedupe_hash_update(&h, buf, b);
+        offset += b;
+    }
+    *hash = gifdedupe_hash_final(&h);
+    return GIFDEDUPE_SUCCESS;
+}
+
+int dedupe_hash_path(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return GIFDEDUPE_IO_ERROR;
+    int status = gifdedupe_hash_fd(fd, hash);
+    close(fd);
+    return status;
+}
+
+// reads len bytes at offset, returns 0 when the file ends or fails first
+int dedupe_pread_full(int fd, unsigned char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t b = pread(fd, buf, len, offset);
+        if (b < 0 && errno == EINTR)
+            continue;
+        if (b <= 0)
+            return 0;
+        buf += b;
+        len -= b;
+        offset += b;
+    }
+    return 1;
+}
+
+// compares the first size bytes of fd with the file at path. a file that
+// cannot be read counts as different, and is parsed as a distinct file
+int dedupe_same_content(int fd, const char *path, uint64_t size) {
+    int other = open(path, O_RDONLY);
+    if (other < 0)
+        return 0;
+    unsigned char *buf = malloc(GIFDEDUPE_READ_SIZE * 2);
+    if (buf == NULL) {
+        close(other);
+        return 0;
+    }
+    unsigned char *other_buf = buf + GIFDEDUPE_READ_SIZE;
+    int same = 1;
+    for (uint64_t offset = 0; same && offset < size;) {
+        size_t len = size - offset < GIFDEDUPE_READ_SIZE ? size - offset : GIFDEDUPE_READ_SIZE;
+        if (!dedupe_pread_full(fd, buf, len, offset) || !dedupe_pread_full(other, other_buf, len, offset) || memcmp(buf, other_buf, len) != 0)
+            same = 0;
+        offset += len;
+    }
+    free(buf);
+    close(other);
+    return same;
+}
+
+gifdedupe *gifdedupe_new() {
+    gifdedupe *d = calloc(1, sizeof(gifdedupe));
+    if (d == NULL)
+        return NULL;
+    d->bucket_count = DEDUPE_MIN_BUCKETS;
+    d->buckets = calloc(d->bucket_count, sizeof(gifdedupe_entry *));
+    if (d->buckets == NULL) {
+        free(d);
+        return NULL;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    return d;
+}
+
+void gifdedupe_free(gifdedupe *d) {
+    if (d == NULL)
+        return;
+    for (size_t i = 0; i < d->bucket_count; i++) {
+        gifdedupe_entry *e = d->buckets[i];
+        while (e != NULL) {
+            gifdedupe_entry *next = e->next;
+            for (size_t j = 0; j < e->dups_len; j++)
+                free(e->dups[j]);
+            free(e->dups);
+            free(e->path);
+            free(e->record);
+            free(e);
+            e = next;
+        }
+    }
+    pthread_mutex_destroy(&d->lock);
+    free(d->buckets);
+    free(d);
+}
+
+size_t dedupe_bucket(const gifdedupe *d, uint64_t size) {
+    return (size * XXH_PRIME1 >> 32) & (d->bucket_count - 1);
+}
+
+// doubles the buckets once there are more entries than buckets, the lock is
+// held. a failed allocation only leaves the chains longer
+void dedupe_grow(gifdedupe *d) {
+    size_t bucket_count = d->bucket_count * 2;
+    gifdedupe_entry **buckets = calloc(bucket_count, sizeof(gifdedupe_entry *));
+    if (buckets == NULL)
+        return;
+    gifdedupe_entry **old = d->buckets;
+    size_t old_count = d->bucket_count;
+    d->buckets = buckets;
+    d->bucket_count = bucket_count;
+    for (size_t i = 0; i < old_count; i++) {
+        gifdedupe_entry *e = old[i];
+        while (e != NULL) {
+            gifdedupe_entry *next = e->next;
+            size_t b = dedupe_bucket(d, e->size);
+            e->next = d->buckets[b];
+            d->buckets[b] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+gifdedupe_entry *dedupe_add_entry(gifdedupe *d, const char *path, uint64_t size, uint64_t hash, int hashed) {
+    gifdedupe_entry *e = calloc(1, sizeof(gifdedupe_entry));
+    if (e == NULL)
+        return NULL;
+    e->path = strdup(path);
+    if (e->path == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->size = size;
+    e->hash = hash;
+    e->hashed = hashed;
+    size_t b = dedupe_bucket(d, size);
+    e->next = d->buckets[b];
+    d->buckets[b] = e;
+    if (++d->entries > d->bucket_count)
+        dedupe_grow(d);
+    return e;
+}
+
+int dedupe_add_dup(gifdedupe_entry *e, const char *path) {
+    if (e->dups_len == e->dups_size) {
+        size_t size = e->dups_size > 0 ? e->dups_size * 2 : 4;
+        char **dups = realloc(e->dups, sizeof(char *) * size);
+        if (dups == NULL)
+            return GIFDEDUPE_ALLOC_FAILURE;
+        e->dups = dups;
+        e->dups_size = size;
+    }
+    e->dups[e->dups_len] = strdup(path);
+    if (e->dups[e->dups_len] == NULL)
+        return GIFDEDUPE_ALLOC_FAILURE;
+    e->dups_len++;
+    return GIFDEDUPE_SUCCESS;
+}
+
+const gifindex_record *gifdedupe_lookup(gifdedupe *d, const char *path, int fd, const struct stat *st, gifdedupe_entry **entry, int *status) {
+    uint64_t size = st->st_size;
+    *entry = NULL;
+    *status = GIFDEDUPE_SUCCESS;
+
+    pthread_mutex_lock(&d->lock);
+    gifdedupe_entry *first = NULL;
+    gifdedupe_entry *unhashed = NULL;
+    for (gifdedupe_entry *e = d->buckets[dedupe_bucket(d, size)]; e != NULL; e = e->next) {
+        if (e->size != size)
+            continue;
+        first = e;
+        if (!e->hashed)
+            unhashed = e;
+    }
+    if (first == NULL) {
+        // the only file of its size so far, nothing to hash yet
+        if (dedupe_add_entry(d, path, size, 0, 0) == NULL)
+            *status = GIFDEDUPE_ALLOC_FAILURE;
+        pthread_mutex_unlock(&d->lock);
+        return NULL;
+    }
+    // entries are never removed or renamed, so the path stays valid
+    const char *unhashed_path = unhashed != NULL ? unhashed->path : NULL;
+    pthread_mutex_unlock(&d->lock);
+
+    // hashing happens outside the lock, another thread may hash the same
+    // first file at the same time and get the same result
+    uint64_t hash;
+    uint64_t unhashed_hash = 0;
+    int unhashed_status = GIFDEDUPE_SUCCESS;
+    *status = gifdedupe_hash_fd(fd, &hash);
+    if (*status != GIFDEDUPE_SUCCESS)
+        return NULL;
+    if (unhashed_path != NULL)
+        unhashed_status = dedupe_hash_path(unhashed_path, &unhashed_hash);
+
+    pthread_mutex_lock(&d->lock);
+    if (unhashed != NULL && !unhashed->hashed && unhashed_status == GIFDEDUPE_SUCCESS) {
+        unhashed->hash = unhashed_hash;
+        unhashed->hashed = 1;
+    }
+
+    // xxh64 only narrows down the candidates, a record is shared once the
+    // bytes compare equal. entries that only collide are skipped, the
+    // chains are walked again each time as they may grow meanwhile
+    const gifindex_record *record = NULL;
+    gifdedupe_entry *match;
+    gifdedupe_entry **differ = NULL;
+    size_t differ_len = 0;
+    for (;;) {
+        match = NULL;
+        for (gifdedupe_entry *e = d->buckets[dedupe_bucket(d, size)]; e != NULL && match == NULL; e = e->next) {
+            if (e->size != size || !e->hashed || e->hash != hash)
+                continue;
+            match = e;
+            for (size_t i = 0; i < differ_len; i++) {
+                if (differ[i] == e)
+                    match = NULL;
+            }
+        }
+        if (match == NULL)
+            break;
+        const char *match_path = match->path;
+        pthread_mutex_unlock(&d->lock);
+        int same = dedupe_same_content(fd, match_path, size);
+        pthread_mutex_lock(&d->lock);
+        if (same)
+            break;
+        gifdedupe_entry **grown = realloc(differ, sizeof(gifdedupe_entry *) * (differ_len + 1));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&d->lock);
+            free(differ);
+            *status = GIFDEDUPE_ALLOC_FAILURE;
+            return NULL;
+        }
+        differ = grown;
+        differ[differ_len++] = match;
+    }
+    free(differ);
+
+    if (match != NULL) {
+        *status = dedupe_add_dup(match, path);
+        record = match->record;
+        // the first file of a size is parsed before anything is known to
+        // duplicate it, so its first duplicate supplies the record
+        if (record == NULL)
+            *entry = match;
+    } else {
+        *entry = dedupe_add_entry(d, path, size, hash, 1);
+        if (*entry == NULL)
+            *status = GIFDEDUPE_ALLOC_FAILURE;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return record;
+}
+
+void gifdedupe_set_record(gifdedupe *d, gifdedupe_entry *entry, gifindex_record *record) {
+    pthread_mutex_lock(&d->lock);
+    if (entry->record == NULL) {
+        entry->record = record;
+        record = NULL;
+    }
+    pthread_mutex_unlock(&d->lock);
+    free(record);
+}
+
+int dedupe_compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// a group of identical files, paths sorted and NULL terminated
+typedef struct dedupe_group {
+    uint64_t hash;
+    char **paths;
+} dedupe_group;
+
+int dedupe_compare_groups(const void *a, const void *b) {
+    return strcmp(((const dedupe_group *)a)->paths[0], ((const dedupe_group *)b)->paths[0]);
+}
+
+size_t gifdedupe_report(gifdedupe *d, FILE *out, size_t *groups, uint64_t *bytes) {
+    size_t group_count = 0;
+    size_t dup_count = 0;
+    *bytes = 0;
+    for (size_t i = 0; i < d->bucket_count; i++) {
+        for (gifdedupe_entry *e = d->buckets[i]; e != NULL; e = e->next)
+            group_count += e->dups_len > 0;
+    }
+    *groups = group_count;
+    if (group_count == 0)
+        return 0;
+
+    dedupe_group *sorted = malloc(sizeof(dedupe_group) * group_count);
+    if (sorted == NULL)
+        return 0;
+    size_t n = 0;
+    for (size_t i = 0; i < d->bucket_count; i++) {
+        for (gifdedupe_entry *e = d->buckets[i]; e != NULL; e = e->next) {
+            if (e->dups_len == 0)
+                continue;
+            char **paths = malloc(sizeof(char *) * (e->dups_len + 2));
+            if (paths == NULL)
+                continue;
+            paths[0] = e->path;
+            memcpy(paths + 1, e->dups, sizeof(char *) * e->dups_len);
+            paths[e->dups_len + 1] = NULL;
+            qsort(paths, e->dups_len + 1, sizeof(char *), &dedupe_compare_paths);
+            sorted[n].hash = e->hash;
+            sorted[n].paths = paths;
+            n++;
+            dup_count += e->dups_len;
+            *bytes += e->size * e->dups_len;
+        }
+    }
+    qsort(sorted, n, sizeof(dedupe_group), &dedupe_compare_groups);
+
+    for (size_t i = 0; i < n; i++) {
+        for (char **p = sorted[i].paths; *p != NULL; p++)
+            fprintf(out, "DUPLICATE %016llx %s\n", (unsigned long long)sorted[i].hash, *p);
+        free(sorted[i].paths);
+    }
+    free(sorted);
+    return dup_count;
+}
@@ -0,0 +1,95 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_DEDUPE_H
+#define GIFMETADATA_DEDUPE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "gifindex.h"
+
+// finds files with identical content while scanning, so that the results
+// of the first can be reused for the rest. files are only hashed once
+// another file of the same size turns up, most files are never read past
+// their headers. a matching hash is confirmed by comparing the bytes
+
+#define GIFDEDUPE_SUCCESS 0
+#define GIFDEDUPE_IO_ERROR -1
+#define GIFDEDUPE_ALLOC_FAILURE -2
+
+// read size when hashing
+#define GIFDEDUPE_READ_SIZE 65536
+
+// xxh64 of a whole file, streamed
+typedef struct gifdedupe_hash {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char stripe[32];
+    size_t stripe_len;
+} gifdedupe_hash;
+
+// a distinct content, or the first file of its size before it is hashed
+typedef struct gifdedupe_entry {
+    uint64_t size;
+    uint64_t hash;
+    int hashed;
+    // the first file, and the others with the same content
+    char *path;
+    char **dups;
+    size_t dups_len;
+    size_t dups_size;
+    // results of a parse, set once and then read without the lock
+    gifindex_record *record;
+    struct gifdedupe_entry *next;
+} gifdedupe_entry;
+
+typedef struct gifdedupe {
+    pthread_mutex_t lock;
+    // chained by size
+    gifdedupe_entry **buckets;
+    size_t bucket_count;
+    size_t entries;
+} gifdedupe;
+
+void gifdedupe_hash_init(gifdedupe_hash *h);
+void gifdedupe_hash_update(gifdedupe_hash *h, const unsigned char *data, size_t len);
+uint64_t gifdedupe_hash_final(const gifdedupe_hash *h);
+// Hashes the whole of fd with pread, leaving its offset alone
+int gifdedupe_hash_fd(int fd, uint64_t *hash);
+
+gifdedupe *gifdedupe_new();
+void gifdedupe_free(gifdedupe *d);
+
+// Registers a file being scanned, fd and st being the open file. Returns the
+// record of an earlier file with the same content, or NULL when the file has
+// to be parsed. *entry is then set to where its record is wanted with
+// gifdedupe_set_record, or NULL when it is not. *status reports a file that
+// could not be hashed, which is parsed as a distinct file. Safe to call from
+// any thread
+const gifindex_record *gifdedupe_lookup(gifdedupe *d, const char *path, int fd, const struct stat *st, gifdedupe_entry **entry, int *status);
+// Keeps the record of a file parsed after gifdedupe_lookup, taking ownership
+void gifdedupe_set_record(gifdedupe *d, gifdedupe_entry *entry, gifindex_record *record);
+
+// Prints every group of identical files as a "DUPLICATE <hash> <path>" line
+// per file, sorted by path. Returns the number of files that duplicate an
+// earlier one
+size_t gifdedupe_report(gifdedupe *d, FILE *out, size_t *groups, uint64_t *bytes);
+
+#endif
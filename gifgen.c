@@ -0,0 +1,118 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// gifgen writes synthetic gifs, either one built from a benchmark case and
+// the given overrides or every benchmark case into a directory
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gifsynth.h"
+
+void print_usage() {
+    fprintf(stderr,
+        "Usage: gifgen [-n case] [-W width] [-H height] [-f frames] [-g gct size]\n"
+        "              [-l lct size] [-c comments] [-C comment bytes]\n"
+        "              [-a applications] [-A application bytes]\n"
+        "              [-d frame data bytes] [-z] [-s seed] [-o output]\n"
+        "       gifgen -O directory\n"
+        "       gifgen -L\n");
+}
+
+int write_gif(const gifsynth_params *p, const char *path) {
+    gifsynth_buf b = { NULL, 0, 0, 0 };
+    if (!gifsynth_make(&b, p, NULL)) {
+        fprintf(stderr, "ERROR Buffer memory alloc failure\n");
+        free(b.data);
+        return 3;
+    }
+
+    FILE *f = path != NULL ? fopen(path, "wb") : stdout;
+    if (f == NULL) {
+        fprintf(stderr, "ERROR Failed to open %s\n", path);
+        free(b.data);
+        return 1;
+    }
+    int failed = fwrite(b.data, 1, b.len, f) != b.len;
+    if (path != NULL)
+        failed |= fclose(f) != 0;
+    else
+        failed |= fflush(f) != 0;
+    free(b.data);
+
+    if (failed) {
+        fprintf(stderr, "ERROR Failed to write %s\n", path != NULL ? path : "output");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    gifsynth_params p = gifsynth_cases[0].params;
+    const char *output = NULL;
+    const char *directory = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:W:H:f:g:l:c:C:a:A:d:zs:o:O:L")) != -1) {
+        switch (opt) {
+        case 'n': {
+            const gifsynth_case *c = gifsynth_find_case(optarg);
+            if (c == NULL) {
+                fprintf(stderr, "ERROR Unknown case %s\n", optarg);
+                return 1;
+            }
+            // a case resets the parameters, overrides after it still apply
+            p = c->params;
+            break;
+        }
+        case 'W': p.width = atoi(optarg); break;
+        case 'H': p.height = atoi(optarg); break;
+        case 'f': p.frames = atoi(optarg); break;
+        case 'g': p.gct_size = atoi(optarg); break;
+        case 'l': p.lct_size = atoi(optarg); break;
+        case 'c': p.comments = atoi(optarg); break;
+        case 'C': p.comment_len = atol(optarg); break;
+        case 'a': p.applications = atoi(optarg); break;
+        case 'A': p.app_len = atol(optarg); break;
+        case 'd': p.frame_data_len = atol(optarg); break;
+        case 'z': p.lzw = 1; break;
+        case 's': p.seed = strtoul(optarg, NULL, 10); break;
+        case 'o': output = optarg; break;
+        case 'O': directory = optarg; break;
+        case 'L':
+            for (const gifsynth_case *c = gifsynth_cases; c->name != NULL; c++)
+                printf("%s\n", c->name);
+            return 0;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (directory == NULL)
+        return write_gif(&p, output);
+
+    for (const gifsynth_case *c = gifsynth_cases; c->name != NULL; c++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.gif", directory, c->name);
+        int status = write_gif(&c->params, path);
+        if (status != 0)
+            return status;
+    }
+    return 0;
+}
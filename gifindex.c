@@ -0,0 +1,394 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "gifindex.h"
+
+// records and the payloads within them are padded to 8 bytes
+#define INDEX_ALIGN(n) (((size_t)(n) + 7) & ~(size_t)7)
+
+uint64_t index_hash(const char *path, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)path[i]) * 1099511628211ULL;
+    return hash;
+}
+
+const char *index_record_path(const gifindex_record *r) {
+    return (const char *)(r + 1);
+}
+
+const gifindex_extension *gifindex_first_extension(const gifindex_record *r) {
+    return (const gifindex_extension *)((const unsigned char *)(r + 1) + INDEX_ALIGN(r->path_len + 1));
+}
+
+const gifindex_extension *gifindex_next_extension(const gifindex_extension *e) {
+    return (const gifindex_extension *)((const unsigned char *)(e + 1) + INDEX_ALIGN(e->stored_len));
+}
+
+const unsigned char *gifindex_extension_payload(const gifindex_extension *e) {
+    return (const unsigned char *)(e + 1);
+}
+
+// checks that the record at offset lies within len bytes and so do its
+// path and extensions
+int index_record_valid(const unsigned char *map, size_t len, size_t offset) {
+    if (len - offset < sizeof(gifindex_record))
+        return 0;
+    const gifindex_record *r = (const gifindex_record *)(map + offset);
+    if (r->record_len < sizeof(gifindex_record) || r->record_len % 8 != 0 || r->record_len > len - offset)
+        return 0;
+
+    size_t i = sizeof(gifindex_record) + INDEX_ALIGN((size_t)r->path_len + 1);
+    for (uint32_t n = 0; n < r->extension_count && i <= r->record_len; n++) {
+        if (r->record_len - i < sizeof(gifindex_extension))
+            return 0;
+        const gifindex_extension *e = (const gifindex_extension *)(map + offset + i);
+        i += sizeof(gifindex_extension) + INDEX_ALIGN(e->stored_len);
+    }
+    return i == r->record_len;
+}
+
+// slot of a path in the table, either empty or holding its record
+size_t index_slot(const gifindex *idx, const char *path, size_t path_len) {
+    size_t mask = idx->table_size - 1;
+    size_t i = index_hash(path, path_len) & mask;
+    while (idx->table[i] != NULL) {
+        const gifindex_record *r = idx->table[i];
+        if (r->path_len == path_len && memcmp(index_record_path(r), path, path_len) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+int index_write_all(int fd, const void *buf, size_t len) {
+    const unsigned char *b = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, b, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return GIFINDEX_IO_ERROR;
+        b += w;
+        len -= w;
+    }
+    return GIFINDEX_SUCCESS;
+}
+
+void index_unload(gifindex *idx) {
+    if (idx->map != NULL)
+        munmap(idx->map, idx->map_len);
+    free(idx->table);
+    idx->map = NULL;
+    idx->map_len = 0;
+    idx->valid_len = 0;
+    idx->table = NULL;
+    idx->table_size = 0;
+    idx->records = 0;
+    idx->paths = 0;
+}
+
+// maps the index and fills the table with the latest record of each path.
+// a new file is given its header and a record cut off by a crash is
+// truncated away, so the caller must hold the file lock
+int index_load(gifindex *idx) {
+    struct stat st;
+    if (fstat(idx->fd, &st) != 0)
+        return GIFINDEX_IO_ERROR;
+
+    if (st.st_size == 0) {
+        gifindex_header h;
+        memset(&h, 0, sizeof(gifindex_header));
+        memcpy(h.magic, GIFINDEX_MAGIC, sizeof(h.magic));
+        h.version = GIFINDEX_VERSION;
+        h.byte_order = GIFINDEX_BYTE_ORDER;
+        return index_write_all(idx->fd, &h, sizeof(gifindex_header));
+    }
+    if (st.st_size < sizeof(gifindex_header))
+        return GIFINDEX_INVALID;
+
+    idx->map_len = st.st_size;
+    idx->map = mmap(NULL, idx->map_len, PROT_READ, MAP_SHARED, idx->fd, 0);
+    if (idx->map == MAP_FAILED) {
+        idx->map = NULL;
+        return GIFINDEX_IO_ERROR;
+    }
+    const gifindex_header *h = (const gifindex_header *)idx->map;
+    if (memcmp(h->magic, GIFINDEX_MAGIC, sizeof(h->magic)) != 0 || h->version != GIFINDEX_VERSION || h->byte_order != GIFINDEX_BYTE_ORDER)
+        return GIFINDEX_INVALID;
+
+    size_t offset = sizeof(gifindex_header);
+    while (offset < idx->map_len && index_record_valid(idx->map, idx->map_len, offset)) {
+        offset += ((const gifindex_record *)(idx->map + offset))->record_len;
+        idx->records++;
+    }
+    if (offset < idx->map_len && ftruncate(idx->fd, offset) != 0)
+        return GIFINDEX_IO_ERROR;
+    idx->valid_len = offset;
+
+    idx->table_size = 16;
+    while (idx->table_size < idx->records * 2)
+        idx->table_size *= 2;
+    idx->table = calloc(idx->table_size, sizeof(gifindex_record *));
+    if (idx->table == NULL)
+        return GIFINDEX_ALLOC_FAILURE;
+
+    for (offset = sizeof(gifindex_header); offset < idx->valid_len;) {
+        const gifindex_record *r = (const gifindex_record *)(idx->map + offset);
+        size_t slot = index_slot(idx, index_record_path(r), r->path_len);
+        if (idx->table[slot] == NULL)
+            idx->paths++;
+        idx->table[slot] = r;
+        offset += r->record_len;
+    }
+    return GIFINDEX_SUCCESS;
+}
+
+void index_free(gifindex *idx) {
+    index_unload(idx);
+    if (idx->fd >= 0)
+        close(idx->fd);
+    pthread_mutex_destroy(&idx->lock);
+    free(idx->pending);
+    free(idx->path);
+    free(idx);
+}
+
+gifindex *gifindex_open(const char *path, int *status) {
+    gifindex *idx = calloc(1, sizeof(gifindex));
+    if (idx == NULL) {
+        *status = GIFINDEX_ALLOC_FAILURE;
+        return NULL;
+    }
+    pthread_mutex_init(&idx->lock, NULL);
+    idx->opened = time(NULL);
+    idx->path = strdup(path);
+    idx->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (idx->path == NULL || idx->fd < 0) {
+        *status = idx->path == NULL ? GIFINDEX_ALLOC_FAILURE : GIFINDEX_IO_ERROR;
+        index_free(idx);
+        return NULL;
+    }
+
+    flock(idx->fd, LOCK_EX);
+    *status = index_load(idx);
+    flock(idx->fd, LOCK_UN);
+    if (*status != GIFINDEX_SUCCESS) {
+        index_free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+const gifindex_record *gifindex_find(const gifindex *idx, const char *path, const struct stat *st) {
+    if (idx->table == NULL)
+        return NULL;
+    const gifindex_record *r = idx->table[index_slot(idx, path, strlen(path))];
+    if (r == NULL || r->dev != st->st_dev || r->ino != st->st_ino || r->size != st->st_size)
+        return NULL;
+    if (r->mtime_sec != st->st_mtim.tv_sec || r->mtime_nsec != st->st_mtim.tv_nsec)
+        return NULL;
+    return r;
+}
+
+void gifindex_builder_reset(gifindex_builder *b) {
+    b->len = 0;
+    b->extension_count = 0;
+    b->frames = 0;
+    b->failed = 0;
+}
+
+void gifindex_builder_free(gifindex_builder *b) {
+    free(b->data);
+    b->data = NULL;
+    b->size = 0;
+}
+
+void gifindex_builder_extension(gifindex_builder *b, const gifmetadata_extension_info *extension) {
+    size_t stored_len = extension->type == application_subblock ? 0 : extension->buffer_len;
+    size_t len = sizeof(gifindex_extension) + INDEX_ALIGN(stored_len);
+    if (b->failed)
+        return;
+    if (b->len + len > b->size) {
+        size_t size = (b->len + len) * 2;
+        unsigned char *data = realloc(b->data, size);
+        if (data == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->size = size;
+    }
+
+    gifindex_extension *e = (gifindex_extension *)(b->data + b->len);
+    memset(e, 0, len);
+    e->block_offset = extension->block_offset;
+    e->len = extension->buffer_len;
+    e->stored_len = stored_len;
+    e->type = extension->type;
+    memcpy(e + 1, extension->buffer, stored_len);
+    b->len += len;
+    b->extension_count++;
+}
+
+// appends the pending records to the index, the caller holds idx->lock
+int index_flush(gifindex *idx) {
+    if (idx->pending_len == 0)
+        return GIFINDEX_SUCCESS;
+    flock(idx->fd, LOCK_EX);
+    int status = index_write_all(idx->fd, idx->pending, idx->pending_len);
+    flock(idx->fd, LOCK_UN);
+    idx->pending_len = 0;
+    return status;
+}
+
+// bytes of the record for a path and the builder's extensions
+size_t index_record_len(size_t path_len, const gifindex_builder *b) {
+    return sizeof(gifindex_record) + INDEX_ALIGN(path_len + 1) + b->len;
+}
+
+void index_fill_record(gifindex_record *r, size_t len, const char *path, size_t path_len, const struct stat *st, const gifmetadata_state *s, const gifindex_builder *b) {
+    memset(r, 0, len);
+    r->record_len = len;
+    r->path_len = path_len;
+    r->dev = st->st_dev;
+    r->ino = st->st_ino;
+    r->size = st->st_size;
+    r->mtime_sec = st->st_mtim.tv_sec;
+    r->mtime_nsec = st->st_mtim.tv_nsec;
+    r->frames = b->frames;
+    r->extension_count = b->extension_count;
+    r->canvas_width = s->canvas_width;
+    r->canvas_height = s->canvas_height;
+    r->gif_version = s->gif_version;
+    r->complete = s->read_state == trailer;
+    memcpy(r + 1, path, path_len);
+    memcpy((unsigned char *)gifindex_first_extension(r), b->data, b->len);
+}
+
+gifindex_record *gifindex_new_record(const char *path, const struct stat *st, const gifmetadata_state *s, const gifindex_builder *b) {
+    size_t path_len = strlen(path);
+    size_t len = index_record_len(path_len, b);
+    if (b->failed || len > UINT32_MAX)
+        return NULL;
+    gifindex_record *r = malloc(len);
+    if (r != NULL)
+        index_fill_record(r, len, path, path_len, st, s, b);
+    return r;
+}
+
+int gifindex_add(gifindex *idx, const char *path, const struct stat *st, const gifmetadata_state *s, const gifindex_builder *b) {
+    if (b->failed)
+        return GIFINDEX_ALLOC_FAILURE;
+    if (st->st_mtim.tv_sec >= idx->opened)
+        return GIFINDEX_SUCCESS;
+    size_t path_len = strlen(path);
+    size_t len = index_record_len(path_len, b);
+    if (len > UINT32_MAX)
+        return GIFINDEX_SUCCESS;
+
+    pthread_mutex_lock(&idx->lock);
+    if (idx->pending_len + len > idx->pending_size) {
+        size_t size = (idx->pending_len + len) * 2;
+        unsigned char *pending = realloc(idx->pending, size);
+        if (pending == NULL) {
+            pthread_mutex_unlock(&idx->lock);
+            return GIFINDEX_ALLOC_FAILURE;
+        }
+        idx->pending = pending;
+        idx->pending_size = size;
+    }
+
+    index_fill_record((gifindex_record *)(idx->pending + idx->pending_len), len, path, path_len, st, s, b);
+    idx->pending_len += len;
+
+    idx->added++;
+    if (idx->table == NULL || idx->table[index_slot(idx, path, path_len)] == NULL)
+        idx->added_paths++;
+
+    int status = GIFINDEX_SUCCESS;
+    if (idx->pending_len >= GIFINDEX_FLUSH_SIZE)
+        status = index_flush(idx);
+    pthread_mutex_unlock(&idx->lock);
+    return status;
+}
+
+// rewrites the index with only the latest record of each path, through a
+// temporary file renamed over it
+int index_compact(gifindex *idx) {
+    flock(idx->fd, LOCK_EX);
+    index_unload(idx);
+    int status = index_load(idx);
+
+    size_t path_len = strlen(idx->path);
+    char *tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+    if (status == GIFINDEX_SUCCESS && tmp_path == NULL)
+        status = GIFINDEX_ALLOC_FAILURE;
+    int tmp_fd = -1;
+    if (status == GIFINDEX_SUCCESS) {
+        memcpy(tmp_path, idx->path, path_len);
+        memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+        tmp_fd = mkstemp(tmp_path);
+        if (tmp_fd < 0)
+            status = GIFINDEX_IO_ERROR;
+    }
+
+    if (status == GIFINDEX_SUCCESS) {
+        FILE *f = fdopen(tmp_fd, "wb");
+        struct stat st;
+        int failed = f == NULL || fstat(idx->fd, &st) != 0 || fchmod(tmp_fd, st.st_mode & 07777) != 0;
+        if (!failed)
+            failed = fwrite(idx->map, 1, sizeof(gifindex_header), f) != sizeof(gifindex_header);
+        for (size_t offset = sizeof(gifindex_header); !failed && offset < idx->valid_len;) {
+            const gifindex_record *r = (const gifindex_record *)(idx->map + offset);
+            if (idx->table[index_slot(idx, index_record_path(r), r->path_len)] == r)
+                failed = fwrite(r, 1, r->record_len, f) != r->record_len;
+            offset += r->record_len;
+        }
+        failed = failed || fflush(f) != 0 || fsync(tmp_fd) != 0;
+        if (f != NULL)
+            failed = fclose(f) != 0 || failed;
+        else
+            close(tmp_fd);
+        failed = failed || rename(tmp_path, idx->path) != 0;
+        if (failed) {
+            unlink(tmp_path);
+            status = GIFINDEX_IO_ERROR;
+        }
+    }
+
+    flock(idx->fd, LOCK_UN);
+    free(tmp_path);
+    return status;
+}
+
+int gifindex_close(gifindex *idx) {
+    int status = index_flush(idx);
+    size_t records = idx->records + idx->added;
+    size_t paths = idx->paths + idx->added_paths;
+    if (status == GIFINDEX_SUCCESS && records > GIFINDEX_COMPACT_MIN && records > paths * 2)
+        status = index_compact(idx);
+    index_free(idx);
+    return status;
+}
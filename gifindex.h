@@ -0,0 +1,149 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_INDEX_H
+#define GIFMETADATA_INDEX_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "gifmetadata.h"
+
+// on-disk index of scanned files, so that unchanged files are answered
+// without parsing them again. the index is a header followed by records
+// that are only ever appended, the last record for a path wins. records are
+// in host byte order and laid out to be read straight from the mapping
+
+#define GIFINDEX_SUCCESS 0
+#define GIFINDEX_IO_ERROR -1
+#define GIFINDEX_ALLOC_FAILURE -2
+// the file exists but is not an index, or one from another version
+#define GIFINDEX_INVALID -3
+
+#define GIFINDEX_MAGIC "gifindex"
+#define GIFINDEX_VERSION 1
+// written in host byte order, an index from another byte order is invalid
+#define GIFINDEX_BYTE_ORDER 0x01020304
+// records added are buffered up to this size before being appended
+#define GIFINDEX_FLUSH_SIZE (1 << 20)
+// the index is rewritten with only the latest records once there are more
+// than this many and over half of them are superseded
+#define GIFINDEX_COMPACT_MIN 1024
+
+typedef struct gifindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+} gifindex_header;
+
+// followed by the path, NUL padded to 8 bytes, and extension_count
+// extensions
+typedef struct gifindex_record {
+    // whole record including the padding
+    uint32_t record_len;
+    uint32_t path_len;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t frames;
+    uint32_t extension_count;
+    uint16_t canvas_width;
+    uint16_t canvas_height;
+    uint8_t gif_version;
+    // the trailer was found
+    uint8_t complete;
+    uint8_t reserved[2];
+} gifindex_record;
+
+// followed by stored_len bytes of payload, NUL padded to 8 bytes.
+// application sub-blocks are only recorded by their length
+typedef struct gifindex_extension {
+    uint64_t block_offset;
+    uint32_t len;
+    uint32_t stored_len;
+    uint8_t type;
+    uint8_t reserved[7];
+} gifindex_extension;
+
+// extensions and frames of a file being scanned, turned into a record by
+// gifindex_add
+typedef struct gifindex_builder {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    uint32_t extension_count;
+    uint32_t frames;
+    int failed;
+} gifindex_builder;
+
+typedef struct gifindex {
+    char *path;
+    int fd;
+    // records of the file when it was opened
+    unsigned char *map;
+    size_t map_len;
+    // end of the last whole record in the mapping
+    size_t valid_len;
+    // latest record of every path in the mapping, open addressed by hash
+    const gifindex_record **table;
+    size_t table_size;
+    size_t records;
+    size_t paths;
+    // files modified since this time are not added, their next change could
+    // keep the same mtime
+    time_t opened;
+
+    // records added since opening, see GIFINDEX_FLUSH_SIZE
+    pthread_mutex_t lock;
+    unsigned char *pending;
+    size_t pending_len;
+    size_t pending_size;
+    size_t added;
+    size_t added_paths;
+} gifindex;
+
+// Opens or creates the index at path, *status is set on failure
+gifindex *gifindex_open(const char *path, int *status);
+// Writes the records added and compacts the index when it is mostly
+// superseded records, returns a status
+int gifindex_close(gifindex *idx);
+
+// Returns the record of path when it still matches the file's device,
+// inode, size and mtime, otherwise NULL. Safe to call from any thread
+const gifindex_record *gifindex_find(const gifindex *idx, const char *path, const struct stat *st);
+const gifindex_extension *gifindex_first_extension(const gifindex_record *r);
+const gifindex_extension *gifindex_next_extension(const gifindex_extension *e);
+const unsigned char *gifindex_extension_payload(const gifindex_extension *e);
+
+void gifindex_builder_reset(gifindex_builder *b);
+void gifindex_builder_free(gifindex_builder *b);
+// records an extension as reported to extension_cb
+void gifindex_builder_extension(gifindex_builder *b, const gifmetadata_extension_info *extension);
+
+// Returns a heap copy of the record gifindex_add would add, NULL on
+// allocation failure
+gifindex_record *gifindex_new_record(const char *path, const struct stat *st, const gifmetadata_state *s, const gifindex_builder *b);
+
+// Adds the record of a parsed file. Safe to call from any thread, returns a
+// status
+int gifindex_add(gifindex *idx, const char *path, const struct stat *st, const gifmetadata_state *s, const gifindex_builder *b);
+
+#endif
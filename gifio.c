@@ -0,0 +1,120 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gifmetadata.h"
+
+void gifmetadata_fd_reader_init(gifmetadata_state *s, gifmetadata_fd_reader *r) {
+    s->flags |= GIFMETADATA_FLAG_SKIP;
+    r->offset = 0;
+    r->window = GIFMETADATA_FD_MIN_WINDOW;
+}
+
+int gifmetadata_fd_reader_feed(
+    gifmetadata_state *s,
+    gifmetadata_fd_reader *r,
+    unsigned char *buf,
+    size_t b,
+    const gifmetadata_callbacks *cb) {
+
+    if (b == 0) {
+        gifmetadata_parse_end(s, cb);
+        return GIFMETADATA_END;
+    }
+
+    int parse_status = gifmetadata_parse_gif_v2(s, buf, b, cb);
+    if (parse_status != GIFMETADATA_SUCCESS)
+        return parse_status;
+    r->offset += b;
+
+    if (s->skip_len > 0) {
+        // the window ended inside a color table or image data, seek past
+        // the rest of it and read only from the next length byte
+        r->offset += s->skip_len;
+        s->file_i += s->skip_len;
+        if (s->flags & GIFMETADATA_FLAG_STATS)
+            s->stats.state_bytes[s->skip_state] += s->skip_len;
+        s->skip_len = 0;
+        r->window = GIFMETADATA_FD_MIN_WINDOW;
+    } else if (r->window < GIFMETADATA_FD_MAX_WINDOW) {
+        // reading extension payloads, widen the window
+        r->window *= 2;
+    }
+
+    if (s->read_state == trailer) {
+        gifmetadata_parse_end(s, cb);
+        return GIFMETADATA_END;
+    }
+    return GIFMETADATA_SUCCESS;
+}
+
+int gifmetadata_parse_fd_v2(
+    gifmetadata_state *s,
+    int fd,
+    const gifmetadata_callbacks *cb) {
+
+    unsigned char buf[GIFMETADATA_FD_MAX_WINDOW];
+    gifmetadata_fd_reader r;
+    gifmetadata_fd_reader_init(s, &r);
+
+    for (;;) {
+        ssize_t b = pread(fd, buf, r.window, r.offset);
+        if (b < 0) {
+            if (errno == EINTR)
+                continue;
+            return GIFMETADATA_IO_ERROR;
+        }
+
+        int parse_status = gifmetadata_fd_reader_feed(s, &r, buf, b, cb);
+        if (parse_status == GIFMETADATA_END)
+            return GIFMETADATA_SUCCESS;
+        if (parse_status != GIFMETADATA_SUCCESS)
+            return parse_status;
+    }
+}
+
+int gifmetadata_parse_mmap_v2(
+    gifmetadata_state *s,
+    int fd,
+    const gifmetadata_callbacks *cb) {
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return GIFMETADATA_IO_ERROR;
+    if (st.st_size == 0)
+        return GIFMETADATA_SUCCESS;
+
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return GIFMETADATA_IO_ERROR;
+    // hints only, failure is not an error
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    s->flags |= GIFMETADATA_FLAG_ZERO_COPY;
+    int parse_status = gifmetadata_parse_gif_v2(s, map, st.st_size, cb);
+    if (parse_status == GIFMETADATA_SUCCESS)
+        gifmetadata_parse_end(s, cb);
+
+    munmap(map, st.st_size);
+    return parse_status;
+}
@@ -0,0 +1,225 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// pull iterator over a gif held whole in memory. unlike the parse functions
+// nothing is carried across chunks, so every block is read straight from the
+// buffer and lengths are used to hop from one block to the next
+
+#include <string.h>
+
+#include "gifmetadata.h"
+
+void gifmetadata_iter_init(gifmetadata_iter *it, const unsigned char *buffer, size_t buffer_len) {
+    memset(it, 0, sizeof(gifmetadata_iter));
+    it->buffer = buffer;
+    it->buffer_len = buffer_len;
+    it->read_state = header;
+}
+
+// stops iteration, every later call returns GIFMETADATA_END
+static int iter_stop(gifmetadata_iter *it, enum gifmetadata_read_state read_state, int status) {
+    it->read_state = read_state;
+    return status;
+}
+
+// offset just past the terminator of the sub-blocks starting with the size
+// byte at i, zero when the terminator lies beyond the buffer
+static size_t iter_subblocks_end(const gifmetadata_iter *it, size_t i) {
+    if (i >= it->buffer_len)
+        return 0;
+    size_t rest = 0;
+    unsigned char last_len = 0;
+    size_t hops = 0;
+    size_t end = gifmetadata_walk_subblocks(it->buffer, it->buffer_len, i, &rest, &last_len, &hops);
+    return end < it->buffer_len ? end + 1 : 0;
+}
+
+// reads the extension whose introducer is at i
+static int iter_extension(gifmetadata_iter *it, gifmetadata_block *block, size_t i) {
+    const unsigned char *b = it->buffer;
+    size_t len = it->buffer_len;
+    // introducer, label and the first size byte
+    if (len - i < 3)
+        return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+
+    block->label = b[i + 1];
+    switch (block->label) {
+    case 0x01:
+        block->type = block_plain_text;
+        break;
+    case 0xf9:
+        block->type = block_control_extension;
+        break;
+    case 0xfe:
+        block->type = block_comment;
+        break;
+    case 0xff:
+        block->type = block_application;
+        break;
+    default:
+        block->type = block_extension;
+        break;
+    }
+
+    size_t first = i + 2;
+    size_t first_len = b[first];
+    block->data = b + first + 1;
+    size_t end;
+    if (first_len == 0) {
+        end = first + 1;
+    } else if (first_len >= len - first) {
+        return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+    } else if (block->type == block_comment) {
+        // a comment runs on past its sub-block size up to the first zero
+        // byte, see known_extension in gif.c
+        const unsigned char *terminator = memchr(b + first + 1 + first_len, 0, len - (first + 1 + first_len));
+        if (terminator == NULL)
+            return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+        block->data_len = terminator - block->data;
+        end = terminator - b + 1;
+    } else {
+        block->data_len = first_len;
+        size_t next = first + 1 + first_len;
+        end = iter_subblocks_end(it, next);
+        if (end == 0)
+            return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+        if (b[next] != 0)
+            block->subblocks = next;
+    }
+
+    block->len = end - i;
+    it->i = end;
+    return GIFMETADATA_SUCCESS;
+}
+
+int gifmetadata_next_block(gifmetadata_iter *it, gifmetadata_block *block) {
+    const unsigned char *b = it->buffer;
+    size_t len = it->buffer_len;
+    size_t i = it->i;
+
+    memset(block, 0, sizeof(gifmetadata_block));
+    block->offset = i;
+
+    switch (it->read_state) {
+    case header:
+        for (size_t j = 0; j < 6 && j < len; j++) {
+            if (j == 4 ? b[j] != '7' && b[j] != '9' : b[j] != "GIF8xa"[j])
+                return iter_stop(it, eof, GIFMETADATA_INVALID_SIG);
+        }
+        if (len < 6)
+            return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+        it->gif_version = b[4] == '7' ? gif87a : gif89a;
+        block->type = block_header;
+        block->data = b;
+        block->data_len = block->len = 6;
+        it->i = 6;
+        it->read_state = logical_screen_descriptor;
+        return GIFMETADATA_SUCCESS;
+    case logical_screen_descriptor:
+        if (len - i < 7)
+            return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+        it->canvas_width = b[i] | (b[i + 1] << 8);
+        it->canvas_height = b[i + 2] | (b[i + 3] << 8);
+        block->type = block_logical_screen_descriptor;
+        block->data = b + i;
+        block->data_len = block->len = 7;
+        it->i = i + 7;
+        if (b[i + 4] & 0x80) {
+            it->color_table_len = 3 << ((b[i + 4] & 0b111) + 1);
+            it->read_state = global_color_table;
+        } else {
+            it->read_state = searching;
+        }
+        return GIFMETADATA_SUCCESS;
+    case global_color_table:
+    case local_color_table:
+        if (len - i < it->color_table_len)
+            return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+        block->type = it->read_state == global_color_table ? block_global_color_table : block_local_color_table;
+        block->data = b + i;
+        block->data_len = block->len = it->color_table_len;
+        it->i = i + it->color_table_len;
+        it->read_state = it->read_state == global_color_table ? searching : image_data;
+        return GIFMETADATA_SUCCESS;
+    case image_data: {
+        // lzw minimum code size, then the sub-blocks
+        size_t end = iter_subblocks_end(it, i + 1);
+        if (end == 0)
+            return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+        block->type = block_image_data;
+        block->data = b + i;
+        block->data_len = 1;
+        if (b[i + 1] != 0)
+            block->subblocks = i + 1;
+        block->len = end - i;
+        it->i = end;
+        it->read_state = searching;
+        return GIFMETADATA_SUCCESS;
+    }
+    case searching:
+        // bytes that do not start a block are passed over as the parser does
+        while (i < len && b[i] != 0x21 && b[i] != 0x2c && b[i] != 0x3b)
+            i++;
+        it->i = i;
+        block->offset = i;
+        if (i >= len)
+            return iter_stop(it, eof, GIFMETADATA_END);
+
+        switch (b[i]) {
+        case 0x21:
+            return iter_extension(it, block, i);
+        case 0x2c:
+            // introducer, position, size and packed byte
+            if (len - i < 10)
+                return iter_stop(it, eof, GIFMETADATA_TRUNCATED);
+            block->type = block_image_descriptor;
+            block->data = b + i + 1;
+            block->data_len = 9;
+            block->len = 10;
+            it->i = i + 10;
+            if (b[i + 9] & 0x80) {
+                it->color_table_len = 3 << ((b[i + 9] & 0b111) + 1);
+                it->read_state = local_color_table;
+            } else {
+                it->read_state = image_data;
+            }
+            return GIFMETADATA_SUCCESS;
+        default:
+            // nothing is read after the trailer
+            block->type = block_trailer;
+            block->len = 1;
+            it->i = i + 1;
+            it->read_state = trailer;
+            return GIFMETADATA_SUCCESS;
+        }
+    default:
+        return GIFMETADATA_END;
+    }
+}
+
+int gifmetadata_next_subblock(const gifmetadata_iter *it, size_t *cursor, const unsigned char **data, size_t *data_len) {
+    size_t i = *cursor;
+    if (i == 0 || i >= it->buffer_len || it->buffer[i] == 0)
+        return 0;
+    // blocks are only yielded once their sub-blocks are within the buffer
+    size_t n = it->buffer[i];
+    if (n >= it->buffer_len - i)
+        return 0;
+    *data = it->buffer + i + 1;
+    *data_len = n;
+    *cursor = i + 1 + n;
+    return 1;
+}
@@ -0,0 +1,185 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// lzw decoder for image data. the tables are fixed at the 4096 codes the
+// format allows, so nothing is allocated while decoding. pixels are counted
+// into a histogram and an adler-32 as they are decoded, they are never kept
+
+#include <string.h>
+
+#include "gifmetadata.h"
+
+static void lzw_adler_reduce(gifmetadata_lzw *lzw) {
+    lzw->adler_a %= GIFMETADATA_ADLER_MOD;
+    lzw->adler_b %= GIFMETADATA_ADLER_MOD;
+    lzw->adler_pending = 0;
+}
+
+// starts the table over after a clear code
+static void lzw_clear(gifmetadata_lzw *lzw) {
+    lzw->code_size = lzw->min_code_size + 1;
+    lzw->next_code = (1 << lzw->min_code_size) + 2;
+    lzw->prev_code = -1;
+}
+
+void gifmetadata_lzw_begin(gifmetadata_lzw *lzw, int min_code_size, size_t index, size_t expected_pixels) {
+    memset(&lzw->result, 0, sizeof(gifmetadata_decode));
+    lzw->result.index = index;
+    lzw->result.expected_pixels = expected_pixels;
+    lzw->bits = 0;
+    lzw->bit_count = 0;
+    lzw->active = 1;
+    lzw->done = 0;
+    lzw->adler_a = 1;
+    lzw->adler_b = 0;
+    lzw->adler_pending = 0;
+    lzw->min_code_size = min_code_size;
+    lzw->code_size = 0;
+    lzw->next_code = 0;
+    lzw->prev_code = -1;
+
+    // the format uses 2 even for two colors, and color indices have to fit
+    // the one byte suffixes
+    if (min_code_size < 2 || min_code_size > 8) {
+        lzw->result.errors |= GIFMETADATA_DECODE_CORRUPT;
+        lzw->done = 1;
+        return;
+    }
+    for (int code = 0; code < 1 << min_code_size; code++) {
+        lzw->prefix[code] = 0;
+        lzw->suffix[code] = code;
+        lzw->first[code] = code;
+        lzw->length[code] = 1;
+    }
+    lzw_clear(lzw);
+}
+
+// counts the string of code, pixels past the end of the frame are flagged
+// rather than counted
+static void lzw_output(gifmetadata_lzw *lzw, int code) {
+    gifmetadata_decode *r = &lzw->result;
+    int len = lzw->length[code];
+    for (int j = len - 1; j >= 0; j--) {
+        lzw->pixels[j] = lzw->suffix[code];
+        code = lzw->prefix[code];
+    }
+
+    size_t room = r->expected_pixels - r->pixels;
+    if ((size_t)len > room) {
+        r->errors |= GIFMETADATA_DECODE_EXCESS;
+        len = room;
+    }
+    // a string is at most 4096 pixels, so reducing before it is enough
+    if (lzw->adler_pending + len > GIFMETADATA_ADLER_NMAX)
+        lzw_adler_reduce(lzw);
+    lzw->adler_pending += len;
+    uint32_t a = lzw->adler_a;
+    uint32_t b = lzw->adler_b;
+    for (int j = 0; j < len; j++) {
+        unsigned char pixel = lzw->pixels[j];
+        r->histogram[pixel]++;
+        a += pixel;
+        b += a;
+    }
+    lzw->adler_a = a;
+    lzw->adler_b = b;
+    r->pixels += len;
+}
+
+// takes one code, returns nonzero once decoding has stopped
+static int lzw_code(gifmetadata_lzw *lzw, int code) {
+    int clear = 1 << lzw->min_code_size;
+    if (code == clear) {
+        lzw_clear(lzw);
+        return 0;
+    }
+    if (code == clear + 1) {
+        lzw->done = 1;
+        return 1;
+    }
+
+    int prev = lzw->prev_code;
+    if (prev < 0) {
+        // the first code after a clear has to be a color index
+        if (code > clear) {
+            lzw->result.errors |= GIFMETADATA_DECODE_CORRUPT;
+            lzw->done = 1;
+            return 1;
+        }
+        lzw_output(lzw, code);
+        lzw->prev_code = code;
+        return 0;
+    }
+
+    unsigned char first;
+    if (code < lzw->next_code) {
+        first = lzw->first[code];
+    } else if (code == lzw->next_code && code < GIFMETADATA_LZW_CODES) {
+        // the code being defined, the previous string followed by its own
+        // first pixel
+        first = lzw->first[prev];
+    } else {
+        lzw->result.errors |= GIFMETADATA_DECODE_CORRUPT;
+        lzw->done = 1;
+        return 1;
+    }
+
+    // once the table is full codes are taken without adding to it until
+    // the encoder sends a clear
+    if (lzw->next_code < GIFMETADATA_LZW_CODES) {
+        int next = lzw->next_code++;
+        lzw->prefix[next] = prev;
+        lzw->suffix[next] = first;
+        lzw->first[next] = lzw->first[prev];
+        lzw->length[next] = lzw->length[prev] + 1;
+        if (lzw->next_code == 1 << lzw->code_size && lzw->code_size < 12)
+            lzw->code_size++;
+    }
+    lzw_output(lzw, code);
+    lzw->prev_code = code;
+    return 0;
+}
+
+void gifmetadata_lzw_feed(gifmetadata_lzw *lzw, const unsigned char *data, size_t len) {
+    if (lzw->done)
+        return;
+
+    uint32_t bits = lzw->bits;
+    int bit_count = lzw->bit_count;
+    for (size_t i = 0; i < len; i++) {
+        bits |= (uint32_t)data[i] << bit_count;
+        bit_count += 8;
+        while (bit_count >= lzw->code_size) {
+            int code = bits & ((1 << lzw->code_size) - 1);
+            bits >>= lzw->code_size;
+            bit_count -= lzw->code_size;
+            if (lzw_code(lzw, code))
+                return;
+        }
+    }
+    lzw->bits = bits;
+    lzw->bit_count = bit_count;
+}
+
+void gifmetadata_lzw_end(gifmetadata_lzw *lzw) {
+    gifmetadata_decode *r = &lzw->result;
+    lzw_adler_reduce(lzw);
+    r->checksum = (lzw->adler_b << 16) | lzw->adler_a;
+    if (r->pixels < r->expected_pixels)
+        r->errors |= GIFMETADATA_DECODE_TRUNCATED;
+    lzw->active = 0;
+    lzw->done = 1;
+}
@@ -14,26 +14,81 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <string.h>
+
 #include "gifmetadata.h"
 
+static void *default_alloc(void *user, size_t size) {
+    return malloc(size);
+}
+
+static void *default_resize(void *user, void *ptr, size_t old_size, size_t size) {
+    return realloc(ptr, size);
+}
+
+static void default_release(void *user, void *ptr, size_t size) {
+    free(ptr);
+}
+
+const gifmetadata_allocator gifmetadata_default_allocator = {
+    &default_alloc,
+    &default_resize,
+    &default_release,
+    NULL
+};
+
 gifmetadata_state *gifmetadata_state_new() {
-    gifmetadata_state *state = malloc(sizeof(gifmetadata_state));
+    return gifmetadata_state_new_with(&gifmetadata_default_allocator);
+}
+
+gifmetadata_state *gifmetadata_state_new_with(const gifmetadata_allocator *allocator) {
+    gifmetadata_state *state = allocator->alloc(allocator->user, sizeof(gifmetadata_state));
     if (state == NULL)
         return NULL;
-
-    state->file_i = 0;
+    state->allocator = allocator;
 
     // configure the scratchpad
 
     // TODO include scratchpad size in header file
-    state->scratchpad = malloc(SCRATCHPAD_CHUNK_SIZE);
+    state->scratchpad = allocator->alloc(allocator->user, SCRATCHPAD_CHUNK_SIZE);
     if (state->scratchpad == NULL) {
-        free(state);
+        allocator->release(allocator->user, state, sizeof(gifmetadata_state));
         return NULL;
     }
     state->scratchpad_size = SCRATCHPAD_CHUNK_SIZE;
+    state->flags = 0;
+    state->query = 0;
+    state->query_comments = 0;
+    state->lzw = NULL;
+
+    gifmetadata_state_reset(state);
+    return state;
+}
+
+void gifmetadata_state_reset(gifmetadata_state *state) {
+    // the allocator, scratchpad, flags, query and decoder outlive a parse
+    const gifmetadata_allocator *allocator = state->allocator;
+    unsigned char *scratchpad = state->scratchpad;
+    size_t scratchpad_size = state->scratchpad_size;
+    unsigned int flags = state->flags;
+    unsigned int query = state->query;
+    int query_comments = state->query_comments;
+    gifmetadata_lzw *lzw = state->lzw;
+
+    memset(state, 0, sizeof(gifmetadata_state));
+    state->allocator = allocator;
+    state->scratchpad = scratchpad;
+    state->scratchpad_size = scratchpad_size;
+    state->flags = flags;
+    state->query = query;
+    state->query_comments = query_comments;
+    state->lzw = lzw;
+    if (lzw != NULL)
+        lzw->active = 0;
+
     state->scratchpad_i = 0;
     state->scratchpad_len = 0;
+    state->payload_chunk_i = -1;
 
     // initial values
     state->read_state = header;
@@ -44,14 +99,36 @@ gifmetadata_state *gifmetadata_state_new() {
 
     state->canvas_width = -1;
     state->canvas_height = -1;
-
-    return state;
+    state->loop_count = -1;
+    state->frame.transparent_index = -1;
 }
 
 void gifmetadata_state_free(gifmetadata_state *state) {
+    const gifmetadata_allocator *a = state->allocator;
     if (state->scratchpad != NULL)
-        free(state->scratchpad);
-    free(state);
+        a->release(a->user, state->scratchpad, state->scratchpad_size);
+    if (state->lzw != NULL)
+        a->release(a->user, state->lzw, sizeof(gifmetadata_lzw));
+    a->release(a->user, state, sizeof(gifmetadata_state));
+}
+
+const char *gifmetadata_read_state_name(enum gifmetadata_read_state state) {
+    switch (state) {
+    case header: return "header";
+    case logical_screen_descriptor: return "logical_screen_descriptor";
+    case global_color_table: return "global_color_table";
+    case control_extension: return "control_extension";
+    case image_descriptor: return "image_descriptor";
+    case local_color_table: return "local_color_table";
+    case image_data: return "image_data";
+    case extension: return "extension";
+    case known_extension: return "known_extension";
+    case unknown_extension: return "unknown_extension";
+    case trailer: return "trailer";
+    case searching: return "searching";
+    case eof: return "eof";
+    }
+    return "unknown";
 }
 
 int gifmetadata_parse_gif(
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 // error
 #define GIFMETADATA_SUCCESS 0 
@@ -27,8 +28,72 @@
 #define GIFMETADATA_COMMENT_EXCEEDS_BOUNDS -2
 // TODO rename to ALLOC_FAILURE
 #define GIFMETADATA_ALLOC_FAILED -3
+#define GIFMETADATA_IO_ERROR -4
+// a block runs past the end of the buffer given to gifmetadata_iter_init
+#define GIFMETADATA_TRUNCATED -5
+// gifmetadata_next_block has passed the trailer or the end of the buffer,
+// or gifmetadata_fd_reader_feed the end of the file
+#define GIFMETADATA_END 1
+// every field of gifmetadata_state.query has been found, the rest of the
+// chunk is left unparsed
+#define GIFMETADATA_QUERY_SATISFIED 2
+// gifmetadata_state_deserialize was given something other than a state
+// saved by this version, or a damaged one
+#define GIFMETADATA_INVALID_STATE -6
 
 #define SCRATCHPAD_CHUNK_SIZE 256
+// length of the identifier of the application extensions holding a loop
+// count, NETSCAPE2.0 and ANIMEXTS1.0
+#define GIFMETADATA_LOOP_ID_LEN 11
+
+// serialized parser states start with the magic, followed by the version
+// which changes whenever the layout does
+#define GIFMETADATA_STATE_MAGIC "gifstate"
+#define GIFMETADATA_STATE_VERSION 2
+
+// parser flags, set on gifmetadata_state.flags before the first parse
+
+// jump over color tables and image data using their known lengths instead of
+// visiting every byte, state callbacks fire once per skipped run rather than
+// once per byte. without a state callback or GIFMETADATA_FLAG_STATS nothing
+// can see the difference, so such runs are jumped over regardless, a file cut
+// off inside its global color table then ends searching as it does with the
+// flag
+#define GIFMETADATA_FLAG_SKIP 0x1
+// hand extension payloads that lie within the current chunk to extension_cb
+// as pointers into the chunk instead of copying them into the scratchpad,
+// such buffers are not NUL terminated so buffer_len must be used
+#define GIFMETADATA_FLAG_ZERO_COPY 0x2
+// deliver plain text, application and comment payloads to payload_cb as they
+// arrive instead of collecting them for extension_cb, memory use stays
+// constant and comments are not limited in length
+#define GIFMETADATA_FLAG_STREAM_PAYLOAD 0x4
+// count bytes per read state, blocks, sub-blocks, frames, scratchpad
+// reallocations and callbacks into gifmetadata_state.stats
+#define GIFMETADATA_FLAG_STATS 0x8
+// with GIFMETADATA_FLAG_STATS, also time each read state. the clock is read
+// at every state change so this costs more than the counters
+#define GIFMETADATA_FLAG_STATS_TIMING 0x10
+// decode the lzw image data of every frame, reporting pixel statistics to
+// decode_cb at the end of each frame. image data is read byte by byte rather
+// than hopped over even with GIFMETADATA_FLAG_SKIP. the decoder tables are
+// allocated with the first parse and kept by gifmetadata_state_reset
+#define GIFMETADATA_FLAG_DECODE 0x20
+
+// query fields, set on gifmetadata_state.query to stop parsing as soon as
+// they are known rather than at the end of the file
+
+// canvas width and height, known after the logical screen descriptor
+#define GIFMETADATA_QUERY_DIMENSIONS 0x1
+// the first gifmetadata_state.query_comments comments
+#define GIFMETADATA_QUERY_COMMENTS 0x2
+// the NETSCAPE2.0 loop count, see gifmetadata_state.loop_count
+#define GIFMETADATA_QUERY_LOOP_COUNT 0x4
+
+// read sizes used by gifmetadata_parse_fd, the window starts small so that
+// reads stop close to the next length byte and grows while reading payloads
+#define GIFMETADATA_FD_MIN_WINDOW 16
+#define GIFMETADATA_FD_MAX_WINDOW 4096
 
 enum gifmetadata_gif_version {
     gif87a = 1,
@@ -73,17 +138,150 @@ enum gifmetadata_read_state {
     eof
 };
 
+#define GIFMETADATA_READ_STATES (eof + 1)
+
+// a frame reported to frame_cb once its image descriptor has been read, with
+// the graphic control extension that came before it
+typedef struct gifmetadata_frame {
+    // frames before this one
+    size_t index;
+    // file offset of the image descriptor's introducer
+    size_t offset;
+    uint16_t left;
+    uint16_t top;
+    uint16_t width;
+    uint16_t height;
+    int interlaced;
+    // bytes in the local color table, zero without one
+    int local_color_table_len;
+    // a graphic control extension came before the frame, the fields below
+    // are zero without one
+    int has_control;
+    // hundredths of a second
+    uint16_t delay;
+    int disposal;
+    int user_input;
+    // -1 without a transparent color
+    int transparent_index;
+} gifmetadata_frame;
+
+// problems found by the lzw decoder
+// the image data ended before every pixel of the frame was decoded
+#define GIFMETADATA_DECODE_TRUNCATED 0x1
+// a code not yet in the table, or an invalid minimum code size
+#define GIFMETADATA_DECODE_CORRUPT 0x2
+// more pixels than the frame holds
+#define GIFMETADATA_DECODE_EXCESS 0x4
+
+// the lzw code table is bounded by the format's 12 bit codes
+#define GIFMETADATA_LZW_CODES 4096
+// adler-32 of decoded pixels, reduced at most every NMAX pixels so that the
+// 32 bit sums cannot overflow, as in zlib
+#define GIFMETADATA_ADLER_MOD 65521
+#define GIFMETADATA_ADLER_NMAX 5552
+
+// pixel statistics of a frame, see GIFMETADATA_FLAG_DECODE
+typedef struct gifmetadata_decode {
+    // frames before this one
+    size_t index;
+    // pixels decoded, and the width times height of the frame
+    size_t pixels;
+    size_t expected_pixels;
+    // adler-32 of the color indices in the order they were decoded
+    uint32_t checksum;
+    // GIFMETADATA_DECODE_* problems
+    unsigned int errors;
+    // pixels of each color index
+    uint32_t histogram[256];
+} gifmetadata_decode;
+
+// lzw decoder with fixed tables, fed the bytes of a frame's image data
+// sub-blocks. decoding stops at the end of information code or the first
+// corrupt code
+typedef struct gifmetadata_lzw {
+    // every code is a previous code followed by a color index
+    uint16_t prefix[GIFMETADATA_LZW_CODES];
+    uint16_t length[GIFMETADATA_LZW_CODES];
+    unsigned char suffix[GIFMETADATA_LZW_CODES];
+    unsigned char first[GIFMETADATA_LZW_CODES];
+    // a code's string is written backwards into here
+    unsigned char pixels[GIFMETADATA_LZW_CODES];
+
+    int min_code_size;
+    int code_size;
+    int next_code;
+    int prev_code;
+    // unread bits of the input, least significant first
+    uint32_t bits;
+    int bit_count;
+    // begun and not yet ended, and no longer taking codes
+    int active;
+    int done;
+    uint32_t adler_a;
+    uint32_t adler_b;
+    // pixels summed since the sums were last reduced
+    int adler_pending;
+
+    gifmetadata_decode result;
+} gifmetadata_lzw;
+
+// see GIFMETADATA_FLAG_STATS, cleared by gifmetadata_state_reset
+typedef struct gifmetadata_stats {
+    // bytes consumed in each read state, including those skipped over
+    size_t state_bytes[GIFMETADATA_READ_STATES];
+    // nanoseconds spent in each read state within parse calls
+    uint64_t state_ns[GIFMETADATA_READ_STATES];
+    size_t blocks;
+    size_t subblocks;
+    size_t frames;
+    size_t scratchpad_reallocs;
+    size_t extension_callbacks;
+    size_t state_callbacks;
+    size_t payload_callbacks;
+} gifmetadata_stats;
+
+// heap functions for a state, its scratchpad and its decoder, see
+// gifmetadata_state_new_with. the size of an allocation is passed back to
+// resize and release so that an allocator need not track it
+typedef struct gifmetadata_allocator {
+    void *(*alloc)(void *user, size_t size);
+    void *(*resize)(void *user, void *ptr, size_t old_size, size_t size);
+    void (*release)(void *user, void *ptr, size_t size);
+    void *user;
+} gifmetadata_allocator;
+
+// malloc, realloc and free, used by gifmetadata_state_new
+extern const gifmetadata_allocator gifmetadata_default_allocator;
+
 typedef struct gifmetadata_state {
     enum gifmetadata_read_state read_state;
 
+    // where the state and its buffers come from, must outlive the state.
+    // kept by gifmetadata_state_reset
+    const gifmetadata_allocator *allocator;
+
+    // GIFMETADATA_FLAG_* options
+    unsigned int flags;
+    // GIFMETADATA_QUERY_* fields wanted and, with GIFMETADATA_QUERY_COMMENTS,
+    // how many comments. kept by gifmetadata_state_reset like flags
+    unsigned int query;
+    int query_comments;
+    // queried fields found so far
+    unsigned int query_found;
+
     // externally managed buffers provided at each parse, do not
     // attempt to edit or free
     unsigned char *chunk;
     size_t chunk_len;
-    int chunk_i;
+    // index of the byte being parsed, chunks can be a whole mapped file
+    size_t chunk_i;
+
+    // number of bytes of the file consumed so far
+    size_t file_i;
 
-    // file_i
-    int file_i;
+    // bytes remaining in a run the parser has chosen to ignore, carried
+    // across chunks
+    size_t skip_len;
 
     int color_table_size;
     int color_table_len;
@@ -102,6 +300,26 @@ typedef struct gifmetadata_state {
     // comment data
     int scratchpad_len;
 
+    // with GIFMETADATA_FLAG_ZERO_COPY, index in the chunk at which the
+    // current extension payload begins, -1 when it is in the scratchpad
+    ssize_t payload_chunk_i;
+    // with GIFMETADATA_FLAG_STREAM_PAYLOAD, bytes of the current sub-block
+    // already delivered and index of the sub-block within the extension
+    int payload_flushed;
+    int payload_subblock;
+
+    // file offset of the first byte of the chunk
+    size_t chunk_file_i;
+    // file offset of the introducer of the current block
+    size_t block_file_i;
+
+    gifmetadata_stats stats;
+    // state that set up the current skip_len, skipped bytes are counted
+    // against it
+    enum gifmetadata_read_state skip_state;
+    // start of the current read state with GIFMETADATA_FLAG_STATS_TIMING
+    uint64_t stats_phase_ns;
+
     // local screen descriptor
     enum lsd_state local_lsd_state;
     enum extension_type local_extension_type;
@@ -113,6 +331,27 @@ typedef struct gifmetadata_state {
     uint16_t canvas_width;
     uint16_t canvas_height;
 
+    // comments reported so far
+    int comments;
+    // image descriptors read so far, and the frame being read with the graphic
+    // control extension for it
+    size_t frames;
+    gifmetadata_frame frame;
+
+    // with GIFMETADATA_FLAG_DECODE, allocated by the first parse, and the
+    // width times height of the frame being decoded
+    gifmetadata_lzw *lzw;
+    size_t frame_pixels;
+    // loop count of a NETSCAPE2.0 or ANIMEXTS1.0 application extension, zero
+    // looping forever, -1 until one is found
+    int loop_count;
+    // the current application extension is one of the above
+    int loop_extension;
+    // identifier of the current application extension and the first bytes
+    // of the sub-block after it, collected as they are read so that the loop
+    // count does not depend on where chunks end
+    unsigned char loop_bytes[GIFMETADATA_LOOP_ID_LEN + 3];
+
     enum gifmetadata_gif_version gif_version;
 } gifmetadata_state;
 
@@ -120,9 +359,105 @@ typedef struct gifmetadata_extension_info {
     enum extension_type type;
     unsigned char *buffer;
     size_t buffer_len;
+    // file offset of the extension's 0x21 introducer. comments are reported
+    // on their terminator, so a comment block spans block_offset up to the
+    // state's file_i
+    size_t block_offset;
 } gifmetadata_extension_info;
 
+enum gifmetadata_payload_event {
+    payload_begin,
+    payload_data,
+    payload_end
+};
+
+// streamed extension payload, see GIFMETADATA_FLAG_STREAM_PAYLOAD. an
+// extension is reported as begin, any number of data events each holding a
+// contiguous run of one sub-block, then end. only the header of a plain text
+// extension is delivered, its end comes after the text sub-blocks
+typedef struct gifmetadata_payload {
+    enum gifmetadata_payload_event event;
+    enum extension_type type;
+    // index of the sub-block within the extension, for applications zero is
+    // the identifier
+    int subblock;
+    // data events only, valid for the duration of the callback
+    unsigned char *buffer;
+    size_t buffer_len;
+    // file offset of the buffer, for begin and end events of the label byte
+    // and of the byte that ended the extension
+    size_t offset;
+} gifmetadata_payload;
+
+// version 2 callbacks, receiving the user context given with them. the
+// extension info is owned by the parser and only valid during the call, so
+// parsing makes no heap allocations for callbacks
+typedef struct gifmetadata_callbacks {
+    void (*extension_cb)(void *user, gifmetadata_state *s, const gifmetadata_extension_info *extension);
+    void (*state_cb)(void *user, gifmetadata_state *s, enum gifmetadata_read_state state);
+    void (*payload_cb)(void *user, gifmetadata_state *s, const gifmetadata_payload *payload);
+    // called at the packed byte of every image descriptor, before its local
+    // color table and image data. without it the position and size of frames
+    // are skipped over with GIFMETADATA_FLAG_SKIP
+    void (*frame_cb)(void *user, gifmetadata_state *s, const gifmetadata_frame *frame);
+    // called with GIFMETADATA_FLAG_DECODE once a frame's image data has
+    // ended, or by gifmetadata_parse_end for a frame cut off by the end of
+    // the file
+    void (*decode_cb)(void *user, gifmetadata_state *s, const gifmetadata_decode *decode);
+    void *user;
+} gifmetadata_callbacks;
+
 // Implementation can be found in gif.c
+int gifmetadata_parse_gif_v2(
+    gifmetadata_state *s,
+    unsigned char *chunk,
+    size_t chunk_len,
+    const gifmetadata_callbacks *cb);
+
+// Saves a parser state between calls to gifmetadata_parse_gif_v2, so that
+// the parse can be resumed from file_i by another process, possibly on
+// another machine. Returns the length of the serialized state, which is only
+// written when it fits in buffer_len. The state of callbacks' user data is
+// not included. Implementation can be found in gifstate.c
+size_t gifmetadata_state_serialize(const gifmetadata_state *s, unsigned char *buffer, size_t buffer_len);
+
+// Replaces s with a serialized state, including its flags and query. The
+// next chunk given to gifmetadata_parse_gif_v2 must start at file_i. Returns
+// GIFMETADATA_INVALID_STATE, leaving s reset, for a state from another
+// version or one that fails its checksum
+int gifmetadata_state_deserialize(gifmetadata_state *s, const unsigned char *buffer, size_t buffer_len);
+
+// Ends a parse at the end of the file, reporting a frame still being decoded
+// to decode_cb as truncated. gifmetadata_parse_fd_v2 and
+// gifmetadata_parse_mmap_v2 call it themselves, implementation can be found in
+// gif.c
+void gifmetadata_parse_end(gifmetadata_state *s, const gifmetadata_callbacks *cb);
+
+// The decoder behind GIFMETADATA_FLAG_DECODE, usable on its own with the
+// sub-blocks from gifmetadata_next_subblock. begin takes the lzw minimum
+// code size byte, index and expected_pixels only fill in the result.
+// Implementation can be found in giflzw.c
+void gifmetadata_lzw_begin(gifmetadata_lzw *lzw, int min_code_size, size_t index, size_t expected_pixels);
+void gifmetadata_lzw_feed(gifmetadata_lzw *lzw, const unsigned char *data, size_t len);
+// Completes lzw->result
+void gifmetadata_lzw_end(gifmetadata_lzw *lzw);
+
+// Hops a chain of data sub-blocks in memory starting at the size byte at
+// index i. Returns the index of the zero terminator, or buffer_len when the
+// chain runs off the end with *rest set to the bytes of the last sub-block
+// beyond it and *last_len to that sub-block's size. The number of sub-blocks
+// entered is added to *hops. Used by
+// GIFMETADATA_FLAG_SKIP for image data, implementation can be found in gif.c
+size_t gifmetadata_walk_subblocks(
+    const unsigned char *buffer,
+    size_t buffer_len,
+    size_t i,
+    size_t *rest,
+    unsigned char *last_len,
+    size_t *hops);
+
+// Version 1 of the parse functions, extension_cb receives a heap copy of the
+// extension info that it must free. Implementation can be found in gif.c
 int gifmetadata_parse_gif(
     gifmetadata_state *s,
     unsigned char *chunk,
@@ -130,13 +465,158 @@ int gifmetadata_parse_gif(
     void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
     void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state));
 
-// TODO 'int bytes_to_read' is used as the function that the loop depends
-// on for byte chunks. this will be moved to the function arguments
+int gifmetadata_parse_fd(
+    gifmetadata_state *s,
+    int fd,
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state));
+int gifmetadata_parse_mmap(
+    gifmetadata_state *s,
+    int fd,
+    void (*extension_cb)(gifmetadata_state*, gifmetadata_extension_info*),
+    void (*state_cb)(gifmetadata_state*, enum gifmetadata_read_state));
 
-// struct extension_info *extension_cb_info;
-// TODO callback will be moved to the function arguments.
+// Parses a seekable file descriptor with pread, reading only the header,
+// descriptors, extensions and length bytes and seeking past color tables and
+// image data. Enables GIFMETADATA_FLAG_SKIP and stops at the trailer.
+// Implementation can be found in gifio.c
+int gifmetadata_parse_fd_v2(
+    gifmetadata_state *s,
+    int fd,
+    const gifmetadata_callbacks *cb);
+
+// The reads gifmetadata_parse_fd_v2 makes, for callers making them
+// themselves, e.g. with many files read at once. window bytes are wanted
+// from offset next, fewer are only given at the end of the file
+typedef struct gifmetadata_fd_reader {
+    uint64_t offset;
+    size_t window;
+} gifmetadata_fd_reader;
+
+// Starts reading a file from its first byte, enabling GIFMETADATA_FLAG_SKIP.
+// Implementation can be found in gifio.c
+void gifmetadata_fd_reader_init(gifmetadata_state *s, gifmetadata_fd_reader *r);
+// Parses the b bytes read from r->offset and moves r on to the next read.
+// Returns GIFMETADATA_END once the trailer or the end of the file is
+// reached, having called gifmetadata_parse_end, otherwise a parse status
+int gifmetadata_fd_reader_feed(
+    gifmetadata_state *s,
+    gifmetadata_fd_reader *r,
+    unsigned char *buf,
+    size_t b,
+    const gifmetadata_callbacks *cb);
+
+// Maps a whole file read-only and parses it as a single chunk, enabling
+// GIFMETADATA_FLAG_ZERO_COPY so extension payloads point into the mapping.
+// Implementation can be found in gifio.c
+int gifmetadata_parse_mmap_v2(
+    gifmetadata_state *s,
+    int fd,
+    const gifmetadata_callbacks *cb);
+
+// pull iterator
+
+enum gifmetadata_block_type {
+    block_header,
+    block_logical_screen_descriptor,
+    block_global_color_table,
+    block_control_extension,
+    block_image_descriptor,
+    block_local_color_table,
+    block_image_data,
+    block_plain_text,
+    block_application,
+    block_comment,
+    // any other extension, see label
+    block_extension,
+    block_trailer
+};
+
+// a block yielded by gifmetadata_next_block, data points into the buffer
+typedef struct gifmetadata_block {
+    enum gifmetadata_block_type type;
+    // extension label, e.g. 0xfe for comments, zero for other blocks
+    unsigned char label;
+    // buffer offset of the first byte of the block and its length up to and
+    // including any sub-block terminator
+    size_t offset;
+    size_t len;
+    // the fields of the block after its introducer and label. for extensions
+    // the first sub-block, for image data the lzw minimum code size.
+    // comments run to their terminator as with extension_cb, since some
+    // encoders wrote comments longer than their sub-block size
+    const unsigned char *data;
+    size_t data_len;
+    // buffer offset of the size byte of the sub-blocks following data, zero
+    // when there are none. see gifmetadata_next_subblock
+    size_t subblocks;
+} gifmetadata_block;
+
+// iterates over a whole gif in memory, e.g. a mapping. a block is only
+// yielded once all of it lies within the buffer
+typedef struct gifmetadata_iter {
+    const unsigned char *buffer;
+    size_t buffer_len;
+    // offset of the next block
+    size_t i;
+    // kind of block expected next, header, logical_screen_descriptor,
+    // global_color_table, local_color_table, image_data or searching, then
+    // trailer or eof once iteration has ended
+    enum gifmetadata_read_state read_state;
+    size_t color_table_len;
+
+    // set once the header and logical screen descriptor have been yielded
+    enum gifmetadata_gif_version gif_version;
+    uint16_t canvas_width;
+    uint16_t canvas_height;
+} gifmetadata_iter;
+
+// Implementation can be found in gifiter.c
+void gifmetadata_iter_init(gifmetadata_iter *it, const unsigned char *buffer, size_t buffer_len);
+// Fills block with the next block, returning GIFMETADATA_SUCCESS. Returns
+// GIFMETADATA_END after the trailer or at the end of the buffer between
+// blocks, GIFMETADATA_INVALID_SIG for a buffer that is not a gif and
+// GIFMETADATA_TRUNCATED for a block cut off by the end of the buffer. Color
+// tables and image data are stepped over in one go, as with
+// GIFMETADATA_FLAG_SKIP, and unknown bytes between blocks are passed over
+int gifmetadata_next_block(gifmetadata_iter *it, gifmetadata_block *block);
+// Steps through the sub-blocks of a block, *cursor starting at its
+// subblocks offset. Returns 1 with *data and *data_len set to each sub-block,
+// then 0 at the terminator
+int gifmetadata_next_subblock(const gifmetadata_iter *it, size_t *cursor, const unsigned char **data, size_t *data_len);
 
 gifmetadata_state *gifmetadata_state_new();
+// Creates a state whose memory comes from allocator, NULL on failure
+gifmetadata_state *gifmetadata_state_new_with(const gifmetadata_allocator *allocator);
+// Returns a state to how gifmetadata_state_new left it so it can parse
+// another file, keeping its flags and scratchpad allocation
+void gifmetadata_state_reset(gifmetadata_state *state);
 void gifmetadata_state_free(gifmetadata_state *state);
 
+// states kept for reuse, so that a program parsing one file after another
+// makes no heap allocations once its states have grown their scratchpads
+// and decoders. a pool is not thread safe, keep one per thread
+typedef struct gifmetadata_pool {
+    const gifmetadata_allocator *allocator;
+    // states released and waiting to be acquired again
+    gifmetadata_state **states;
+    size_t len;
+    size_t max_states;
+} gifmetadata_pool;
+
+// Creates a pool keeping up to max_states released states, its memory and
+// that of its states comes from allocator. NULL on failure. Implementation
+// can be found in gifpool.c
+gifmetadata_pool *gifmetadata_pool_new(const gifmetadata_allocator *allocator, size_t max_states);
+// Frees the pool and the states kept in it, states acquired and never
+// released are freed with gifmetadata_state_free
+void gifmetadata_pool_free(gifmetadata_pool *pool);
+// Returns a kept state, or a new one when there are none, reset and with no
+// flags or query as if from gifmetadata_state_new. NULL on failure
+gifmetadata_state *gifmetadata_pool_acquire(gifmetadata_pool *pool);
+// Hands a state back for reuse, freeing it when the pool is full
+void gifmetadata_pool_release(gifmetadata_pool *pool, gifmetadata_state *state);
+// Name of a read state for diagnostics, e.g. "image_data"
+const char *gifmetadata_read_state_name(enum gifmetadata_read_state state);
+
 #endif
@@ -0,0 +1,428 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "gifout.h"
+
+const char *gifout_extension_names[] = { "plain_text", "application", "application_subblock", "comment" };
+
+int gifout_format(const char *name) {
+    if (strcmp(name, "text") == 0)
+        return GIFOUT_TEXT;
+    if (strcmp(name, "json") == 0)
+        return GIFOUT_JSON;
+    if (strcmp(name, "blocks") == 0)
+        return GIFOUT_BLOCKS;
+    if (strcmp(name, "binary") == 0)
+        return GIFOUT_BINARY;
+    return -1;
+}
+
+void gifout_init(gifout *o, int format) {
+    memset(o, 0, sizeof(gifout));
+    o->format = format;
+}
+
+void gifout_free(gifout *o) {
+    free(o->data);
+    o->data = NULL;
+    o->len = o->size = 0;
+}
+
+// makes room for n more bytes, returns NULL once an allocation has failed
+unsigned char *out_reserve(gifout *o, size_t n) {
+    if (o->failed)
+        return NULL;
+    if (o->size - o->len < n) {
+        size_t size = o->size > 0 ? o->size : 4096;
+        while (size - o->len < n)
+            size *= 2;
+        unsigned char *data = realloc(o->data, size);
+        if (data == NULL) {
+            o->failed = 1;
+            return NULL;
+        }
+        o->data = data;
+        o->size = size;
+    }
+    return o->data + o->len;
+}
+
+void out_put(gifout *o, const void *data, size_t n) {
+    // data may be NULL when empty, e.g. the path of stdin
+    if (n == 0)
+        return;
+    unsigned char *p = out_reserve(o, n);
+    if (p == NULL)
+        return;
+    memcpy(p, data, n);
+    o->len += n;
+}
+
+void out_put_str(gifout *o, const char *str) {
+    out_put(o, str, strlen(str));
+}
+
+void out_put_le(gifout *o, uint64_t v, int bytes) {
+    unsigned char *p = out_reserve(o, bytes);
+    if (p == NULL)
+        return;
+    for (int i = 0; i < bytes; i++)
+        p[i] = v >> (i * 8);
+    o->len += bytes;
+}
+
+void out_put_uint(gifout *o, uint64_t v) {
+    char digits[20];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    out_put(o, digits + i, sizeof(digits) - i);
+}
+
+void out_put_bool(gifout *o, int v) {
+    out_put_str(o, v ? "true" : "false");
+}
+
+// length of the valid utf-8 sequence starting at data, zero when it is not
+// one
+size_t utf8_sequence_len(const unsigned char *data, size_t len) {
+    unsigned char c = data[0];
+    size_t n;
+    unsigned char min = 0x80, max = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        // overlong encodings and surrogates
+        if (c == 0xe0)
+            min = 0xa0;
+        else if (c == 0xed)
+            max = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        if (c == 0xf0)
+            min = 0x90;
+        else if (c == 0xf4)
+            max = 0x8f;
+    } else {
+        return 0;
+    }
+    if (n > len || data[1] < min || data[1] > max)
+        return 0;
+    for (size_t i = 2; i < n; i++) {
+        if ((data[i] & 0xc0) != 0x80)
+            return 0;
+    }
+    return n;
+}
+
+// writes data as a json string. bytes that are not utf-8, e.g. latin-1
+// comments, are written as the code points of the same value
+void out_put_json_string(gifout *o, const unsigned char *data, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    out_put(o, "\"", 1);
+    size_t i = 0;
+    while (i < len) {
+        // runs that need no escaping are copied whole
+        size_t run = i;
+        while (run < len && data[run] >= 0x20 && data[run] < 0x80 && data[run] != '"' && data[run] != '\\')
+            run++;
+        out_put(o, data + i, run - i);
+        if (run == len)
+            break;
+        i = run;
+
+        unsigned char c = data[i];
+        size_t n = c >= 0x80 ? utf8_sequence_len(data + i, len - i) : 0;
+        if (n > 0) {
+            out_put(o, data + i, n);
+            i += n;
+            continue;
+        }
+        char escape[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+        switch (c) {
+        case '"':
+        case '\\':
+            escape[1] = c;
+            out_put(o, escape, 2);
+            break;
+        case '\n':
+            out_put(o, "\\n", 2);
+            break;
+        case '\t':
+            out_put(o, "\\t", 2);
+            break;
+        default:
+            out_put(o, escape, 6);
+        }
+        i++;
+    }
+    out_put(o, "\"", 1);
+}
+
+// starts a binary record, returns where its length is filled in by
+// out_end_record
+size_t out_begin_record(gifout *o, int type) {
+    size_t start = o->len;
+    out_put_le(o, 0, 4);
+    out_put_le(o, type, 1);
+    return start;
+}
+
+void out_end_record(gifout *o, size_t start) {
+    if (o->failed)
+        return;
+    size_t len = o->len - start - 4;
+    for (int i = 0; i < 4; i++)
+        o->data[start + i] = len >> (i * 8);
+}
+
+// starts a block, in json within the file's line and with blocks on a line
+// of its own
+void out_begin_entry(gifout *o, const char *type) {
+    if (o->format == GIFOUT_JSON) {
+        if (o->entries++ > 0)
+            out_put(o, ",", 1);
+        out_put_str(o, "{\"type\":\"");
+    } else {
+        out_put_str(o, "{\"path\":");
+        if (o->path != NULL)
+            out_put_json_string(o, (const unsigned char *)o->path, strlen(o->path));
+        else
+            out_put_str(o, "null");
+        out_put_str(o, ",\"type\":\"");
+    }
+    out_put_str(o, type);
+    out_put(o, "\"", 1);
+}
+
+void out_end_entry(gifout *o) {
+    if (o->format == GIFOUT_JSON)
+        out_put(o, "}", 1);
+    else
+        out_put(o, "}\n", 2);
+}
+
+void out_put_field(gifout *o, const char *name, uint64_t v) {
+    out_put(o, ",\"", 2);
+    out_put_str(o, name);
+    out_put(o, "\":", 2);
+    out_put_uint(o, v);
+}
+
+void out_put_bool_field(gifout *o, const char *name, int v) {
+    out_put(o, ",\"", 2);
+    out_put_str(o, name);
+    out_put(o, "\":", 2);
+    out_put_bool(o, v);
+}
+
+int gifout_write_header(int format, FILE *f) {
+    if (format != GIFOUT_BINARY)
+        return GIFOUT_SUCCESS;
+    unsigned char header[12];
+    memcpy(header, GIFOUT_MAGIC, 8);
+    for (int i = 0; i < 4; i++)
+        header[8 + i] = GIFOUT_VERSION >> (i * 8);
+    return fwrite(header, 1, sizeof(header), f) == sizeof(header) ? GIFOUT_SUCCESS : GIFOUT_IO_ERROR;
+}
+
+void gifout_begin_file(gifout *o, const char *path) {
+    o->path = path;
+    o->entries = 0;
+    if (o->format != GIFOUT_JSON)
+        return;
+    out_put_str(o, "{\"path\":");
+    if (path != NULL)
+        out_put_json_string(o, (const unsigned char *)path, strlen(path));
+    else
+        out_put_str(o, "null");
+    out_put_str(o, ",\"blocks\":[");
+}
+
+void gifout_extension(gifout *o, const gifmetadata_extension_info *extension) {
+    // like the text output, data is shown up to the first NUL and the data
+    // of application sub-blocks only by its length
+    size_t data_len = 0;
+    if (extension->type != application_subblock)
+        data_len = strnlen((char *)extension->buffer, extension->buffer_len);
+
+    if (o->format == GIFOUT_BINARY) {
+        size_t start = out_begin_record(o, GIFOUT_RECORD_EXTENSION);
+        out_put_le(o, extension->block_offset, 8);
+        out_put_le(o, extension->type, 1);
+        out_put_le(o, extension->buffer_len, 4);
+        out_put(o, extension->buffer, data_len);
+        out_end_record(o, start);
+        return;
+    }
+
+    out_begin_entry(o, gifout_extension_names[extension->type]);
+    out_put_field(o, "offset", extension->block_offset);
+    out_put_field(o, "length", extension->buffer_len);
+    if (extension->type != application_subblock) {
+        out_put_str(o, ",\"data\":");
+        out_put_json_string(o, extension->buffer, data_len);
+    }
+    out_end_entry(o);
+}
+
+void gifout_frame(gifout *o, const gifmetadata_frame *frame) {
+    if (o->format == GIFOUT_BINARY) {
+        int flags = 0;
+        if (frame->interlaced)
+            flags |= GIFOUT_FRAME_INTERLACED;
+        if (frame->local_color_table_len > 0)
+            flags |= GIFOUT_FRAME_LOCAL_COLOR_TABLE;
+        if (frame->transparent_index >= 0)
+            flags |= GIFOUT_FRAME_TRANSPARENT;
+        size_t start = out_begin_record(o, GIFOUT_RECORD_FRAME);
+        out_put_le(o, frame->offset, 8);
+        out_put_le(o, frame->index, 4);
+        out_put_le(o, frame->left, 2);
+        out_put_le(o, frame->top, 2);
+        out_put_le(o, frame->width, 2);
+        out_put_le(o, frame->height, 2);
+        out_put_le(o, frame->delay, 2);
+        out_put_le(o, frame->disposal, 1);
+        out_put_le(o, flags, 1);
+        out_put_le(o, frame->transparent_index >= 0 ? frame->transparent_index : 0, 1);
+        out_end_record(o, start);
+        return;
+    }
+
+    out_begin_entry(o, "frame");
+    out_put_field(o, "offset", frame->offset);
+    out_put_field(o, "index", frame->index);
+    out_put_field(o, "left", frame->left);
+    out_put_field(o, "top", frame->top);
+    out_put_field(o, "width", frame->width);
+    out_put_field(o, "height", frame->height);
+    out_put_field(o, "delay_ms", frame->delay * 10);
+    out_put_field(o, "disposal", frame->disposal);
+    if (frame->transparent_index >= 0)
+        out_put_field(o, "transparent", frame->transparent_index);
+    else
+        out_put_str(o, ",\"transparent\":null");
+    out_put_bool_field(o, "interlaced", frame->interlaced);
+    out_put_bool_field(o, "local_color_table", frame->local_color_table_len > 0);
+    out_end_entry(o);
+}
+
+void gifout_pixels(gifout *o, const gifmetadata_decode *decode) {
+    int colors = 0;
+    for (int i = 0; i < 256; i++)
+        colors += decode->histogram[i] > 0;
+
+    if (o->format == GIFOUT_BINARY) {
+        size_t start = out_begin_record(o, GIFOUT_RECORD_PIXELS);
+        out_put_le(o, decode->index, 4);
+        out_put_le(o, decode->pixels, 8);
+        out_put_le(o, decode->expected_pixels, 8);
+        out_put_le(o, decode->checksum, 4);
+        out_put_le(o, colors, 2);
+        out_put_le(o, decode->errors, 1);
+        out_end_record(o, start);
+        return;
+    }
+
+    out_begin_entry(o, "pixels");
+    out_put_field(o, "index", decode->index);
+    out_put_field(o, "pixels", decode->pixels);
+    out_put_field(o, "expected", decode->expected_pixels);
+    out_put_field(o, "checksum", decode->checksum);
+    out_put_field(o, "colors", colors);
+    out_put_bool_field(o, "truncated", decode->errors & GIFMETADATA_DECODE_TRUNCATED);
+    out_put_bool_field(o, "corrupt", decode->errors & GIFMETADATA_DECODE_CORRUPT);
+    out_put_bool_field(o, "excess", decode->errors & GIFMETADATA_DECODE_EXCESS);
+    out_end_entry(o);
+}
+
+void gifout_end_file(gifout *o, const gifout_file *file) {
+    int version = file->gif_version == gif87a ? 87 : file->gif_version == gif89a ? 89 : 0;
+    // the canvas is unknown without a header, rather than the state's -1
+    uint16_t width = version > 0 ? file->canvas_width : 0;
+    uint16_t height = version > 0 ? file->canvas_height : 0;
+
+    if (o->format == GIFOUT_BINARY) {
+        size_t path_len = o->path != NULL ? strlen(o->path) : 0;
+        size_t start = out_begin_record(o, GIFOUT_RECORD_FILE);
+        out_put_le(o, file->size, 8);
+        out_put_le(o, width, 2);
+        out_put_le(o, height, 2);
+        out_put_le(o, version, 1);
+        out_put_le(o, file->complete, 1);
+        out_put_le(o, (uint32_t)file->loop_count, 4);
+        out_put_le(o, file->frames, 4);
+        out_put_le(o, file->duration, 8);
+        out_put_le(o, path_len, 4);
+        out_put(o, o->path, path_len);
+        if (file->error != NULL)
+            out_put_str(o, file->error);
+        out_end_record(o, start);
+        o->path = NULL;
+        return;
+    }
+
+    if (o->format == GIFOUT_JSON) {
+        out_put(o, "]", 1);
+    } else {
+        out_begin_entry(o, "file");
+    }
+    if (version > 0) {
+        out_put_str(o, version == 87 ? ",\"version\":\"87a\"" : ",\"version\":\"89a\"");
+    } else {
+        out_put_str(o, ",\"version\":null");
+    }
+    out_put_field(o, "size", file->size);
+    if (version > 0) {
+        out_put_field(o, "width", width);
+        out_put_field(o, "height", height);
+    } else {
+        out_put_str(o, ",\"width\":null,\"height\":null");
+    }
+    out_put_bool_field(o, "complete", file->complete);
+    if (file->loop_count >= 0)
+        out_put_field(o, "loop_count", file->loop_count);
+    else
+        out_put_str(o, ",\"loop_count\":null");
+    out_put_field(o, "frames", file->frames);
+    out_put_field(o, "duration_ms", file->duration * 10);
+    if (file->error != NULL) {
+        out_put_str(o, ",\"error\":");
+        out_put_json_string(o, (const unsigned char *)file->error, strlen(file->error));
+    }
+    if (o->format == GIFOUT_JSON)
+        out_put(o, "}\n", 2);
+    else
+        out_end_entry(o);
+    o->path = NULL;
+}
+
+int gifout_flush(gifout *o, FILE *f) {
+    int failed = o->failed;
+    size_t written = o->len > 0 ? fwrite(o->data, 1, o->len, f) : 0;
+    size_t len = o->len;
+    o->len = 0;
+    o->failed = 0;
+    if (failed)
+        return GIFOUT_ALLOC_FAILURE;
+    return written == len ? GIFOUT_SUCCESS : GIFOUT_IO_ERROR;
+}
@@ -0,0 +1,128 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_OUT_H
+#define GIFMETADATA_OUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gifmetadata.h"
+
+// structured output for loading scan results into other programs. records
+// are built in a buffer and written out in large runs, rather than with a
+// call into stdio for every field
+//
+// json writes a line per file, its blocks in order in a "blocks" array.
+// blocks writes a line per block, each with the path of its file, then a
+// line of type "file" ending the file. binary writes the same records as
+// blocks, starting with GIFOUT_MAGIC and its version as a little endian
+// uint32. every record is a little endian uint32 length of the rest of the
+// record, a type byte and then its fields, all little endian:
+//
+// GIFOUT_RECORD_EXTENSION  uint64 offset, uint8 extension_type, uint32
+//                          length, then the data up to the first NUL,
+//                          none for application sub-blocks
+// GIFOUT_RECORD_FRAME      uint64 offset, uint32 index, uint16 left, top,
+//                          width, height and delay in hundredths of a
+//                          second, uint8 disposal, uint8 GIFOUT_FRAME_*
+//                          flags, uint8 transparent index
+// GIFOUT_RECORD_PIXELS     uint32 frame index, uint64 pixels, uint64
+//                          expected pixels, uint32 checksum, uint16 colors,
+//                          uint8 GIFMETADATA_DECODE_* errors
+// GIFOUT_RECORD_FILE       uint64 size, uint16 width, uint16 height (zero
+//                          without a version), uint8 version (87, 89 or
+//                          zero), uint8 complete, int32
+//                          loop count, uint32 frames, uint64 duration in
+//                          hundredths of a second, uint32 path length, the
+//                          path, then the error message for the rest
+//
+// the records of a file's blocks come before the file record ending it
+
+#define GIFOUT_SUCCESS 0
+#define GIFOUT_IO_ERROR -1
+#define GIFOUT_ALLOC_FAILURE -2
+
+#define GIFOUT_TEXT 0
+#define GIFOUT_JSON 1
+#define GIFOUT_BLOCKS 2
+#define GIFOUT_BINARY 3
+
+#define GIFOUT_MAGIC "gifrecs"
+#define GIFOUT_VERSION 1
+
+#define GIFOUT_RECORD_FILE 1
+#define GIFOUT_RECORD_EXTENSION 2
+#define GIFOUT_RECORD_FRAME 3
+#define GIFOUT_RECORD_PIXELS 4
+
+#define GIFOUT_FRAME_INTERLACED 1
+#define GIFOUT_FRAME_LOCAL_COLOR_TABLE 2
+#define GIFOUT_FRAME_TRANSPARENT 4
+
+// records are held until the buffer reaches this size
+#define GIFOUT_FLUSH_SIZE (1 << 20)
+
+typedef struct gifout {
+    int format;
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    // an allocation failed, records since the last flush are lost
+    int failed;
+    // file whose records are being written, NULL for stdin
+    const char *path;
+    // blocks written to the current json line
+    size_t entries;
+} gifout;
+
+// totals of a file for the record ending it
+typedef struct gifout_file {
+    uint64_t size;
+    enum gifmetadata_gif_version gif_version;
+    uint16_t canvas_width;
+    uint16_t canvas_height;
+    int complete;
+    int loop_count;
+    size_t frames;
+    // hundredths of a second
+    uint64_t duration;
+    // why the file could not be read, NULL when it was
+    const char *error;
+} gifout_file;
+
+// Returns the GIFOUT_* format named text, json, blocks or binary, -1 for
+// any other name
+int gifout_format(const char *name);
+
+void gifout_init(gifout *o, int format);
+void gifout_free(gifout *o);
+
+// Writes what a stream of the format starts with to f, returns a status
+int gifout_write_header(int format, FILE *f);
+
+// Starts the records of a file, path is kept until gifout_end_file
+void gifout_begin_file(gifout *o, const char *path);
+void gifout_extension(gifout *o, const gifmetadata_extension_info *extension);
+void gifout_frame(gifout *o, const gifmetadata_frame *frame);
+void gifout_pixels(gifout *o, const gifmetadata_decode *decode);
+void gifout_end_file(gifout *o, const gifout_file *file);
+
+// Writes the buffered records to f and empties the buffer, returns a status
+int gifout_flush(gifout *o, FILE *f);
+
+#endif
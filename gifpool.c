@@ -0,0 +1,76 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// reuse of parser states between files. a released state keeps its
+// scratchpad and decoder at the size its largest file needed, so a pool that
+// has seen a few files hands out states that never have to grow again
+
+#include <string.h>
+
+#include "gifmetadata.h"
+
+gifmetadata_pool *gifmetadata_pool_new(const gifmetadata_allocator *allocator, size_t max_states) {
+    gifmetadata_pool *pool = allocator->alloc(allocator->user, sizeof(gifmetadata_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->allocator = allocator;
+    pool->len = 0;
+    pool->max_states = max_states;
+    pool->states = NULL;
+    // the slots are made up front, releasing a state never allocates
+    if (max_states > 0) {
+        pool->states = allocator->alloc(allocator->user, sizeof(gifmetadata_state *) * max_states);
+        if (pool->states == NULL) {
+            allocator->release(allocator->user, pool, sizeof(gifmetadata_pool));
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void gifmetadata_pool_free(gifmetadata_pool *pool) {
+    if (pool == NULL)
+        return;
+    const gifmetadata_allocator *a = pool->allocator;
+    for (size_t i = 0; i < pool->len; i++)
+        gifmetadata_state_free(pool->states[i]);
+    if (pool->states != NULL)
+        a->release(a->user, pool->states, sizeof(gifmetadata_state *) * pool->max_states);
+    a->release(a->user, pool, sizeof(gifmetadata_pool));
+}
+
+gifmetadata_state *gifmetadata_pool_acquire(gifmetadata_pool *pool) {
+    if (pool->len == 0)
+        return gifmetadata_state_new_with(pool->allocator);
+
+    // the most recently released state is the likeliest to be in cache
+    gifmetadata_state *state = pool->states[--pool->len];
+    state->flags = 0;
+    state->query = 0;
+    state->query_comments = 0;
+    gifmetadata_state_reset(state);
+    return state;
+}
+
+void gifmetadata_pool_release(gifmetadata_pool *pool, gifmetadata_state *state) {
+    if (state == NULL)
+        return;
+    if (pool->len == pool->max_states || state->allocator != pool->allocator) {
+        gifmetadata_state_free(state);
+        return;
+    }
+    pool->states[pool->len++] = state;
+}
@@ -0,0 +1,283 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "gifserver.h"
+
+gifserver *gifserver_listen(const char *path, int *status) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        *status = GIFSERVER_IO_ERROR;
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        *status = GIFSERVER_IO_ERROR;
+        return NULL;
+    }
+    // a socket nobody answers on was left by a server that stopped
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(fd);
+            *status = GIFSERVER_IN_USE;
+            return NULL;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        *status = GIFSERVER_IO_ERROR;
+        return NULL;
+    }
+
+    gifserver *server = calloc(1, sizeof(gifserver));
+    if (server == NULL) {
+        close(fd);
+        *status = GIFSERVER_ALLOC_FAILURE;
+        return NULL;
+    }
+    server->fd = fd;
+    *status = GIFSERVER_SUCCESS;
+    return server;
+}
+
+void gifserver_free(gifserver *server) {
+    if (server == NULL)
+        return;
+    close(server->fd);
+    free(server);
+}
+
+// requests of a connection read ahead of the one being answered
+typedef struct server_conn {
+    int fd;
+    FILE *out;
+    unsigned char buf[GIFSERVER_READ_SIZE];
+    size_t start;
+    size_t end;
+} server_conn;
+
+// reads more of the connection, first sending the replies so far since the
+// client may be waiting for them. returns zero at the end of the connection
+int conn_fill(server_conn *c) {
+    if (fflush(c->out) != 0)
+        return 0;
+    if (c->start > 0) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    if (c->end == sizeof(c->buf))
+        return 0;
+    ssize_t b;
+    do {
+        b = read(c->fd, c->buf + c->end, sizeof(c->buf) - c->end);
+    } while (b < 0 && errno == EINTR);
+    if (b <= 0)
+        return 0;
+    c->end += b;
+    return 1;
+}
+
+// returns the next line without its newline, NUL terminated in place, or
+// NULL at the end of the connection. a line that does not fit in the read
+// buffer is skipped and returned empty with *too_long set
+char *conn_line(server_conn *c, int *too_long) {
+    *too_long = 0;
+    size_t scanned = 0;
+    for (;;) {
+        unsigned char *nl = memchr(c->buf + c->start + scanned, '\n', c->end - c->start - scanned);
+        if (nl != NULL) {
+            char *line = (char *)c->buf + c->start;
+            *nl = '\0';
+            if (nl > c->buf + c->start && nl[-1] == '\r')
+                nl[-1] = '\0';
+            if (*too_long)
+                *line = '\0';
+            c->start = nl - c->buf + 1;
+            return line;
+        }
+        if (c->start == 0 && c->end == sizeof(c->buf)) {
+            *too_long = 1;
+            c->end = 0;
+        }
+        scanned = c->end - c->start;
+        if (!conn_fill(c))
+            return NULL;
+    }
+}
+
+// reads len bytes into the worker's data buffer, returns zero when the
+// connection ends first
+int conn_data(server_conn *c, gifserver_worker *w, size_t len) {
+    if (len > w->data_size) {
+        unsigned char *data = realloc(w->data, len);
+        if (data == NULL)
+            return 0;
+        w->data = data;
+        w->data_size = len;
+    }
+    size_t have = c->end - c->start;
+    if (have > len)
+        have = len;
+    if (have > 0)
+        memcpy(w->data, c->buf + c->start, have);
+    c->start += have;
+
+    if (have < len && fflush(c->out) != 0)
+        return 0;
+    while (have < len) {
+        ssize_t b = read(c->fd, w->data + have, len - have);
+        if (b < 0 && errno == EINTR)
+            continue;
+        if (b <= 0)
+            return 0;
+        have += b;
+    }
+    return 1;
+}
+
+void serve_conn(gifserver_worker *w, server_conn *c) {
+    const gifserver_handler *handler = w->server->handler;
+    if (handler->open != NULL)
+        handler->open(w->user, c->out);
+
+    for (;;) {
+        int too_long;
+        char *line = conn_line(c, &too_long);
+        gifserver_request request;
+        memset(&request, 0, sizeof(request));
+        int last = 0;
+
+        if (line == NULL) {
+            break;
+        } else if (too_long) {
+            request.type = GIFSERVER_REQUEST_INVALID;
+            request.error = "Request line too long";
+        } else if (strncmp(line, "PATH ", 5) == 0) {
+            request.type = GIFSERVER_REQUEST_PATH;
+            request.path = line + 5;
+        } else if (strncmp(line, "DATA ", 5) == 0) {
+            char *end;
+            errno = 0;
+            unsigned long long len = strtoull(line + 5, &end, 10);
+            if (end == line + 5 || *end != '\0' || errno != 0 || len > GIFSERVER_MAX_DATA) {
+                // the bytes that follow cannot be told from requests
+                request.type = GIFSERVER_REQUEST_INVALID;
+                request.error = "Invalid data length";
+                last = 1;
+            } else if (!conn_data(c, w, len)) {
+                break;
+            } else {
+                request.type = GIFSERVER_REQUEST_DATA;
+                request.data = w->data;
+                request.data_len = len;
+            }
+        } else {
+            request.type = GIFSERVER_REQUEST_INVALID;
+            request.error = "Unknown request";
+        }
+
+        handler->request(w->user, &request, c->out);
+        if (last || ferror(c->out))
+            break;
+    }
+}
+
+void *server_worker_run(void *arg) {
+    gifserver_worker *w = arg;
+    server_conn *c = malloc(sizeof(server_conn));
+    char *out_buf = malloc(GIFSERVER_WRITE_SIZE);
+    if (c == NULL || out_buf == NULL) {
+        free(c);
+        free(out_buf);
+        return NULL;
+    }
+
+    for (;;) {
+        int fd = accept(w->server->fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // wait for other connections to close
+                usleep(10000);
+                continue;
+            }
+            break;
+        }
+
+        // replies go through stdio on a duplicate that fclose closes
+        int out_fd = dup(fd);
+        c->out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+        if (c->out == NULL) {
+            if (out_fd >= 0)
+                close(out_fd);
+            close(fd);
+            continue;
+        }
+        setvbuf(c->out, out_buf, _IOFBF, GIFSERVER_WRITE_SIZE);
+        c->fd = fd;
+        c->start = c->end = 0;
+        serve_conn(w, c);
+        fclose(c->out);
+        close(fd);
+    }
+
+    free(c);
+    free(out_buf);
+    return NULL;
+}
+
+int gifserver_run(gifserver *server, const gifserver_handler *handler, void **users, int worker_count) {
+    // a client closing its end early must not stop the server
+    signal(SIGPIPE, SIG_IGN);
+
+    server->handler = handler;
+    server->workers = calloc(worker_count, sizeof(gifserver_worker));
+    if (server->workers == NULL)
+        return GIFSERVER_ALLOC_FAILURE;
+    server->worker_count = worker_count;
+
+    int started = 0;
+    for (int i = 0; i < worker_count; i++) {
+        server->workers[i].server = server;
+        server->workers[i].user = users[i];
+        if (pthread_create(&server->workers[i].thread, NULL, &server_worker_run, &server->workers[i]) != 0)
+            break;
+        started++;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(server->workers[i].thread, NULL);
+
+    for (int i = 0; i < worker_count; i++)
+        free(server->workers[i].data);
+    free(server->workers);
+    server->workers = NULL;
+    return started > 0 ? GIFSERVER_IO_ERROR : GIFSERVER_ALLOC_FAILURE;
+}
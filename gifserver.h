@@ -0,0 +1,98 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_SERVER_H
+#define GIFMETADATA_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// a unix socket server answering requests with a fixed pool of workers,
+// each serving one connection at a time with its own handler state. a
+// connection sends requests one after another without waiting for the
+// replies, which are written in order and sent once every request received
+// so far has been answered:
+//
+// PATH <path>\n             a file to read
+// DATA <length>\n<bytes>    a gif sent whole
+//
+// any other line, or one longer than GIFSERVER_READ_SIZE, is answered as an
+// invalid request. a connection is closed after a DATA length that is not a
+// number up to GIFSERVER_MAX_DATA, as its bytes cannot be told apart from the
+// requests that follow
+
+#define GIFSERVER_SUCCESS 0
+#define GIFSERVER_IO_ERROR -1
+#define GIFSERVER_ALLOC_FAILURE -2
+// another server is listening on the socket path
+#define GIFSERVER_IN_USE -3
+
+// requests are read in runs of up to this size, which also bounds a line
+#define GIFSERVER_READ_SIZE 65536
+// replies are buffered up to this size before being sent
+#define GIFSERVER_WRITE_SIZE (1 << 20)
+// largest gif accepted with DATA
+#define GIFSERVER_MAX_DATA (64 << 20)
+
+#define GIFSERVER_REQUEST_PATH 1
+#define GIFSERVER_REQUEST_DATA 2
+#define GIFSERVER_REQUEST_INVALID 3
+
+typedef struct gifserver_request {
+    int type;
+    // NUL terminated, for GIFSERVER_REQUEST_PATH
+    const char *path;
+    // for GIFSERVER_REQUEST_DATA, owned by the worker and reused
+    unsigned char *data;
+    size_t data_len;
+    // why a GIFSERVER_REQUEST_INVALID request was refused
+    const char *error;
+} gifserver_request;
+
+typedef struct gifserver_handler {
+    // optional, writes what every connection starts with
+    void (*open)(void *user, FILE *out);
+    // writes the reply to a request
+    void (*request)(void *user, const gifserver_request *request, FILE *out);
+} gifserver_handler;
+
+typedef struct gifserver_worker {
+    struct gifserver *server;
+    void *user;
+    pthread_t thread;
+    // DATA requests are read into this buffer, kept between requests
+    unsigned char *data;
+    size_t data_size;
+} gifserver_worker;
+
+typedef struct gifserver {
+    int fd;
+    const gifserver_handler *handler;
+    gifserver_worker *workers;
+    int worker_count;
+} gifserver;
+
+// Listens on a unix socket at path, replacing a socket left behind by a
+// server that is no longer running. *status is set on failure
+gifserver *gifserver_listen(const char *path, int *status);
+// Serves connections with a worker for every element of users, each only
+// ever handed its own user. Returns once every worker has stopped, which
+// only happens when accepting connections fails
+int gifserver_run(gifserver *server, const gifserver_handler *handler, void **users, int worker_count);
+void gifserver_free(gifserver *server);
+
+#endif
@@ -0,0 +1,425 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// saving and restoring a parser state between parse calls. every field is
+// written as a little endian 64 bit integer so that a state can be resumed by
+// a build for another architecture, and the whole is checked by a hash so a
+// torn or damaged checkpoint is refused rather than parsed from
+
+#include <string.h>
+
+#include "gifmetadata.h"
+
+typedef struct state_writer {
+    unsigned char *buffer;
+    size_t buffer_len;
+    size_t len;
+} state_writer;
+
+typedef struct state_reader {
+    const unsigned char *buffer;
+    size_t buffer_len;
+    size_t i;
+    // set once a read runs past the end, later reads return zero
+    int failed;
+} state_reader;
+
+// fnv-1a, as used for the checksum of the serialized state
+static uint64_t state_hash(const unsigned char *buffer, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ buffer[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// bytes are only stored while they fit, the length is always counted
+static void state_put(state_writer *w, const void *src, size_t len) {
+    if (w->len + len <= w->buffer_len)
+        memcpy(w->buffer + w->len, src, len);
+    w->len += len;
+}
+
+static void state_put_u64(state_writer *w, uint64_t v) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = v >> (i * 8);
+    state_put(w, bytes, 8);
+}
+
+static void state_put_i64(state_writer *w, int64_t v) {
+    state_put_u64(w, (uint64_t)v);
+}
+
+static const unsigned char *state_get(state_reader *r, size_t len) {
+    if (r->failed || len > r->buffer_len - r->i) {
+        r->failed = 1;
+        return NULL;
+    }
+    const unsigned char *bytes = r->buffer + r->i;
+    r->i += len;
+    return bytes;
+}
+
+static uint64_t state_get_u64(state_reader *r) {
+    const unsigned char *bytes = state_get(r, 8);
+    if (bytes == NULL)
+        return 0;
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= (uint64_t)bytes[i] << (i * 8);
+    return v;
+}
+
+static int64_t state_get_i64(state_reader *r) {
+    return (int64_t)state_get_u64(r);
+}
+
+// reads a signed value, failing the read when it lies outside min and max
+static int64_t state_get_range(state_reader *r, int64_t min, int64_t max) {
+    int64_t v = state_get_i64(r);
+    if (v < min || v > max) {
+        r->failed = 1;
+        return min;
+    }
+    return v;
+}
+
+// the scratchpad bytes that matter between parse calls. the header, screen
+// and image descriptors and a collected extension payload are held below
+// scratchpad_i, other states only use scratchpad_i as a count
+static size_t state_scratchpad_len(const gifmetadata_state *s) {
+    switch (s->read_state) {
+    case header:
+    case logical_screen_descriptor:
+    case image_descriptor:
+        break;
+    case known_extension:
+        if (s->payload_chunk_i < 0)
+            break;
+        return 0;
+    default:
+        return 0;
+    }
+    if (s->scratchpad_i <= 0)
+        return 0;
+    return (size_t)s->scratchpad_i < s->scratchpad_size ? (size_t)s->scratchpad_i : s->scratchpad_size;
+}
+
+static void state_put_lzw(state_writer *w, const gifmetadata_lzw *lzw) {
+    const gifmetadata_decode *r = &lzw->result;
+    state_put_i64(w, lzw->min_code_size);
+    state_put_i64(w, lzw->code_size);
+    state_put_i64(w, lzw->next_code);
+    state_put_i64(w, lzw->prev_code);
+    state_put_u64(w, lzw->bits);
+    state_put_i64(w, lzw->bit_count);
+    state_put_i64(w, lzw->done);
+    state_put_u64(w, lzw->adler_a);
+    state_put_u64(w, lzw->adler_b);
+    state_put_i64(w, lzw->adler_pending);
+    state_put_u64(w, r->index);
+    state_put_u64(w, r->pixels);
+    state_put_u64(w, r->expected_pixels);
+    state_put_u64(w, r->errors);
+    for (int i = 0; i < 256; i++)
+        state_put_u64(w, r->histogram[i]);
+
+    // only the codes defined since the last clear, the rest follows from
+    // them. a decoder that has stopped takes no more codes
+    if (lzw->done)
+        return;
+    int first_code = (1 << lzw->min_code_size) + 2;
+    for (int code = first_code; code < lzw->next_code; code++) {
+        state_put_u64(w, lzw->prefix[code]);
+        state_put_u64(w, lzw->suffix[code]);
+    }
+}
+
+static int state_get_lzw(state_reader *r, gifmetadata_lzw *lzw) {
+    int min_code_size = state_get_range(r, 0, 255);
+    int code_size = state_get_range(r, 0, 12);
+    int next_code = state_get_range(r, 0, GIFMETADATA_LZW_CODES);
+    int prev_code = state_get_range(r, -1, GIFMETADATA_LZW_CODES - 1);
+    uint64_t bits = state_get_u64(r);
+    int bit_count = state_get_range(r, 0, 11);
+    int done = state_get_range(r, 0, 1);
+    uint64_t adler_a = state_get_range(r, 0, UINT32_MAX);
+    uint64_t adler_b = state_get_range(r, 0, UINT32_MAX);
+    uint64_t adler_pending = state_get_range(r, 0, GIFMETADATA_ADLER_NMAX);
+    size_t index = state_get_u64(r);
+    size_t pixels = state_get_u64(r);
+    size_t expected_pixels = state_get_u64(r);
+    unsigned int errors = state_get_u64(r);
+    if (r->failed)
+        return 0;
+    // only the bits not yet taken as a code are kept, and pixels past the
+    // end of the frame are never counted
+    if (bits >> bit_count != 0 || pixels > expected_pixels)
+        return 0;
+    // the sums are reduced below the modulus, then grow by at most 255 a
+    // pixel. anything larger could overflow before the next reduction
+    uint64_t a_max = GIFMETADATA_ADLER_MOD - 1 + 255 * adler_pending;
+    uint64_t b_max = (adler_pending + 1) * (GIFMETADATA_ADLER_MOD - 1) + 255 * adler_pending * (adler_pending + 1) / 2;
+    if (adler_a > a_max || adler_b > b_max)
+        return 0;
+
+    // sets up the color index codes, or marks an invalid minimum code size
+    gifmetadata_lzw_begin(lzw, min_code_size, index, expected_pixels);
+    for (int i = 0; i < 256; i++)
+        lzw->result.histogram[i] = state_get_range(r, 0, UINT32_MAX);
+    if (lzw->done && !done)
+        return 0;
+
+    if (!done) {
+        // the clear and end codes are never a previous code or a prefix
+        int first_code = (1 << min_code_size) + 2;
+        if (code_size <= min_code_size || bit_count >= code_size || next_code < first_code)
+            return 0;
+        if (prev_code >= next_code || prev_code == first_code - 2 || prev_code == first_code - 1)
+            return 0;
+        // a code's prefix was always defined before it
+        for (int code = first_code; code < next_code; code++) {
+            int prefix = state_get_range(r, 0, code - 1);
+            if (prefix == first_code - 2 || prefix == first_code - 1)
+                r->failed = 1;
+            lzw->prefix[code] = prefix;
+            lzw->suffix[code] = state_get_range(r, 0, 255);
+            lzw->first[code] = lzw->first[prefix];
+            lzw->length[code] = lzw->length[prefix] + 1;
+        }
+    }
+    lzw->code_size = code_size;
+    lzw->next_code = next_code;
+    lzw->prev_code = prev_code;
+    lzw->bits = bits;
+    lzw->bit_count = bit_count;
+    lzw->done = done;
+    lzw->adler_a = adler_a;
+    lzw->adler_b = adler_b;
+    lzw->adler_pending = adler_pending;
+    lzw->result.pixels = pixels;
+    lzw->result.errors = errors;
+    return !r->failed;
+}
+
+size_t gifmetadata_state_serialize(const gifmetadata_state *s, unsigned char *buffer, size_t buffer_len) {
+    state_writer w = { buffer, buffer_len, 0 };
+    const gifmetadata_stats *st = &s->stats;
+    const gifmetadata_frame *f = &s->frame;
+
+    state_put(&w, GIFMETADATA_STATE_MAGIC, 8);
+    state_put_u64(&w, GIFMETADATA_STATE_VERSION);
+
+    state_put_i64(&w, s->read_state);
+    state_put_u64(&w, s->flags);
+    state_put_u64(&w, s->query);
+    state_put_i64(&w, s->query_comments);
+    state_put_u64(&w, s->query_found);
+    state_put_u64(&w, s->file_i);
+    state_put_u64(&w, s->skip_len);
+    state_put_i64(&w, s->color_table_size);
+    state_put_i64(&w, s->color_table_len);
+    state_put_i64(&w, s->scratchpad_i);
+    state_put_i64(&w, s->scratchpad_len);
+    // only meaningful within an extension payload, where the end of the
+    // parse call has already moved it to the scratchpad or the next chunk
+    state_put_i64(&w, s->read_state == known_extension ? s->payload_chunk_i : -1);
+    state_put_i64(&w, s->payload_flushed);
+    state_put_i64(&w, s->payload_subblock);
+    state_put_u64(&w, s->block_file_i);
+    state_put_i64(&w, s->skip_state);
+    state_put_i64(&w, s->local_lsd_state);
+    state_put_i64(&w, s->local_extension_type);
+    state_put_i64(&w, s->global_color_table_flag);
+    state_put_i64(&w, s->color_resolution);
+    state_put_u64(&w, s->canvas_width);
+    state_put_u64(&w, s->canvas_height);
+    state_put_i64(&w, s->comments);
+    state_put_u64(&w, s->frames);
+    state_put_u64(&w, s->frame_pixels);
+    state_put_i64(&w, s->loop_count);
+    state_put_i64(&w, s->loop_extension);
+    state_put(&w, s->loop_bytes, sizeof(s->loop_bytes));
+    state_put_i64(&w, s->gif_version);
+
+    state_put_u64(&w, f->index);
+    state_put_u64(&w, f->offset);
+    state_put_i64(&w, f->left);
+    state_put_i64(&w, f->top);
+    state_put_i64(&w, f->width);
+    state_put_i64(&w, f->height);
+    state_put_i64(&w, f->interlaced);
+    state_put_i64(&w, f->local_color_table_len);
+    state_put_i64(&w, f->has_control);
+    state_put_i64(&w, f->delay);
+    state_put_i64(&w, f->disposal);
+    state_put_i64(&w, f->user_input);
+    state_put_i64(&w, f->transparent_index);
+
+    for (int i = 0; i < GIFMETADATA_READ_STATES; i++)
+        state_put_u64(&w, st->state_bytes[i]);
+    for (int i = 0; i < GIFMETADATA_READ_STATES; i++)
+        state_put_u64(&w, st->state_ns[i]);
+    state_put_u64(&w, st->blocks);
+    state_put_u64(&w, st->subblocks);
+    state_put_u64(&w, st->frames);
+    state_put_u64(&w, st->scratchpad_reallocs);
+    state_put_u64(&w, st->extension_callbacks);
+    state_put_u64(&w, st->state_callbacks);
+    state_put_u64(&w, st->payload_callbacks);
+
+    size_t scratchpad_len = state_scratchpad_len(s);
+    state_put_u64(&w, scratchpad_len);
+    state_put(&w, s->scratchpad, scratchpad_len);
+
+    // the decoder is only saved part way through a frame
+    int decoding = s->lzw != NULL && s->lzw->active;
+    state_put_i64(&w, decoding);
+    if (decoding)
+        state_put_lzw(&w, s->lzw);
+
+    if (w.len + 8 <= buffer_len)
+        state_put_u64(&w, state_hash(buffer, w.len));
+    else
+        w.len += 8;
+    return w.len;
+}
+
+int gifmetadata_state_deserialize(gifmetadata_state *s, const unsigned char *buffer, size_t buffer_len) {
+    if (buffer_len < 16 || memcmp(buffer, GIFMETADATA_STATE_MAGIC, 8) != 0)
+        return GIFMETADATA_INVALID_STATE;
+    state_reader r = { buffer, buffer_len - 8, 8, 0 };
+    state_reader hash_r = { buffer, buffer_len, buffer_len - 8, 0 };
+    if (state_get_u64(&r) != GIFMETADATA_STATE_VERSION)
+        return GIFMETADATA_INVALID_STATE;
+    if (state_get_u64(&hash_r) != state_hash(buffer, buffer_len - 8))
+        return GIFMETADATA_INVALID_STATE;
+
+    // the scratchpad and decoder are reused, the rest is replaced
+    gifmetadata_state_reset(s);
+    gifmetadata_stats *st = &s->stats;
+    gifmetadata_frame *f = &s->frame;
+
+    s->read_state = state_get_range(&r, header, GIFMETADATA_READ_STATES - 1);
+    s->flags = state_get_u64(&r);
+    s->query = state_get_u64(&r);
+    s->query_comments = state_get_range(&r, 0, INT32_MAX);
+    s->query_found = state_get_u64(&r);
+    s->file_i = state_get_u64(&r);
+    s->skip_len = state_get_u64(&r);
+    s->color_table_size = state_get_range(&r, 0, INT32_MAX);
+    s->color_table_len = state_get_range(&r, 0, INT32_MAX);
+    s->scratchpad_i = state_get_range(&r, 0, INT32_MAX);
+    s->scratchpad_len = state_get_range(&r, 0, INT32_MAX);
+    s->payload_chunk_i = state_get_range(&r, -1, 0);
+    s->payload_flushed = state_get_range(&r, 0, INT32_MAX);
+    s->payload_subblock = state_get_range(&r, 0, INT32_MAX);
+    s->block_file_i = state_get_u64(&r);
+    s->skip_state = state_get_range(&r, header, GIFMETADATA_READ_STATES - 1);
+    s->local_lsd_state = state_get_range(&r, width, pixel_aspect_ratio);
+    s->local_extension_type = state_get_range(&r, plain_text, comment);
+    s->global_color_table_flag = state_get_range(&r, -1, 1);
+    s->color_resolution = state_get_range(&r, -1, INT32_MAX);
+    s->canvas_width = state_get_range(&r, 0, UINT16_MAX);
+    s->canvas_height = state_get_range(&r, 0, UINT16_MAX);
+    s->comments = state_get_range(&r, 0, INT32_MAX);
+    s->frames = state_get_u64(&r);
+    s->frame_pixels = state_get_u64(&r);
+    s->loop_count = state_get_range(&r, -1, UINT16_MAX);
+    s->loop_extension = state_get_range(&r, 0, 1);
+    const unsigned char *loop_bytes = state_get(&r, sizeof(s->loop_bytes));
+    if (loop_bytes != NULL)
+        memcpy(s->loop_bytes, loop_bytes, sizeof(s->loop_bytes));
+    s->gif_version = state_get_range(&r, 0, gif89a);
+
+    f->index = state_get_u64(&r);
+    f->offset = state_get_u64(&r);
+    f->left = state_get_range(&r, 0, UINT16_MAX);
+    f->top = state_get_range(&r, 0, UINT16_MAX);
+    f->width = state_get_range(&r, 0, UINT16_MAX);
+    f->height = state_get_range(&r, 0, UINT16_MAX);
+    f->interlaced = state_get_range(&r, 0, 1);
+    f->local_color_table_len = state_get_range(&r, 0, INT32_MAX);
+    f->has_control = state_get_range(&r, 0, 1);
+    f->delay = state_get_range(&r, 0, UINT16_MAX);
+    f->disposal = state_get_range(&r, 0, 7);
+    f->user_input = state_get_range(&r, 0, 1);
+    f->transparent_index = state_get_range(&r, -1, 255);
+
+    for (int i = 0; i < GIFMETADATA_READ_STATES; i++)
+        st->state_bytes[i] = state_get_u64(&r);
+    for (int i = 0; i < GIFMETADATA_READ_STATES; i++)
+        st->state_ns[i] = state_get_u64(&r);
+    st->blocks = state_get_u64(&r);
+    st->subblocks = state_get_u64(&r);
+    st->frames = state_get_u64(&r);
+    st->scratchpad_reallocs = state_get_u64(&r);
+    st->extension_callbacks = state_get_u64(&r);
+    st->state_callbacks = state_get_u64(&r);
+    st->payload_callbacks = state_get_u64(&r);
+
+    size_t scratchpad_len = state_get_u64(&r);
+    const unsigned char *scratchpad = state_get(&r, scratchpad_len);
+    if (r.failed || scratchpad_len > (size_t)s->scratchpad_i)
+        goto invalid;
+    // the descriptors are written into the scratchpad without checking its
+    // size, and sub-blocks up to scratchpad_len. the largest length read is
+    // that of a color table
+    if ((s->read_state == header && s->scratchpad_i > 6) ||
+        (s->read_state == logical_screen_descriptor && s->scratchpad_i > 1) ||
+        (s->read_state == image_descriptor && s->scratchpad_i > 8) ||
+        s->scratchpad_len > 3 * 256)
+        goto invalid;
+    // a payload left in the chunk starts at the next one, so nothing of the
+    // current sub-block can be waiting to be delivered from it
+    if (s->read_state == known_extension && s->payload_chunk_i == 0) {
+        if ((s->flags & GIFMETADATA_FLAG_STREAM_PAYLOAD) ? s->payload_flushed != s->scratchpad_i : s->scratchpad_i != 0)
+            goto invalid;
+    }
+    // and a payload collected in the scratchpad is handed over whole
+    if (s->read_state == known_extension && s->payload_chunk_i < 0 && scratchpad_len != (size_t)s->scratchpad_i)
+        goto invalid;
+    size_t needed = scratchpad_len > (size_t)s->scratchpad_len ? scratchpad_len : (size_t)s->scratchpad_len;
+    if (s->scratchpad_size < needed + 1) {
+        size_t size = (needed / SCRATCHPAD_CHUNK_SIZE + 1) * SCRATCHPAD_CHUNK_SIZE;
+        unsigned char *grown = s->allocator->resize(s->allocator->user, s->scratchpad, s->scratchpad_size, size);
+        if (grown == NULL)
+            return GIFMETADATA_ALLOC_FAILED;
+        s->scratchpad = grown;
+        s->scratchpad_size = size;
+    }
+    memcpy(s->scratchpad, scratchpad, scratchpad_len);
+
+    int decoding = state_get_range(&r, 0, 1);
+    if (decoding) {
+        if (s->lzw == NULL) {
+            s->lzw = s->allocator->alloc(s->allocator->user, sizeof(gifmetadata_lzw));
+            if (s->lzw == NULL)
+                return GIFMETADATA_ALLOC_FAILED;
+        }
+        if (!state_get_lzw(&r, s->lzw))
+            goto invalid;
+    }
+    if (r.failed || r.i != r.buffer_len)
+        goto invalid;
+
+    s->chunk_file_i = s->file_i;
+    return GIFMETADATA_SUCCESS;
+
+invalid:
+    gifmetadata_state_reset(s);
+    return GIFMETADATA_INVALID_STATE;
+}
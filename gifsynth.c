@@ -0,0 +1,239 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "gifsynth.h"
+
+const gifsynth_case gifsynth_cases[] = {
+    // one large still, most of the file is a single image data chain
+    { "still", { 1920, 1080, 1, 256, 0, 1, 64, 0, 0, 0, 1 } },
+    // tiny files where the per-file cost dominates
+    { "icon", { 32, 32, 1, 16, 0, 0, 0, 0, 0, 0, 2 } },
+    // a typical animation, local tables on every other frame
+    { "anim", { 320, 240, 200, 256, 256, 1, 32, 1, 0, 0, 3 } },
+    // many small frames, lots of blocks and short chains
+    { "anim-10k", { 64, 64, 10000, 64, 0, 0, 0, 1, 0, 0, 4 } },
+    // metadata heavy, many multi sub-block comments
+    { "comments", { 320, 240, 10, 256, 0, 200, 2000, 0, 0, 0, 5 } },
+    // metadata heavy, many application extensions such as xmp packets
+    { "apps", { 320, 240, 10, 256, 0, 0, 0, 50, 4096, 0, 6 } },
+    // no global table, every frame brings its own
+    { "no-gct", { 320, 240, 50, 0, 128, 0, 0, 1, 0, 0, 7 } },
+    // image data that decodes, for timing GIFMETADATA_FLAG_DECODE
+    { "pixels", { 320, 240, 20, 256, 64, 0, 0, 1, 0, 0, 8, 1 } },
+    { NULL }
+};
+
+const gifsynth_case *gifsynth_find_case(const char *name) {
+    for (const gifsynth_case *c = gifsynth_cases; c->name != NULL; c++) {
+        if (strcmp(c->name, name) == 0)
+            return c;
+    }
+    return NULL;
+}
+
+void synth_put(gifsynth_buf *b, const void *src, size_t len) {
+    if (b->failed)
+        return;
+    if (b->len + len > b->size) {
+        size_t size = (b->len + len) * 2;
+        unsigned char *data = realloc(b->data, size);
+        if (data == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->data = data;
+        b->size = size;
+    }
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+}
+
+void synth_put_byte(gifsynth_buf *b, unsigned char byte) {
+    synth_put(b, &byte, 1);
+}
+
+void synth_put_u16(gifsynth_buf *b, uint16_t v) {
+    synth_put_byte(b, v & 0xff);
+    synth_put_byte(b, v >> 8);
+}
+
+unsigned char synth_rand(uint32_t *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+// size bits of the packed fields for a table of n entries, which hold
+// 2^(bits+1) entries
+int synth_table_bits(int n) {
+    int bits = 0;
+    while ((2 << bits) < n && bits < 7)
+        bits++;
+    return bits;
+}
+
+void synth_put_table(gifsynth_buf *b, int n, uint32_t *seed) {
+    for (int i = 0; i < (2 << synth_table_bits(n)) * 3; i++)
+        synth_put_byte(b, synth_rand(seed));
+}
+
+// writes len bytes as 255 byte sub-blocks and the terminator, the bytes are
+// noise or when text is set printable characters
+void synth_put_subblocks(gifsynth_buf *b, size_t len, uint32_t *seed, int text) {
+    while (len > 0) {
+        unsigned char sub_len = len > 255 ? 255 : len;
+        synth_put_byte(b, sub_len);
+        for (int i = 0; i < sub_len; i++) {
+            unsigned char byte = synth_rand(seed);
+            synth_put_byte(b, text ? 'a' + byte % 26 : byte);
+        }
+        len -= sub_len;
+    }
+    synth_put_byte(b, 0);
+}
+
+void synth_put_comment(gifsynth_buf *b, size_t len, uint32_t *seed) {
+    synth_put_byte(b, 0x21);
+    synth_put_byte(b, 0xfe);
+    synth_put_subblocks(b, len, seed, 1);
+}
+
+void synth_put_application(gifsynth_buf *b, int index, size_t len, uint32_t *seed) {
+    if (index == 0) {
+        const unsigned char netscape[] = { 0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S',
+            'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+        synth_put(b, netscape, sizeof(netscape));
+        return;
+    }
+    const unsigned char xmp[] = { 0x21, 0xff, 0x0b, 'X', 'M', 'P', ' ',
+        'D', 'a', 't', 'a', 'X', 'M', 'P' };
+    synth_put(b, xmp, sizeof(xmp));
+    synth_put_subblocks(b, len, seed, 1);
+}
+
+// codes packed into image data sub-blocks
+typedef struct synth_lzw {
+    unsigned char block[255];
+    int block_len;
+    uint32_t bits;
+    int bit_count;
+} synth_lzw;
+
+void synth_put_code(gifsynth_buf *b, synth_lzw *w, int code, int code_size) {
+    w->bits |= (uint32_t)code << w->bit_count;
+    w->bit_count += code_size;
+    while (w->bit_count >= 8) {
+        w->block[w->block_len++] = w->bits & 0xff;
+        w->bits >>= 8;
+        w->bit_count -= 8;
+        if (w->block_len == 255) {
+            synth_put_byte(b, 255);
+            synth_put(b, w->block, 255);
+            w->block_len = 0;
+        }
+    }
+}
+
+// writes pixels of noise below colors as lzw data that is never compressed,
+// one 9 bit literal code per pixel and a clear code every 254 pixels, before
+// the table grows to need 10 bit codes
+void synth_put_lzw(gifsynth_buf *b, size_t pixels, int colors, uint32_t *seed) {
+    synth_lzw w = { { 0 }, 0, 0, 0 };
+    synth_put_byte(b, 8);
+    for (size_t i = 0; i < pixels; i++) {
+        if (i % 254 == 0)
+            synth_put_code(b, &w, 0x100, 9);
+        synth_put_code(b, &w, synth_rand(seed) % colors, 9);
+    }
+    // end of information, padded out to a byte
+    synth_put_code(b, &w, 0x101, 9);
+    if (w.bit_count > 0)
+        synth_put_code(b, &w, 0, 8 - w.bit_count);
+    if (w.block_len > 0) {
+        synth_put_byte(b, w.block_len);
+        synth_put(b, w.block, w.block_len);
+    }
+    synth_put_byte(b, 0);
+}
+
+int gifsynth_make(gifsynth_buf *b, const gifsynth_params *p, size_t *chains) {
+    uint32_t seed = p->seed;
+    size_t frame_data_len = p->frame_data_len;
+    if (frame_data_len == 0)
+        frame_data_len = (size_t)p->width * p->height / 2;
+
+    synth_put(b, "GIF89a", 6);
+    synth_put_u16(b, p->width);
+    synth_put_u16(b, p->height);
+    if (p->gct_size > 0) {
+        synth_put_byte(b, 0xf0 | synth_table_bits(p->gct_size));
+        synth_put_byte(b, 0);
+        synth_put_byte(b, 0);
+        synth_put_table(b, p->gct_size, &seed);
+    } else {
+        synth_put_byte(b, 0x70);
+        synth_put_byte(b, 0);
+        synth_put_byte(b, 0);
+    }
+
+    for (int a = 0; a < p->applications; a++)
+        synth_put_application(b, a, p->app_len, &seed);
+
+    int c = 0;
+    for (int f = 0; f < p->frames; f++) {
+        // comments fall evenly between the frames
+        while (c < p->comments && (size_t)c * p->frames <= (size_t)f * p->comments) {
+            synth_put_comment(b, p->comment_len, &seed);
+            c++;
+        }
+
+        const unsigned char gce[] = { 0x21, 0xf9, 0x04, 0x04, 0x0a, 0x00, 0x00, 0x00 };
+        synth_put(b, gce, sizeof(gce));
+
+        synth_put_byte(b, 0x2c);
+        synth_put_u16(b, 0);
+        synth_put_u16(b, 0);
+        synth_put_u16(b, p->width);
+        synth_put_u16(b, p->height);
+        // frames without a global table always need a local one
+        int lct_size = p->lct_size > 0 && (f % 2 || p->gct_size == 0) ? p->lct_size : 0;
+        if (lct_size > 0) {
+            synth_put_byte(b, 0x80 | synth_table_bits(lct_size));
+            synth_put_table(b, lct_size, &seed);
+        } else {
+            synth_put_byte(b, 0);
+        }
+
+        if (p->lzw) {
+            // pixels have to index the table in use
+            int colors = 2 << synth_table_bits(lct_size > 0 ? lct_size : p->gct_size);
+            if (chains != NULL)
+                chains[f] = b->len + 1;
+            synth_put_lzw(b, (size_t)p->width * p->height, colors, &seed);
+            continue;
+        }
+        synth_put_byte(b, 8);
+        if (chains != NULL)
+            chains[f] = b->len;
+        synth_put_subblocks(b, frame_data_len, &seed, 0);
+    }
+    for (; c < p->comments; c++)
+        synth_put_comment(b, p->comment_len, &seed);
+
+    synth_put_byte(b, 0x3b);
+    return !b->failed;
+}
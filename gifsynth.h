@@ -0,0 +1,73 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_SYNTH_H
+#define GIFMETADATA_SYNTH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// synthetic gifs for gifbench and gifgen. the output only depends on the
+// parameters so results are comparable between releases. image data is noise
+// standing in for lzw data unless lzw is set
+
+typedef struct gifsynth_buf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    // set once an allocation has failed, later writes are dropped
+    int failed;
+} gifsynth_buf;
+
+typedef struct gifsynth_params {
+    uint16_t width;
+    uint16_t height;
+    int frames;
+    // color table entries, a power of two from 2 to 256 or zero for none. the
+    // local table is used by every other frame
+    int gct_size;
+    int lct_size;
+    // comments spread evenly between the frames, keep comment_len under
+    // 2560 unless parsing with GIFMETADATA_FLAG_STREAM_PAYLOAD
+    int comments;
+    size_t comment_len;
+    // application extensions, the first is a NETSCAPE2.0 loop and the rest
+    // carry app_len bytes of data each
+    int applications;
+    size_t app_len;
+    // image data bytes per frame, zero for half the canvas area
+    size_t frame_data_len;
+    uint32_t seed;
+    // image data is valid lzw data of noise pixels instead, see
+    // GIFMETADATA_FLAG_DECODE. frame_data_len is not used
+    int lzw;
+} gifsynth_params;
+
+typedef struct gifsynth_case {
+    const char *name;
+    gifsynth_params params;
+} gifsynth_case;
+
+// the benchmark corpus, terminated by an entry with a NULL name
+extern const gifsynth_case gifsynth_cases[];
+
+const gifsynth_case *gifsynth_find_case(const char *name);
+
+// appends a gif to b, returns zero on allocation failure. the offset of each
+// frame's first image data sub-block is stored in chains when not NULL
+int gifsynth_make(gifsynth_buf *b, const gifsynth_params *p, size_t *chains);
+
+#endif
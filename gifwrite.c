@@ -0,0 +1,389 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// copy_file_range
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "gifwrite.h"
+
+typedef struct first_block {
+    off_t offset;
+    int found;
+} first_block;
+
+void first_block_state_cb(void *user, gifmetadata_state *s, enum gifmetadata_read_state state) {
+    first_block *fb = user;
+    if (!fb->found && state != searching && state > global_color_table) {
+        // the current byte starts the block
+        fb->offset = s->file_i - 1;
+        fb->found = 1;
+    }
+}
+
+int gifwrite_find_first_block(gifmetadata_state *s, int fd, off_t *offset) {
+    unsigned char buf[GIFWRITE_HEADER_WINDOW];
+    size_t len = 0;
+    while (len < sizeof(buf)) {
+        ssize_t b = pread(fd, buf + len, sizeof(buf) - len, len);
+        if (b < 0) {
+            if (errno == EINTR)
+                continue;
+            return GIFMETADATA_IO_ERROR;
+        }
+        if (b == 0)
+            break;
+        len += b;
+    }
+
+    first_block fb = { -1, 0 };
+    gifmetadata_callbacks cb = { .state_cb = &first_block_state_cb, .user = &fb };
+    int parse_status = gifmetadata_parse_gif_v2(s, buf, len, &cb);
+    *offset = fb.offset;
+    return parse_status;
+}
+
+int gifwrite_copy_range(int in_fd, off_t offset, int out_fd, size_t len) {
+    // each method is dropped once the files turn out not to support it, e.g.
+    // copy_file_range across filesystems or to a pipe and sendfile to a tty
+    int use_copy_file_range = 1;
+    int use_sendfile = 1;
+    unsigned char *buf = NULL;
+
+    while (len > 0) {
+        ssize_t n;
+        if (use_copy_file_range) {
+            loff_t in_off = offset;
+            n = copy_file_range(in_fd, &in_off, out_fd, NULL, len, 0);
+            if (n < 0 && errno != EINTR && errno != EIO && errno != ENOSPC) {
+                use_copy_file_range = 0;
+                continue;
+            }
+        } else if (use_sendfile) {
+            off_t in_off = offset;
+            n = sendfile(out_fd, in_fd, &in_off, len);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            if (buf == NULL) {
+                buf = malloc(GIFWRITE_COPY_BUFFER_SIZE);
+                if (buf == NULL)
+                    return GIFWRITE_IO_ERROR;
+            }
+            size_t want = len < GIFWRITE_COPY_BUFFER_SIZE ? len : GIFWRITE_COPY_BUFFER_SIZE;
+            n = pread(in_fd, buf, want, offset);
+            for (ssize_t written = 0; n > 0 && written < n;) {
+                ssize_t w = write(out_fd, buf + written, n - written);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0) {
+                    free(buf);
+                    return GIFWRITE_IO_ERROR;
+                }
+                written += w;
+            }
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            // an error, or the input is shorter than it was
+            free(buf);
+            return GIFWRITE_IO_ERROR;
+        }
+        offset += n;
+        len -= n;
+    }
+
+    free(buf);
+    return GIFWRITE_SUCCESS;
+}
+
+int gifwrite_filler(unsigned char *buf, size_t len) {
+    if (len == 1 || len == 2 || len == 4)
+        return 0;
+    if (buf == NULL || len == 0)
+        return 1;
+
+    // one extension whose sub-blocks take up the rest, none of them may be
+    // left a single byte as a sub-block of no data is the terminator
+    size_t i = 0;
+    buf[i++] = 0x21;
+    buf[i++] = GIFWRITE_FILLER_LABEL;
+    size_t rest = len - 3;
+    while (rest > 0) {
+        size_t n = rest < 256 ? rest : 256;
+        if (rest - n == 1)
+            n--;
+        buf[i++] = n - 1;
+        memset(buf + i, 0, n - 1);
+        i += n - 1;
+        rest -= n;
+    }
+    buf[i] = 0;
+    return 1;
+}
+
+int write_all(int fd, const unsigned char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t w = offset >= 0 ? pwrite(fd, buf, len, offset) : write(fd, buf, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return GIFWRITE_IO_ERROR;
+        buf += w;
+        len -= w;
+        if (offset >= 0)
+            offset += w;
+    }
+    return GIFWRITE_SUCCESS;
+}
+
+int gifwrite_patch(int fd, const gifwrite_edit *edits, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (write_all(fd, edits[i].data, edits[i].data_len, edits[i].offset) != GIFWRITE_SUCCESS)
+            return GIFWRITE_IO_ERROR;
+    }
+    return GIFWRITE_SUCCESS;
+}
+
+int gifwrite_rewrite(int in_fd, off_t size, int out_fd, const gifwrite_edit *edits, size_t count) {
+    off_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (gifwrite_copy_range(in_fd, offset, out_fd, edits[i].offset - offset) != GIFWRITE_SUCCESS)
+            return GIFWRITE_IO_ERROR;
+        if (write_all(out_fd, edits[i].data, edits[i].data_len, -1) != GIFWRITE_SUCCESS)
+            return GIFWRITE_IO_ERROR;
+        offset = edits[i].offset + edits[i].remove_len;
+    }
+    if (offset < size)
+        return gifwrite_copy_range(in_fd, offset, out_fd, size - offset);
+    return GIFWRITE_SUCCESS;
+}
+
+int gifwrite_replace_file(const char *path, int in_fd, off_t size, const gifwrite_edit *edits, size_t count) {
+    size_t path_len = strlen(path);
+    char *tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+    if (tmp_path == NULL)
+        return GIFWRITE_IO_ERROR;
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int out_fd = mkstemp(tmp_path);
+    if (out_fd < 0) {
+        free(tmp_path);
+        return GIFWRITE_IO_ERROR;
+    }
+
+    // keep the permissions of the original, mkstemp creates files as 0600
+    struct stat st;
+    int failed = fstat(in_fd, &st) != 0 || fchmod(out_fd, st.st_mode & 07777) != 0;
+    failed = failed || gifwrite_rewrite(in_fd, size, out_fd, edits, count) != GIFWRITE_SUCCESS;
+    failed = failed || fsync(out_fd) != 0;
+    failed = close(out_fd) != 0 || failed;
+    failed = failed || rename(tmp_path, path) != 0;
+
+    if (failed)
+        unlink(tmp_path);
+    free(tmp_path);
+    return failed ? GIFWRITE_IO_ERROR : GIFWRITE_SUCCESS;
+}
+
+const char *gifwrite_scrub_keep[] = { "NETSCAPE2.0", "ANIMEXTS1.0", NULL };
+
+enum scrub_mode {
+    // writing the input through
+    scrub_copy,
+    // in an application extension until its identifier is known
+    scrub_hold,
+    // in a block being removed
+    scrub_drop
+};
+
+typedef struct scrub_run {
+    gifwrite_scrub *sc;
+    int out_fd;
+    enum scrub_mode mode;
+    // input offset up to which everything has been written or removed
+    size_t out_i;
+    // offset of the block being held or removed
+    size_t block_i;
+    // bytes of a held block from out_i that arrived in earlier chunks
+    unsigned char hold[GIFWRITE_SCRUB_ID_MAX + 4];
+    size_t hold_len;
+    unsigned char id[GIFWRITE_SCRUB_ID_MAX];
+    size_t id_len;
+    int inserted;
+    int failed;
+} scrub_run;
+
+void scrub_write(scrub_run *r, const unsigned char *buf, size_t len) {
+    if (!r->failed && len > 0 && write_all(r->out_fd, buf, len, -1) != GIFWRITE_SUCCESS)
+        r->failed = 1;
+}
+
+// writes the input from out_i up to the offset end, the part of it before
+// the current chunk is in the hold buffer
+void scrub_write_to(scrub_run *r, gifmetadata_state *s, size_t end) {
+    if (end <= r->out_i)
+        return;
+    if (r->hold_len > 0) {
+        scrub_write(r, r->hold, r->hold_len);
+        r->out_i = s->chunk_file_i;
+        r->hold_len = 0;
+    }
+    scrub_write(r, s->chunk + (r->out_i - s->chunk_file_i), end - r->out_i);
+    r->out_i = end;
+}
+
+// starts removing the current block, after writing what comes before it
+void scrub_drop_block(scrub_run *r, gifmetadata_state *s) {
+    scrub_write_to(r, s, r->block_i);
+    r->hold_len = 0;
+    r->mode = scrub_drop;
+}
+
+int scrub_removes_application(const scrub_run *r) {
+    const gifwrite_scrub *sc = r->sc;
+    if (sc->applications == NULL) {
+        for (const char **id = gifwrite_scrub_keep; *id != NULL; id++) {
+            if (strlen(*id) == r->id_len && memcmp(*id, r->id, r->id_len) == 0)
+                return 0;
+        }
+        return 1;
+    }
+    for (size_t i = 0; i < sc->applications_len; i++) {
+        if (strlen(sc->applications[i]) == r->id_len && memcmp(sc->applications[i], r->id, r->id_len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+void scrub_state_cb(void *user, gifmetadata_state *s, enum gifmetadata_read_state state) {
+    scrub_run *r = user;
+    if (!r->inserted && state != searching && state > global_color_table) {
+        scrub_write_to(r, s, s->block_file_i);
+        scrub_write(r, r->sc->insert, r->sc->insert_len);
+        r->inserted = 1;
+    }
+
+    if (state == extension && r->mode == scrub_copy) {
+        // nothing is written until the label is known, kept blocks are
+        // written with the run they are part of
+        r->mode = scrub_hold;
+        r->block_i = s->block_file_i;
+    } else if ((state == unknown_extension || state == control_extension) && r->mode == scrub_hold) {
+        r->mode = scrub_copy;
+    } else if (state == known_extension && r->mode == scrub_hold) {
+        if (s->local_extension_type == application)
+            r->id_len = 0;
+        else
+            scrub_drop_block(r, s);
+    }
+}
+
+void scrub_payload_cb(void *user, gifmetadata_state *s, const gifmetadata_payload *payload) {
+    scrub_run *r = user;
+    if (r->mode == scrub_hold) {
+        if (payload->event == payload_begin)
+            return;
+        if (payload->event == payload_data && payload->subblock == 0) {
+            size_t len = payload->buffer_len;
+            if (len > GIFWRITE_SCRUB_ID_MAX - r->id_len)
+                len = GIFWRITE_SCRUB_ID_MAX - r->id_len;
+            memcpy(r->id + r->id_len, payload->buffer, len);
+            r->id_len += len;
+            return;
+        }
+        // the identifier is complete
+        if (!scrub_removes_application(r)) {
+            r->mode = scrub_copy;
+            return;
+        }
+        scrub_drop_block(r, s);
+    }
+
+    if (r->mode == scrub_drop && payload->event == payload_end) {
+        r->out_i = payload->offset + 1;
+        r->sc->removed++;
+        r->sc->removed_bytes += r->out_i - r->block_i;
+        r->mode = scrub_copy;
+    }
+}
+
+// writes what can be written of a parsed chunk and holds on to the start of
+// an undecided block
+void scrub_chunk_end(scrub_run *r, gifmetadata_state *s) {
+    size_t chunk_end = s->chunk_file_i + s->chunk_len;
+    if (r->mode == scrub_copy) {
+        scrub_write_to(r, s, chunk_end);
+    } else if (r->mode == scrub_hold) {
+        scrub_write_to(r, s, r->block_i);
+        size_t from = r->out_i > s->chunk_file_i ? r->out_i : s->chunk_file_i;
+        memcpy(r->hold + r->hold_len, s->chunk + (from - s->chunk_file_i), chunk_end - from);
+        r->hold_len += chunk_end - from;
+    }
+}
+
+int gifwrite_scrub_fd(gifmetadata_state *s, int in_fd, int out_fd, gifwrite_scrub *sc, int *parse_status) {
+    unsigned char *buf = malloc(GIFWRITE_SCRUB_BUFFER_SIZE);
+    if (buf == NULL) {
+        *parse_status = GIFMETADATA_ALLOC_FAILED;
+        return GIFWRITE_SUCCESS;
+    }
+
+    scrub_run r;
+    memset(&r, 0, sizeof(scrub_run));
+    r.sc = sc;
+    r.out_fd = out_fd;
+    r.mode = scrub_copy;
+    r.out_i = s->file_i;
+    sc->removed = 0;
+    sc->removed_bytes = 0;
+
+    unsigned int flags = s->flags;
+    s->flags |= GIFMETADATA_FLAG_STREAM_PAYLOAD;
+    gifmetadata_callbacks cb = { .state_cb = &scrub_state_cb, .payload_cb = &scrub_payload_cb, .user = &r };
+
+    *parse_status = GIFMETADATA_SUCCESS;
+    while (!r.failed) {
+        ssize_t n = read(in_fd, buf, GIFWRITE_SCRUB_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            *parse_status = GIFMETADATA_IO_ERROR;
+        if (n <= 0)
+            break;
+        *parse_status = gifmetadata_parse_gif_v2(s, buf, n, &cb);
+        if (*parse_status != GIFMETADATA_SUCCESS)
+            break;
+        scrub_chunk_end(&r, s);
+    }
+    // a block cut off by the end of the input is kept as it is
+    if (*parse_status == GIFMETADATA_SUCCESS)
+        scrub_write(&r, r.hold, r.hold_len);
+
+    s->flags = flags;
+    free(buf);
+    return r.failed ? GIFWRITE_IO_ERROR : GIFWRITE_SUCCESS;
+}
@@ -0,0 +1,113 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_WRITE_H
+#define GIFMETADATA_WRITE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "gifmetadata.h"
+
+// helpers for writing gifs by copying the input around the few bytes that
+// change, rather than passing every byte through the parser
+
+#define GIFWRITE_SUCCESS 0
+#define GIFWRITE_IO_ERROR -1
+
+// bytes of a file read to find its first block, enough for the header, the
+// logical screen descriptor and the largest global color table
+#define GIFWRITE_HEADER_WINDOW 1024
+// buffer size when the copy cannot be made by the kernel
+#define GIFWRITE_COPY_BUFFER_SIZE (1 << 20)
+
+// read size when scrubbing, output is written in runs of up to this size
+#define GIFWRITE_SCRUB_BUFFER_SIZE (1 << 18)
+// longest application identifier sub-block kept while deciding whether to
+// remove the application extension
+#define GIFWRITE_SCRUB_ID_MAX 255
+
+// label of the extension padding out the space of removed comments. it is
+// not one of the gif89a labels, so readers pass over it as an unknown
+// extension rather than report it
+#define GIFWRITE_FILLER_LABEL 0xfa
+
+// replaces remove_len bytes of the input at offset with data
+typedef struct gifwrite_edit {
+    off_t offset;
+    size_t remove_len;
+    unsigned char *data;
+    size_t data_len;
+} gifwrite_edit;
+
+// Parses the start of a file into s and finds the offset of the first block
+// after the global color table, where new blocks can be inserted. Returns a
+// parse status, *offset is -1 when the block lies beyond the window
+int gifwrite_find_first_block(gifmetadata_state *s, int fd, off_t *offset);
+
+// Copies len bytes from offset in in_fd to the current position of out_fd,
+// with copy_file_range or sendfile where the files allow it and a buffered
+// copy otherwise
+int gifwrite_copy_range(int in_fd, off_t offset, int out_fd, size_t len);
+
+// Fills len bytes with an extension of GIFWRITE_FILLER_LABEL and NUL
+// sub-blocks, buf may be NULL to only check len. Returns zero when len is 1,
+// 2 or 4, which no extension adds up to
+int gifwrite_filler(unsigned char *buf, size_t len);
+
+// Writes the edits into fd with pwrite. Every edit must write as many bytes
+// as it removes, or extend past the end of the file
+int gifwrite_patch(int fd, const gifwrite_edit *edits, size_t count);
+
+// Writes the input of size bytes with the edits applied to out_fd, copying
+// the unchanged spans with gifwrite_copy_range. Edits are sorted by offset
+// and do not overlap
+int gifwrite_rewrite(int in_fd, off_t size, int out_fd, const gifwrite_edit *edits, size_t count);
+
+// Rewrites path with the edits applied through a temporary file in the same
+// directory that is renamed over it, so readers see the old or the new file
+int gifwrite_replace_file(const char *path, int in_fd, off_t size, const gifwrite_edit *edits, size_t count);
+
+// options and results of gifwrite_scrub
+typedef struct gifwrite_scrub {
+    // identifiers of the application extensions to remove, compared with
+    // the whole identifier sub-block e.g. "XMP DataXMP". when NULL every
+    // application extension is removed except the looping ones, see
+    // gifwrite_scrub_keep
+    const char **applications;
+    size_t applications_len;
+    // blocks written before the first block, e.g. new comments
+    const unsigned char *insert;
+    size_t insert_len;
+
+    // blocks removed and their bytes
+    size_t removed;
+    size_t removed_bytes;
+} gifwrite_scrub;
+
+// application identifiers kept when no others are given, NULL terminated
+extern const char *gifwrite_scrub_keep[];
+
+// Copies a gif from in_fd to out_fd in one pass, removing comments, plain
+// text and the chosen application extensions. The input is read in chunks
+// of GIFWRITE_SCRUB_BUFFER_SIZE and may be a pipe, the kept runs between
+// removed blocks are written whole. *parse_status is set to the parse
+// status, or GIFMETADATA_IO_ERROR when reading fails. Returns
+// GIFWRITE_IO_ERROR when writing fails
+int gifwrite_scrub_fd(gifmetadata_state *s, int in_fd, int out_fd, gifwrite_scrub *sc, int *parse_status);
+
+#endif
@@ -0,0 +1,84 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "jobs.h"
+
+jobs_queue *jobs_queue_new(size_t job_count, int workers) {
+    jobs_queue *q = malloc(sizeof(jobs_queue));
+    if (q == NULL)
+        return NULL;
+    q->workers = workers;
+    q->deques = malloc(sizeof(jobs_deque) * workers);
+    q->jobs = malloc(sizeof(size_t) * (job_count > 0 ? job_count : 1));
+    if (q->deques == NULL || q->jobs == NULL) {
+        free(q->deques);
+        free(q->jobs);
+        free(q);
+        return NULL;
+    }
+
+    // interleave the jobs so that every worker starts with the lowest
+    // indices, keeping ordered output flowing
+    size_t offset = 0;
+    for (int w = 0; w < workers; w++) {
+        jobs_deque *d = &q->deques[w];
+        pthread_mutex_init(&d->lock, NULL);
+        d->jobs = q->jobs + offset;
+        d->head = 0;
+        d->tail = 0;
+        for (size_t job = w; job < job_count; job += workers)
+            d->jobs[d->tail++] = job;
+        offset += d->tail;
+    }
+
+    return q;
+}
+
+void jobs_queue_free(jobs_queue *q) {
+    if (q == NULL)
+        return;
+    for (int w = 0; w < q->workers; w++)
+        pthread_mutex_destroy(&q->deques[w].lock);
+    free(q->deques);
+    free(q->jobs);
+    free(q);
+}
+
+int jobs_queue_next(jobs_queue *q, int worker, size_t *job) {
+    // own deque first, from the front
+    jobs_deque *d = &q->deques[worker];
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *job = d->jobs[d->head++];
+        pthread_mutex_unlock(&d->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    // then steal from the back of the others
+    for (int i = 1; i < q->workers; i++) {
+        d = &q->deques[(worker + i) % q->workers];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) {
+            *job = d->jobs[--d->tail];
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+// gifmetadata
+// Copyright (C) 2025  Harry Stanton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef GIFMETADATA_JOBS_H
+#define GIFMETADATA_JOBS_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// work-stealing queue over the job indices [0, job_count). each worker owns a
+// deque seeded with every n-th job, takes from its front and when empty
+// steals from the back of another worker's deque
+
+typedef struct jobs_deque {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head;
+    size_t tail;
+} jobs_deque;
+
+typedef struct jobs_queue {
+    int workers;
+    jobs_deque *deques;
+    size_t *jobs;
+} jobs_queue;
+
+jobs_queue *jobs_queue_new(size_t job_count, int workers);
+void jobs_queue_free(jobs_queue *q);
+// takes the next job for a worker, returns zero once every job is taken
+int jobs_queue_next(jobs_queue *q, int worker, size_t *job);
+
+#endif